@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "thread.h"
+#include "network.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define ALLOC_TASKS     20000
+#define ALLOC_BATCH     256     // tasks in flight between wait_all() calls
+#define ALLOC_THREADS   4
+
+// every operator new in the process is counted, library included
+
+static std::atomic<size_t> alloc_count{0};
+
+void *operator new(size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static std::atomic<size_t> alloc_ran{0};
+
+static void count_task(void *arg) {
+    alloc_ran.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void event_task(void *arg) {
+    cm_net::input_event *event = (cm_net::input_event *) arg;
+    alloc_ran.fetch_add(event->msg.size(), std::memory_order_relaxed);
+}
+
+static void submit_batches(cm_thread::pool &pool, void (*submit)(cm_thread::pool &)) {
+    for(int n = 0; n < ALLOC_TASKS; n += ALLOC_BATCH) {
+        for(int b = 0; b < ALLOC_BATCH; b++) submit(pool);
+        pool.wait_all();
+    }
+}
+
+// run the submit loop once to warm the free lists, then again counting
+static double allocs_per_task(cm_thread::pool &pool, void (*submit)(cm_thread::pool &)) {
+    submit_batches(pool, submit);
+    size_t before = alloc_count.load();
+    submit_batches(pool, submit);
+    return (double) (alloc_count.load() - before) / ALLOC_TASKS;
+}
+
+static void submit_add_task(cm_thread::pool &pool) {
+    pool.add_task(count_task, nullptr);
+}
+
+static void submit_execute(cm_thread::pool &pool) {
+    pool.execute([]() { alloc_ran.fetch_add(1, std::memory_order_relaxed); });
+}
+
+static void submit_execute_large(cm_thread::pool &pool) {
+    char pad[TASK_INLINE_SIZE * 2] = {1};
+    pool.execute([pad]() { alloc_ran.fetch_add(pad[0], std::memory_order_relaxed); });
+}
+
+static void submit_future(cm_thread::pool &pool) {
+    pool.submit([]() { return alloc_ran.fetch_add(1, std::memory_order_relaxed); });
+}
+
+// what pool_server does per read
+static void submit_input_event(cm_thread::pool &pool) {
+    static const char rbuf[512] = "GET / HTTP/1.1";
+    cm_net::input_event *event = cm_net::input_event::create(0);
+    event->msg.assign(rbuf, sizeof(rbuf));
+    pool.add_task(event_task, event, cm_net::input_event::release);
+}
+
+// heap allocations per task in steady state, by submit style and pool mode
+
+void alloc_benchmarks() {
+
+    struct { const char *name; void (*submit)(cm_thread::pool &); } styles[] = {
+        { "add_task", submit_add_task },
+        { "execute", submit_execute },
+        { "execute large", submit_execute_large },
+        { "submit future", submit_future },
+        { "input_event", submit_input_event }
+    };
+
+    cm_log::info("alloc: style         mode           allocs/task");
+
+    for(auto mode: { cm_thread::pool_mode::shared, cm_thread::pool_mode::work_stealing }) {
+        cm_thread::pool pool(ALLOC_THREADS, mode);
+        for(auto &s: styles) {
+            double allocs = allocs_per_task(pool, s.submit);
+            cm_log::info(cm_util::format("alloc: %-13s %-14s %11.4lf", s.name,
+                mode == cm_thread::pool_mode::shared ? "shared" : "work_stealing", allocs));
+        }
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "store.h"
+#include "journal.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define JOURNAL_BASE        "bench_journal"
+#define JOURNAL_WRITES      2000        // committed writes per thread
+#define JOURNAL_VALUE_SIZE  100
+#define RECOVER_KEYS        1000000
+
+struct journal_bench {
+    cm_store::info_store<std::string,std::string> store;
+    cm_store::journal journal;
+    std::string value;
+};
+
+// set + journal + commit per write, the way a durable cache server would
+static void journal_writer(int index, void *data) {
+    journal_bench *b = (journal_bench *) data;
+    for(int n = 0; n < JOURNAL_WRITES; n++) {
+        std::string key = cm_util::format("t%d:%d", index, n);
+        b->store.set(key, b->value);
+        b->journal.commit(b->journal.add(key, b->value));
+    }
+}
+
+static void remove_journal_files() {
+    unlink(JOURNAL_BASE ".log");
+    unlink(JOURNAL_BASE ".log.old");
+    unlink(JOURNAL_BASE ".snap");
+}
+
+// journaled write throughput: each write waits for its record to be
+// fdatasync'ed; group commit lets concurrent writers share one sync.
+// Then recovery time of a snapshot plus log tail.
+
+void journal_benchmarks() {
+
+    cm_log::info("journal: threads   writes/s    fsyncs  writes/fsync");
+
+    for(int threads = 1; threads <= 16; threads *= 2) {
+        remove_journal_files();
+        journal_bench b;
+        b.value.assign(JOURNAL_VALUE_SIZE, 'x');
+        if(b.journal.open(JOURNAL_BASE) != 0) {
+            cm_log::error("journal: open failed");
+            return;
+        }
+        uint64_t before = b.journal.sync_count();
+        double secs = run_threads(threads, journal_writer, &b);
+        uint64_t syncs = b.journal.sync_count() - before;
+        double writes = (double) threads * JOURNAL_WRITES;
+        cm_log::info(cm_util::format("journal: %7d %10.0lf %9lu %13.1lf",
+            threads, writes / secs, syncs, writes / (syncs ? syncs : 1)));
+    }
+
+    // recovery: snapshot of RECOVER_KEYS entries plus a 1% log tail
+    remove_journal_files();
+    {
+        journal_bench b;
+        b.value.assign(JOURNAL_VALUE_SIZE, 'x');
+        b.journal.open(JOURNAL_BASE);
+        for(int n = 0; n < RECOVER_KEYS; n++) {
+            b.store.set(cm_util::format("key%d", n), b.value);
+        }
+        b.journal.checkpoint(b.store);
+        for(int n = 0; n < RECOVER_KEYS / 100; n++) {
+            b.journal.add(cm_util::format("key%d", n), "tail");
+        }
+        b.journal.sync();
+    }
+
+    journal_bench r;
+    timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    r.journal.open(JOURNAL_BASE);
+    int records = r.journal.recover(r.store);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double secs = cm_time::duration(start, finish);
+
+    cm_log::info(cm_util::format("journal: recovered %d records (%lu entries) in %.3lf s, %.0lf records/s",
+        records, r.store.size(), secs, records / secs));
+
+    r.journal.close();
+    remove_journal_files();
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "timewatcher.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+struct bench_thread {
+    pthread_t tid;
+    int index;
+    void (*fn)(int, void*);
+    void *data;
+    pthread_barrier_t *barrier;
+};
+
+static void *bench_thread_handler(void *p) {
+    bench_thread *t = (bench_thread *) p;
+    pthread_barrier_wait(t->barrier);
+    t->fn(t->index, t->data);
+    return NULL;
+}
+
+double run_threads(int count, void (*fn)(int index, void *data), void *data) {
+
+    std::vector<bench_thread> threads(count);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, count + 1);
+
+    for(int n = 0; n < count; n++) {
+        threads[n].index = n;
+        threads[n].fn = fn;
+        threads[n].data = data;
+        threads[n].barrier = &barrier;
+        pthread_create(&threads[n].tid, NULL, bench_thread_handler, &threads[n]);
+    }
+
+    timespec start, finish;
+    pthread_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(auto &t: threads) {
+        pthread_join(t.tid, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    pthread_barrier_destroy(&barrier);
+
+    return cm_time::duration(start, finish);
+}
+
+// usage: benchmarks [group ...]
+// with no arguments every benchmark group is run
+
+static bool selected(int argc, char *argv[], const char *group) {
+    if(argc < 2) return true;
+    for(int n = 1; n < argc; n++) {
+        if(strcmp(argv[n], group) == 0) return true;
+    }
+    return false;
+}
+
+int main( int argc, char* argv[] ) {
+
+    cm_log::console.set_message_format("${date_time}${millis} [${lvl}]: ${msg}");
+
+    if(selected(argc, argv, "store")) store_benchmarks();
+    if(selected(argc, argv, "map")) map_benchmarks();
+    if(selected(argc, argv, "journal")) journal_benchmarks();
+    if(selected(argc, argv, "mapped")) mapped_benchmarks();
+    if(selected(argc, argv, "queue")) queue_benchmarks();
+    if(selected(argc, argv, "pool")) pool_benchmarks();
+    if(selected(argc, argv, "alloc")) alloc_benchmarks();
+    if(selected(argc, argv, "parallel")) parallel_benchmarks();
+    if(selected(argc, argv, "network")) network_benchmarks();
+
+}
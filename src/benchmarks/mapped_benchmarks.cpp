@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "record.h"
+#include "store.h"
+#include "mapped_store.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define MAPPED_RECORDS      1000000
+#define MAPPED_LOOKUPS      5000000
+#define MAPPED_PATH         "bench_mapped.map"
+
+template<class storeT>
+static double lookup_ns(storeT &store) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    size_t found = 0;
+    timespec start, finish;
+    char key[32];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int n = 0; n < MAPPED_LOOKUPS; n++) {
+        int len = snprintf(key, sizeof(key), "key%lu", bench_rand(state) % MAPPED_RECORDS);
+        found += store.check(std::string_view(key, len));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    if(found != MAPPED_LOOKUPS) {
+        cm_log::error(cm_util::format("mapped: %lu of %d keys found", found, MAPPED_LOOKUPS));
+    }
+    return cm_time::duration(start, finish) * 1e9 / MAPPED_LOOKUPS;
+}
+
+// cold start of a reference table: parsing the record file into an
+// info_store with load_records_to_store vs. opening a prebuilt mapped
+// store, then lookup cost of each
+
+void mapped_benchmarks() {
+
+    std::stringstream records;
+    for(int n = 0; n < MAPPED_RECORDS; n++) {
+        records << "key" << n << "|value" << n << "\n";
+    }
+
+    cm_record::record_spec spec("bench", "1.0");
+    cm_record::field key_field("key", "string", 0);
+    cm_record::field value_field("value", "string", 0);
+    spec.add_field(key_field);
+    spec.add_field(value_field);
+
+    // build the mapped file once (what the mkstore tool does)
+    {
+        cm_store::mapped_store_writer writer;
+        cm_record::record record(&spec);
+        std::istringstream is(records.str());
+        cm_record::load_records_to_store(is, record, "key", "value", &writer);
+        writer.write(MAPPED_PATH);
+    }
+
+    timespec start, finish;
+
+    cm_store::info_store<std::string,std::string> store;
+    cm_record::record record(&spec);
+    std::istringstream is(records.str());
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cm_record::load_records_to_store(is, record, "key", "value", &store);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double load_ms = cm_time::duration(start, finish) * 1e3;
+
+    cm_store::mapped_store mapped;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mapped.open(MAPPED_PATH);
+    mapped.check("key0");
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double open_ms = cm_time::duration(start, finish) * 1e3;
+
+    cm_log::info("mapped: store          entries   start ms   lookup ns/op");
+    cm_log::info(cm_util::format("mapped: %-12s %9lu %10.3lf %14.1lf",
+        "info_store", store.size(), load_ms, lookup_ns(store)));
+    cm_log::info(cm_util::format("mapped: %-12s %9lu %10.3lf %14.1lf",
+        "mapped_store", mapped.size(), open_ms, lookup_ns(mapped)));
+
+    mapped.close();
+    unlink(MAPPED_PATH);
+}
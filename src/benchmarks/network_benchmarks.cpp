@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "network.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define NET_PORT        56100
+#define NET_CONNS       64      // client connections
+#define NET_SENDERS     4       // client threads, NET_CONNS / NET_SENDERS each
+#define NET_MSG_SIZE    64
+#define NET_ROUNDS      1000    // round trips per connection
+#define NET_BULK_CONNS  16
+#define NET_BULK_BYTES  (8 * 1024 * 1024)  // streamed per connection
+#define NET_PIPE_CONNS  16
+#define NET_PIPE_DEPTH  100     // requests per write
+#define NET_PIPE_ROUNDS 200
+
+static std::atomic<long> net_msgs{0};
+static std::atomic<long> net_bytes{0};
+static std::atomic<int> net_connects{0};
+
+// echo each read back to the client
+static void net_handler(void *arg) {
+
+    cm_net::input_event *event = (cm_net::input_event *) arg;
+
+    if(event->connect) {
+        net_connects++;
+    }
+    else if(!event->eof) {
+        event->send(event->msg);
+        net_msgs++;
+    }
+}
+
+// each round: a message out on every connection of this thread, then
+// every echo back, so NET_CONNS requests are in flight at a time
+static void net_client(int index, void *data) {
+
+    std::vector<int> &fds = *(std::vector<int> *) data;
+    char msg[NET_MSG_SIZE], reply[NET_MSG_SIZE];
+    memset(msg, 'x', sizeof(msg));
+    msg[NET_MSG_SIZE - 1] = '\n';
+
+    int per = NET_CONNS / NET_SENDERS;
+    for(int round = 0; round < NET_ROUNDS; round++) {
+        for(int c = index * per; c < (index + 1) * per; c++) {
+            if(NET_MSG_SIZE != cm_net::write(fds[c], msg, sizeof(msg))) return;
+        }
+        for(int c = index * per; c < (index + 1) * per; c++) {
+            size_t got = 0;
+            while(got < sizeof(reply)) {
+                ssize_t n = ::read(fds[c], reply + got, sizeof(reply) - got);
+                if(n <= 0) return;
+                got += n;
+            }
+        }
+    }
+}
+
+// round trips/s through one server, NET_CONNS connections each making
+// NET_ROUNDS requests; the pool echoes every read
+static void net_run(const char *name, int loops, int port) {
+
+    net_msgs = 0;
+    net_connects = 0;
+
+    cm_thread::pool pool(4);
+    std::unique_ptr<cm_net::pool_server> single;
+    std::unique_ptr<cm_net::multi_pool_server> multi;
+
+    if(loops == 0) {
+        single = std::make_unique<cm_net::pool_server>(port, &pool, net_handler,
+            cm_net::input_event::release);
+    }
+    else {
+        multi = std::make_unique<cm_net::multi_pool_server>(port, loops, &pool, net_handler,
+            cm_net::input_event::release, strcmp(name, "shared") != 0);
+    }
+
+    std::vector<int> fds;
+    for(int c = 0; c < NET_CONNS; c++) {
+        std::string info;
+        int fd = cm_net::connect("127.0.0.1", port, info);
+        if(CM_NET_ERR == fd) break;
+        cm_net::set_no_delay(fd, 1);
+        fds.push_back(fd);
+    }
+    if((int) fds.size() < NET_CONNS) {
+        cm_log::error(cm_util::format("network: %s: connect failed", name));
+        for(int fd: fds) cm_net::close_socket(fd);
+        return;
+    }
+
+    timespec delay = {0, 1000000};   // 1 ms
+    for(int n = 0; n < 5000 && net_connects < NET_CONNS; n++) {
+        nanosleep(&delay, NULL);
+    }
+
+    double secs = run_threads(NET_SENDERS, net_client, &fds);
+    long trips = (long) NET_CONNS * NET_ROUNDS;
+
+    cm_log::info(cm_util::format("network: %-12s %5d %12.0lf %8.1lf",
+        name, loops == 0 ? 1 : loops, trips / secs, secs * 1e6 * NET_CONNS / trips));
+
+    for(int fd: fds) cm_net::close_socket(fd);
+    pool.wait_all();
+}
+
+static void net_bulk_handler(void *arg) {
+
+    cm_net::input_event *event = (cm_net::input_event *) arg;
+
+    if(event->connect) {
+        net_connects++;
+    }
+    else if(!event->eof) {
+        net_bytes += (long) event->msg.size();
+        net_msgs++;
+    }
+}
+
+static void net_bulk_client(int index, void *data) {
+
+    int fd = (*(std::vector<int> *) data)[index];
+    std::string chunk(64 * 1024, 'b');
+
+    for(size_t sent = 0; sent < NET_BULK_BYTES; sent += chunk.size()) {
+        if((int) chunk.size() != cm_net::write(fd, chunk.data(), chunk.size())) return;
+    }
+}
+
+// MB/s streamed by NET_BULK_CONNS clients at once, timed until the pool
+// has seen every byte; read is the average input_event size
+static void net_bulk_run(const char *name, int loops, int port) {
+
+    net_msgs = 0;
+    net_bytes = 0;
+    net_connects = 0;
+
+    cm_thread::pool pool(4);
+    std::unique_ptr<cm_net::pool_server> single;
+    std::unique_ptr<cm_net::multi_pool_server> multi;
+
+    if(loops == 0) {
+        single = std::make_unique<cm_net::pool_server>(port, &pool, net_bulk_handler,
+            cm_net::input_event::release);
+    }
+    else {
+        multi = std::make_unique<cm_net::multi_pool_server>(port, loops, &pool, net_bulk_handler,
+            cm_net::input_event::release);
+    }
+
+    std::vector<int> fds;
+    for(int c = 0; c < NET_BULK_CONNS; c++) {
+        std::string info;
+        int fd = cm_net::connect("127.0.0.1", port, info);
+        if(CM_NET_ERR == fd) break;
+        fds.push_back(fd);
+    }
+    if((int) fds.size() < NET_BULK_CONNS) {
+        cm_log::error(cm_util::format("network: %s: connect failed", name));
+        for(int fd: fds) cm_net::close_socket(fd);
+        return;
+    }
+
+    timespec delay = {0, 1000000};   // 1 ms
+    for(int n = 0; n < 5000 && net_connects < NET_BULK_CONNS; n++) {
+        nanosleep(&delay, NULL);
+    }
+
+    long expected = (long) NET_BULK_CONNS * NET_BULK_BYTES;
+    timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_threads(NET_BULK_CONNS, net_bulk_client, &fds);
+    for(int n = 0; n < 30000 && net_bytes < expected; n++) {
+        nanosleep(&delay, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double secs = cm_time::duration(start, finish);
+
+    cm_log::info(cm_util::format("network: %-12s %5d %10.1lf %10.0lf %s",
+        name, loops == 0 ? 1 : loops, (double) net_bytes / secs / (1024 * 1024),
+        net_msgs > 0 ? (double) net_bytes / net_msgs : 0.0,
+        net_bytes < expected ? "(incomplete)" : ""));
+
+    for(int fd: fds) cm_net::close_socket(fd);
+    pool.wait_all();
+}
+
+// answer each line with its own send()
+static void net_pipe_handler(void *arg) {
+
+    cm_net::input_event *event = (cm_net::input_event *) arg;
+
+    if(event->connect) {
+        net_connects++;
+    }
+    else if(!event->eof) {
+        for(auto &frame: event->frames) {
+            std::string reply(frame);
+            reply += '\n';
+            event->send(reply);
+        }
+        net_msgs += event->frames.size();
+    }
+}
+
+// each round: NET_PIPE_DEPTH "$key" lines in one write, then every reply
+static void net_pipe_client(int index, void *data) {
+
+    int fd = (*(std::vector<int> *) data)[index];
+    std::string out;
+    for(int n = 0; n < NET_PIPE_DEPTH; n++) out += "$key" + std::to_string(n % 10) + "\n";
+    std::string in(out.size(), '\0');
+
+    for(int round = 0; round < NET_PIPE_ROUNDS; round++) {
+        if((int) out.size() != cm_net::write(fd, out.data(), out.size())) return;
+        if((int) in.size() != cm_net::read(fd, &in[0], in.size())) return;
+    }
+}
+
+// requests/s from NET_PIPE_CONNS pipelining clients, and socket writes
+// per request, with and without write combining
+static void net_pipe_run(const char *name, bool coalescing, int port) {
+
+    net_msgs = 0;
+    net_connects = 0;
+
+    cm_thread::pool pool(4);
+    cm_net::pool_server server(port, &pool, net_pipe_handler, cm_net::input_event::release);
+    server.set_framing(cm_net::framing::line);
+    server.set_coalescing(coalescing);
+
+    std::vector<int> fds;
+    for(int c = 0; c < NET_PIPE_CONNS; c++) {
+        std::string info;
+        int fd = cm_net::connect("127.0.0.1", port, info);
+        if(CM_NET_ERR == fd) break;
+        cm_net::set_no_delay(fd, 1);
+        fds.push_back(fd);
+    }
+    if((int) fds.size() < NET_PIPE_CONNS) {
+        cm_log::error(cm_util::format("network: %s: connect failed", name));
+        for(int fd: fds) cm_net::close_socket(fd);
+        return;
+    }
+
+    timespec delay = {0, 1000000};   // 1 ms
+    for(int n = 0; n < 5000 && net_connects < NET_PIPE_CONNS; n++) {
+        nanosleep(&delay, NULL);
+    }
+
+    double secs = run_threads(NET_PIPE_CONNS, net_pipe_client, &fds);
+    long requests = (long) NET_PIPE_CONNS * NET_PIPE_DEPTH * NET_PIPE_ROUNDS;
+
+    cm_log::info(cm_util::format("network: %-12s %12.0lf %10.3lf",
+        name, requests / secs, (double) server.write_count() / requests));
+
+    for(int fd: fds) cm_net::close_socket(fd);
+    pool.wait_all();
+}
+
+// pool_server against multi_pool_server with 1 to 16 SO_REUSEPORT loops
+// (and 4 loops sharing one listen socket); the pool and the clients are
+// the same for every row, so the rows differ only in how many reactors
+// read the sockets; then bulk streams, where each wakeup drains the
+// socket up to the read budget; then pipelined requests, one send()
+// per reply, as separate writes or combined per event
+
+void network_benchmarks() {
+
+    cm_log::info(cm_util::format("network: %d connections, %d round trips of %d bytes each, %d cpus",
+        NET_CONNS, NET_ROUNDS, NET_MSG_SIZE, cm_thread::cpu_topology::get().cpu_count()));
+    cm_log::info("network: server       loops      trips/s   rtt us");
+
+    int port = NET_PORT;
+    net_run("pool_server", 0, port++);
+    for(int loops = 1; loops <= 16; loops *= 2) {
+        net_run("reuseport", loops, port++);
+    }
+    net_run("shared", 4, port++);
+
+    cm_log::info(cm_util::format("network: %d connections streaming %d MB each",
+        NET_BULK_CONNS, NET_BULK_BYTES / (1024 * 1024)));
+    cm_log::info("network: server       loops       MB/s  read size");
+    net_bulk_run("pool_server", 0, port++);
+    net_bulk_run("reuseport", 4, port++);
+
+    cm_log::info(cm_util::format("network: %d connections pipelining %d requests per write",
+        NET_PIPE_CONNS, NET_PIPE_DEPTH));
+    cm_log::info("network: replies          requests/s  writes/req");
+    net_pipe_run("separate", false, port++);
+    net_pipe_run("coalesced", true, port++);
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "thread.h"
+#include "parallel.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define PARALLEL_ITEMS      (4 * 1024 * 1024)
+#define PARALLEL_SORT_ITEMS (2 * 1024 * 1024)
+#define PARALLEL_ROUNDS     3       // best of
+
+struct parallel_times {
+    double for_ms = 0, reduce_ms = 0, transform_ms = 0, sort_ms = 0;
+};
+
+static double elapsed_ms(const timespec &start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return cm_time::duration(start, now) * 1000.0;
+}
+
+static double item_work(size_t i) {
+    return sqrt((double) i) * 1.0001 + (double) (i % 7);
+}
+
+// best of PARALLEL_ROUNDS for each algorithm; pool == nullptr: the
+// serial std:: equivalents
+static parallel_times parallel_run(cm_thread::pool *pool, double &check) {
+
+    std::vector<double> out(PARALLEL_ITEMS);
+    std::vector<double> in(PARALLEL_ITEMS);
+    std::vector<uint64_t> keys(PARALLEL_SORT_ITEMS);
+    parallel_times best;
+    best.for_ms = best.reduce_ms = best.transform_ms = best.sort_ms = 1e12;
+
+    for(int round = 0; round < PARALLEL_ROUNDS; round++) {
+        timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(pool) {
+            cm_thread::parallel_for(*pool, 0, PARALLEL_ITEMS, [&](size_t i) { out[i] = item_work(i); });
+        }
+        else {
+            for(size_t i = 0; i < PARALLEL_ITEMS; i++) out[i] = item_work(i);
+        }
+        best.for_ms = std::min(best.for_ms, elapsed_ms(start));
+
+        auto add = [](double a, double b) { return a + b; };
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(pool) {
+            check = cm_thread::parallel_reduce(*pool, 0, PARALLEL_ITEMS, 0.0, item_work, add);
+        }
+        else {
+            check = 0.0;
+            for(size_t i = 0; i < PARALLEL_ITEMS; i++) check = add(check, item_work(i));
+        }
+        best.reduce_ms = std::min(best.reduce_ms, elapsed_ms(start));
+
+        auto scale = [](double x) { return x * x + 1.0; };
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(pool) {
+            cm_thread::parallel_transform(*pool, out.begin(), out.end(), in.begin(), scale);
+        }
+        else {
+            std::transform(out.begin(), out.end(), in.begin(), scale);
+        }
+        best.transform_ms = std::min(best.transform_ms, elapsed_ms(start));
+
+        uint64_t state = 88172645463325252ull;
+        for(auto &key: keys) key = bench_rand(state);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(pool) {
+            cm_thread::parallel_sort(*pool, keys.begin(), keys.end());
+        }
+        else {
+            std::stable_sort(keys.begin(), keys.end());
+        }
+        best.sort_ms = std::min(best.sort_ms, elapsed_ms(start));
+    }
+    return best;
+}
+
+// parallel_for, parallel_reduce, parallel_transform and parallel_sort
+// against their serial std:: equivalents on work-stealing pools of 1 to
+// 32 workers (the calling thread takes chunks too); speedup is of the
+// sum of the four times
+
+void parallel_benchmarks() {
+
+    double check = 0.0;
+    parallel_times serial = parallel_run(nullptr, check);
+    double serial_total = serial.for_ms + serial.reduce_ms + serial.transform_ms + serial.sort_ms;
+
+    cm_log::info(cm_util::format("parallel: %d items, %d sorted, %d cpus",
+        PARALLEL_ITEMS, PARALLEL_SORT_ITEMS, cm_thread::cpu_topology::get().cpu_count()));
+    cm_log::info("parallel: threads   for ms reduce ms transform ms  sort ms speedup");
+    cm_log::info(cm_util::format("parallel: %7s %8.1lf %9.1lf %12.1lf %8.1lf %7.2lf", "serial",
+        serial.for_ms, serial.reduce_ms, serial.transform_ms, serial.sort_ms, 1.0));
+
+    for(int threads = 1; threads <= 32; threads *= 2) {
+        cm_thread::pool pool(threads, cm_thread::pool_mode::work_stealing);
+        double sum = 0.0;
+        parallel_times t = parallel_run(&pool, sum);
+        double total = t.for_ms + t.reduce_ms + t.transform_ms + t.sort_ms;
+        cm_log::info(cm_util::format("parallel: %7d %8.1lf %9.1lf %12.1lf %8.1lf %7.2lf", threads,
+            t.for_ms, t.reduce_ms, t.transform_ms, t.sort_ms, serial_total / total));
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "thread.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define POOL_SHARED_TASKS   5000        // the shared pool runs about 1000 tasks/s per worker
+#define POOL_STEALING_TASKS 200000
+#define POOL_LATENCY_TASKS  2000
+#define POOL_SUBMIT_USECS   50          // latency run submit interval
+
+static std::atomic<size_t> pool_completed{0};
+
+static void null_task(void *arg) {
+    pool_completed.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct latency_slot {
+    timespec enqueued;
+    double wait_usecs;
+};
+
+static void latency_task(void *arg) {
+    latency_slot *slot = (latency_slot *) arg;
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    slot->wait_usecs = cm_time::duration(slot->enqueued, now) * 1e6;
+    pool_completed.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void wait_completed(size_t count) {
+    while(pool_completed.load(std::memory_order_relaxed) < count) {
+        sched_yield();
+    }
+}
+
+// null tasks submitted from outside the pool as fast as possible
+static double pool_tasks_per_sec(int threads, cm_thread::pool_mode mode, size_t tasks) {
+    cm_thread::pool pool(threads, mode);
+    pool_completed = 0;
+    timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(size_t n = 0; n < tasks; n++) {
+        pool.add_task(null_task, nullptr);
+    }
+    wait_completed(tasks);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    return tasks / cm_time::duration(start, finish);
+}
+
+// enqueue to start latency of paced submissions: p50, p99, p99.9 usecs
+static void pool_latency(int threads, cm_thread::pool_mode mode, double pct[3]) {
+    cm_thread::pool pool(threads, mode);
+    std::vector<latency_slot> slots(POOL_LATENCY_TASKS);
+    pool_completed = 0;
+    for(auto &slot: slots) {
+        clock_gettime(CLOCK_MONOTONIC, &slot.enqueued);
+        pool.add_task(latency_task, &slot);
+        usleep(POOL_SUBMIT_USECS);
+    }
+    wait_completed(POOL_LATENCY_TASKS);
+
+    std::vector<double> waits;
+    for(auto &slot: slots) waits.push_back(slot.wait_usecs);
+    std::sort(waits.begin(), waits.end());
+    pct[0] = waits[waits.size() * 50 / 100];
+    pct[1] = waits[waits.size() * 99 / 100];
+    pct[2] = waits[waits.size() * 999 / 1000];
+}
+
+// null task cost with per-worker stats on and off, best of
+// POOL_STATS_ROUNDS each (rounds alternate so drift hits both alike).
+// The tasks are queued behind a gate task and timed from its release to
+// wait_all(), so only the workers run while the clock is going; the
+// clock is process CPU time, so time the host gives to others does not
+// count.
+
+#define POOL_STATS_ROUNDS 15
+
+static std::atomic<bool> pool_gate{false};
+
+static void gate_task(void *arg) {
+    while(!pool_gate.load()) sched_yield();
+}
+
+static void pool_stats_overhead(int threads, cm_thread::pool_mode mode, size_t tasks) {
+    double best[2] = { 0, 0 };
+    for(int round = 0; round < POOL_STATS_ROUNDS * 2; round++) {
+        bool on = round % 2 == 0;
+        cm_thread::pool pool(threads, mode);
+        pool.set_stats(on);
+        pool_gate = false;
+        for(int n = 0; n < threads; n++) {
+            pool.add_task(gate_task, nullptr);
+        }
+        for(size_t n = 0; n < tasks; n++) {
+            pool.add_task(null_task, nullptr);
+        }
+        timespec start, finish;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+        pool_gate = true;
+        pool.wait_all();
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &finish);
+        double ns = cm_time::duration(start, finish) * 1e9 / tasks;
+        if(best[on] == 0 || ns < best[on]) best[on] = ns;
+    }
+    cm_log::info(cm_util::format("pool stats: %7d %-13s %11.1lf %11.1lf %7.2lf%%", threads,
+        mode == cm_thread::pool_mode::shared ? "shared" : "work_stealing", best[0], best[1],
+        (best[1] - best[0]) / best[0] * 100.0));
+}
+
+// shared queue pool vs. work-stealing pool: task throughput and tail
+// latency from 2 to 64 workers
+
+void pool_benchmarks() {
+
+    cm_log::info("pool: threads mode           tasks/s   p50 us   p99 us p99.9 us");
+
+    for(int threads = 2; threads <= 64; threads *= 2) {
+        struct { const char *name; cm_thread::pool_mode mode; size_t tasks; } modes[] = {
+            { "shared", cm_thread::pool_mode::shared, POOL_SHARED_TASKS },
+            { "work_stealing", cm_thread::pool_mode::work_stealing, POOL_STEALING_TASKS }
+        };
+        for(auto &m: modes) {
+            double rate = pool_tasks_per_sec(threads, m.mode, m.tasks);
+            double pct[3];
+            pool_latency(threads, m.mode, pct);
+            cm_log::info(cm_util::format("pool: %7d %-13s %9.0lf %8.1lf %8.1lf %8.1lf",
+                threads, m.name, rate, pct[0], pct[1], pct[2]));
+        }
+    }
+
+    cm_log::info("pool stats: threads mode          off ns/task  on ns/task overhead");
+    for(int threads = 1; threads <= 4; threads *= 2) {
+        pool_stats_overhead(threads, cm_thread::pool_mode::shared, POOL_STEALING_TASKS);
+        pool_stats_overhead(threads, cm_thread::pool_mode::work_stealing, POOL_STEALING_TASKS);
+    }
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sched.h>
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <string>
+
+#include "queue.h"
+#include "ring_queue.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define QUEUE_ITEMS     1000000     // total per run
+
+// producer/consumer throughput: threads producers and threads consumers
+// move QUEUE_ITEMS values through one queue. Consumers of the non-blocking
+// variants yield when they find the queue empty.
+
+template<class queueT>
+struct queue_bench {
+    queueT queue;
+    int threads;
+    std::atomic<uint64_t> sum{0};
+};
+
+static void double_queue_run(int index, void *data) {
+    auto *b = (queue_bench<cm_queue::double_queue<uint64_t>> *) data;
+    int count = QUEUE_ITEMS / b->threads;
+    if(index < b->threads) {
+        for(int n = 1; n <= count; n++) b->queue.push_back(n);
+        return;
+    }
+    uint64_t sum = 0;
+    for(int n = 0; n < count; ) {
+        uint64_t value = b->queue.pop_front();
+        if(value == 0) {
+            sched_yield();
+            continue;
+        }
+        sum += value;
+        n++;
+    }
+    b->sum += sum;
+}
+
+#define QUEUE_BATCH     64
+
+// producers splice batches, consumers drain up to a batch per lock
+static void double_queue_batch_run(int index, void *data) {
+    auto *b = (queue_bench<cm_queue::double_queue<uint64_t>> *) data;
+    int count = QUEUE_ITEMS / b->threads;
+    if(index < b->threads) {
+        std::deque<uint64_t> batch;
+        for(int n = 1; n <= count; n++) {
+            batch.push_back(n);
+            if(batch.size() == QUEUE_BATCH || n == count) {
+                b->queue.push_back(std::move(batch));
+            }
+        }
+        return;
+    }
+    uint64_t sum = 0;
+    std::vector<uint64_t> values;
+    for(int n = 0; n < count; ) {
+        values.clear();
+        size_t got = b->queue.pop_front(values, std::min((size_t) QUEUE_BATCH, (size_t) (count - n)));
+        if(got == 0) {
+            sched_yield();
+            continue;
+        }
+        for(auto value: values) sum += value;
+        n += got;
+    }
+    b->sum += sum;
+}
+
+static void ring_try_run(int index, void *data) {
+    auto *b = (queue_bench<cm_queue::ring_queue<uint64_t>> *) data;
+    int count = QUEUE_ITEMS / b->threads;
+    if(index < b->threads) {
+        for(int n = 1; n <= count; ) {
+            if(b->queue.try_push(n)) n++;
+            else sched_yield();
+        }
+        return;
+    }
+    uint64_t sum = 0;
+    for(int n = 0; n < count; ) {
+        uint64_t value;
+        if(b->queue.try_pop(value)) {
+            sum += value;
+            n++;
+        }
+        else sched_yield();
+    }
+    b->sum += sum;
+}
+
+static void ring_wait_run(int index, void *data) {
+    auto *b = (queue_bench<cm_queue::ring_queue<uint64_t>> *) data;
+    int count = QUEUE_ITEMS / b->threads;
+    if(index < b->threads) {
+        for(int n = 1; n <= count; n++) b->queue.push_back(n);
+        return;
+    }
+    uint64_t sum = 0;
+    for(int n = 0; n < count; n++) {
+        uint64_t value;
+        b->queue.pop_wait(value);
+        sum += value;
+    }
+    b->sum += sum;
+}
+
+template<class queueT>
+static double items_per_sec(int threads, void (*fn)(int, void *)) {
+    queue_bench<queueT> b;
+    b.threads = threads;
+    double secs = run_threads(threads * 2, fn, &b);
+    uint64_t count = QUEUE_ITEMS / threads;
+    if(b.sum != threads * (count * (count + 1) / 2)) {
+        cm_log::error(cm_util::format("queue: checksum mismatch %lu", (unsigned long) b.sum));
+    }
+    return (double) (count * threads) / secs;
+}
+
+void queue_benchmarks() {
+
+    cm_log::info("queue: threads  double_queue/s  batch of 64/s    ring try/s   ring wait/s");
+
+    for(int threads: { 1, 4, 16 }) {
+        double a = items_per_sec<cm_queue::double_queue<uint64_t>>(threads, double_queue_run);
+        double b = items_per_sec<cm_queue::double_queue<uint64_t>>(threads, double_queue_batch_run);
+        double c = items_per_sec<cm_queue::ring_queue<uint64_t>>(threads, ring_try_run);
+        double d = items_per_sec<cm_queue::ring_queue<uint64_t>>(threads, ring_wait_run);
+        cm_log::info(cm_util::format("queue: %7d %15.0lf %14.0lf %13.0lf %13.0lf",
+            threads, a, b, c, d));
+    }
+}
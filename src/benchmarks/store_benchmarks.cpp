@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <malloc.h>
+
+#include <string>
+#include <vector>
+
+#include "store.h"
+#include "flat_map.h"
+#include "util.h"
+#include "log.h"
+#include "benchmarks.h"
+
+#define STORE_KEYS      100000
+#define STORE_OPS       500000      // per thread
+#define STORE_READ_PCT  90
+
+static std::vector<std::string> store_keys;
+
+template<class storeT>
+struct store_bench {
+
+    storeT store;
+
+    static void run(int index, void *data) {
+        store_bench<storeT> *b = (store_bench<storeT> *) data;
+        uint64_t state = 0x9E3779B97F4A7C15ULL * (index + 1);
+        for(int n = 0; n < STORE_OPS; n++) {
+            uint64_t r = bench_rand(state);
+            const std::string &key = store_keys[r % STORE_KEYS];
+            if((r >> 32) % 100 < STORE_READ_PCT) {
+                b->store.find(key);
+            }
+            else {
+                b->store.set(key, key);
+            }
+        }
+    }
+
+    double ops_per_sec(int threads) {
+        double secs = run_threads(threads, run, this);
+        return ((double) threads * STORE_OPS) / secs;
+    }
+};
+
+// contention benchmark: throughput of a 90% read / 10% write mix on a
+// single-lock info_store, an info_store with a reader/writer lock and the
+// lock-striped sharded_store as the number of threads grows
+
+void store_benchmarks() {
+
+    for(int n = 0; n < STORE_KEYS; n++) {
+        store_keys.push_back(cm_util::format("key%d", n));
+    }
+
+    store_bench<cm_store::info_store<std::string,std::string>> single;
+    store_bench<cm_store::info_store<std::string,std::string,cm::rwlock>> rw;
+    store_bench<cm_store::sharded_store<std::string,std::string>> sharded;
+
+    for(auto &key: store_keys) {
+        single.store.set(key, key);
+        rw.store.set(key, key);
+        sharded.store.set(key, key);
+    }
+
+    cm_log::info("store: threads  info_store ops/s    rwlock ops/s   sharded ops/s");
+
+    for(int threads = 1; threads <= 32; threads *= 2) {
+        double a = single.ops_per_sec(threads);
+        double b = rw.ops_per_sec(threads);
+        double c = sharded.ops_per_sec(threads);
+        cm_log::info(cm_util::format("store: %7d %17.0lf %15.0lf %15.0lf",
+            threads, a, b, c));
+    }
+}
+
+#define MAP_KEYS        1000000
+#define MAP_LOOKUPS     5000000
+
+static size_t heap_in_use() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+// memory per entry and lookup latency of the node based map vs. the open
+// addressing flat_map for a large number of small string keys and values
+
+template<class mapT>
+static void map_bench(const char *name, std::vector<std::string> &keys) {
+
+    size_t before = heap_in_use();
+    mapT *map = new mapT;
+    for(auto &key: keys) {
+        (*map)[key] = key;
+    }
+    size_t bytes = heap_in_use() - before;
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    size_t found = 0;
+    timespec start, finish;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int n = 0; n < MAP_LOOKUPS; n++) {
+        found += map->find(keys[bench_rand(state) % keys.size()]) != map->end();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double hit_ns = cm_time::duration(start, finish) * 1e9 / MAP_LOOKUPS;
+
+    std::string miss("missing-key");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int n = 0; n < MAP_LOOKUPS; n++) {
+        miss[n % miss.size()] = 'a' + (bench_rand(state) % 26);
+        found += map->find(miss) != map->end();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double miss_ns = cm_time::duration(start, finish) * 1e9 / MAP_LOOKUPS;
+
+    cm_log::info(cm_util::format("map: %-14s %10lu %12.1lf %12.1lf %12.1lf",
+        name, map->size(), (double) bytes / keys.size(), hit_ns, miss_ns));
+
+    delete map;
+}
+
+void map_benchmarks() {
+
+    std::vector<std::string> keys;
+    for(int n = 0; n < MAP_KEYS; n++) {
+        keys.push_back(cm_util::format("key%d", n));
+    }
+
+    cm_log::info("map: table             entries  bytes/entry   hit ns/op   miss ns/op");
+
+    map_bench<cm_store::hash_map<std::string,std::string>>("unordered_map", keys);
+    map_bench<cm_store::open_map<std::string,std::string>>("flat_map", keys);
+}
@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BOUNDED_STORE_H
+#define __BOUNDED_STORE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+#include "timewatcher.h"
+#include "store.h"
+
+namespace cm_store {
+
+////////////////////////// eviction policies ///////////////////////////
+//
+// Each entry owns a slot holding its key and one 32-bit atomic word of
+// policy metadata. touch() runs on every hit, including from readers
+// sharing an rwlock, so it only does relaxed atomic stores (and skips the
+// store when the word already holds the value to avoid dirtying the cache
+// line). victim() runs with the store's exclusive lock held.
+
+// CLOCK (second chance): touch sets a reference bit, the hand clears
+// referenced slots and evicts the first unreferenced one.
+struct clock_policy {
+
+    static const bool admission = false;
+
+    static void touch(std::atomic<uint32_t> &meta) {
+        if(meta.load(std::memory_order_relaxed) == 0) {
+            meta.store(1, std::memory_order_relaxed);
+        }
+    }
+
+    template<class slotsT>
+    static size_t victim(slotsT &slots, uint64_t &hand) {
+        while(true) {
+            hand = (hand + 1) % slots.size();
+            auto &s = slots[hand];
+            if(!s.used) continue;
+            if(s.meta.load(std::memory_order_relaxed) == 0) return hand;
+            s.meta.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Approximate LRU (sampled, as in Redis): touch records the coarse
+// timewatcher clock in 100 ms units, eviction samples a few random
+// entries and evicts the least recently used of them.
+struct lru_policy {
+
+    static const bool admission = false;
+    static const int samples = 5;
+
+    static void touch(std::atomic<uint32_t> &meta) {
+        timespec ts = cm_time::clock_time();
+        uint32_t now = (uint32_t) (cm_time::total_millis(ts) / 100);
+        if(meta.load(std::memory_order_relaxed) != now) {
+            meta.store(now, std::memory_order_relaxed);
+        }
+    }
+
+    template<class slotsT>
+    static size_t victim(slotsT &slots, uint64_t &hand) {
+        size_t best = (size_t) -1;
+        uint32_t oldest = 0;
+        for(int n = 0; n < samples || best == (size_t) -1; ) {
+            // xorshift64: hand doubles as the random state
+            hand ^= hand << 13;
+            hand ^= hand >> 7;
+            hand ^= hand << 17;
+            size_t i = (size_t) (hand % slots.size());
+            if(!slots[i].used) continue;
+            uint32_t t = slots[i].meta.load(std::memory_order_relaxed);
+            if(best == (size_t) -1 || t < oldest) {
+                best = i;
+                oldest = t;
+            }
+            n++;
+        }
+        return best;
+    }
+};
+
+// TinyLFU admission on top of an eviction policy: a new key only
+// replaces the victim if it has been seen more often recently.
+template<class evictT = clock_policy>
+struct tinylfu_policy: public evictT {
+    static const bool admission = true;
+};
+
+//////////////////////////// frequency sketch //////////////////////////
+
+// Count-min sketch of 4-bit saturating counters (stored one per byte) used
+// for TinyLFU admission. All counters are halved every 10 x width samples
+// so the estimate follows recent popularity. Increments are relaxed
+// atomics and safe under a shared lock, reset() needs exclusive access.
+
+class frequency_sketch {
+
+    static const int depth = 4;
+
+    std::unique_ptr<std::atomic<uint8_t>[]> counters;
+    size_t width = 0;           // power of two
+    std::atomic<size_t> samples{0};
+
+    size_t index(uint64_t h, int row) const {
+        static const uint64_t seeds[depth] = {
+            0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+            0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL };
+        return (size_t) (((h ^ (h >> 29)) * seeds[row]) >> 32) & (width - 1);
+    }
+
+public:
+    void resize(size_t entries) {
+        width = 64;
+        while(width < entries) width <<= 1;
+        counters.reset(new std::atomic<uint8_t>[depth * width]);
+        clear();
+    }
+
+    bool enabled() const { return width > 0; }
+
+    void increment(uint64_t h) {
+        for(int row = 0; row < depth; row++) {
+            auto &c = counters[row * width + index(h, row)];
+            if(c.load(std::memory_order_relaxed) < 15) {
+                c.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        samples.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint8_t estimate(uint64_t h) const {
+        uint8_t est = 15;
+        for(int row = 0; row < depth; row++) {
+            uint8_t c = counters[row * width + index(h, row)].load(std::memory_order_relaxed);
+            if(c < est) est = c;
+        }
+        return est;
+    }
+
+    bool need_reset() const {
+        return samples.load(std::memory_order_relaxed) >= 10 * width;
+    }
+
+    // halve all counters (aging)
+    void reset() {
+        for(size_t i = 0; i < depth * width; i++) {
+            counters[i].store(counters[i].load(std::memory_order_relaxed) >> 1,
+                std::memory_order_relaxed);
+        }
+        samples.store(0, std::memory_order_relaxed);
+    }
+
+    void swap(frequency_sketch &r) {
+        counters.swap(r.counters);
+        std::swap(width, r.width);
+        size_t n = samples.load(std::memory_order_relaxed);
+        samples.store(r.samples.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        r.samples.store(n, std::memory_order_relaxed);
+    }
+
+    void clear() {
+        for(size_t i = 0; i < depth * width; i++) {
+            counters[i].store(0, std::memory_order_relaxed);
+        }
+        samples.store(0, std::memory_order_relaxed);
+    }
+};
+
+/////////////////////////////// stats //////////////////////////////////
+
+struct store_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t rejections = 0;    // new keys refused by admission
+
+    double hit_ratio() const {
+        uint64_t total = hits + misses;
+        return total > 0 ? (double) hits / (double) total : 0.0;
+    }
+
+    store_stats &operator += (const store_stats &r) {
+        hits += r.hits;
+        misses += r.misses;
+        evictions += r.evictions;
+        rejections += r.rejections;
+        return *this;
+    }
+};
+
+// approximate memory charged for an entry against the byte budget
+template<class T>
+inline size_t entry_bytes(const T &) { return sizeof(T); }
+
+inline size_t entry_bytes(const std::string &s) {
+    return sizeof(std::string) + s.size();
+}
+
+/////////////////////////// bounded_store //////////////////////////////
+
+// Store with the info_store interface and a capacity: at most max_entries
+// entries and/or max_bytes of keys and values (0 = no limit). When a new
+// entry does not fit, entries are evicted as chosen by policyT
+// (clock_policy, lru_policy or tinylfu_policy<>). With an admission policy
+// set() returns false when the new key is refused.
+//
+// Policy metadata lives in a per-entry atomic word and the counters are
+// relaxed atomics, so hits under a shared cm::rwlock lock need no extra
+// locking. To bound a sharded_store use bounded_store as its shard type
+// and set each shard's capacity through for_each_shard().
+
+template<class keyT, class valueT, class policyT = clock_policy,
+         class lockT = cm::mutex, template<class,class> class mapT = hash_map>
+class bounded_store: protected lockT {
+
+protected:
+    struct entry {
+        valueT value;
+        uint32_t slot = 0;
+    };
+
+    struct slot {
+        keyT key;
+        std::atomic<uint32_t> meta{0};
+        bool used = false;
+    };
+
+    typedef mapT<keyT,entry> map_type;
+
+    map_type _map;
+    std::deque<slot> _slots;        // stable addresses, indexed by entry.slot
+    std::vector<uint32_t> _free;    // unused slots
+    uint64_t _hand = 0x9E3779B97F4A7C15ULL;
+
+    size_t _max_entries = 0;
+    size_t _max_bytes = 0;
+    size_t _bytes = 0;
+
+    frequency_sketch _sketch;
+
+    std::atomic<uint64_t> _hits{0};
+    std::atomic<uint64_t> _misses{0};
+    std::atomic<uint64_t> _evictions{0};
+    std::atomic<uint64_t> _rejections{0};
+
+    void read_lock() { cm::read_lock(*this); }
+
+    using lockT::lock;
+    using lockT::unlock;
+
+    template<class K>
+    typename map_type::const_iterator _find(const K &name) const {
+#ifdef __cpp_lib_generic_unordered_lookup
+        return _map.find(name);
+#else
+        return _map.find(keyT(name));
+#endif
+    }
+
+    template<class K>
+    static uint64_t hash_of(const K &name) {
+        return (uint64_t) typename store_traits<keyT>::hash()(name);
+    }
+
+    // count a lookup, touch the entry on a hit
+    template<class K>
+    void record(const K &name, typename map_type::const_iterator p) {
+        if(policyT::admission) {
+            _sketch.increment(hash_of(name));
+        }
+        if(p != _map.end()) {
+            policyT::touch(_slots[p->second.slot].meta);
+            _hits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            _misses.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool over(size_t entries, size_t bytes) const {
+        return (_max_entries > 0 && entries > _max_entries) ||
+               (_max_bytes > 0 && bytes > _max_bytes);
+    }
+
+    void release(uint32_t index) {
+        slot &s = _slots[index];
+        s.used = false;
+        s.key = keyT();
+        _free.push_back(index);
+    }
+
+    void evict(size_t index) {
+        slot &s = _slots[index];
+        auto p = _map.find(s.key);
+        _bytes -= entry_bytes(s.key) + entry_bytes(p->second.value);
+        _map.erase(s.key);
+        release((uint32_t) index);
+        _evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint32_t acquire(const keyT &name) {
+        uint32_t index;
+        if(!_free.empty()) {
+            index = _free.back();
+            _free.pop_back();
+        }
+        else {
+            index = (uint32_t) _slots.size();
+            _slots.emplace_back();
+        }
+        slot &s = _slots[index];
+        s.key = name;
+        s.used = true;
+        s.meta.store(0, std::memory_order_relaxed);
+        policyT::touch(s.meta);
+        return index;
+    }
+
+public:
+
+    bounded_store(size_t max_entries = 0, size_t max_bytes = 0) {
+        set_capacity(max_entries, max_bytes);
+    }
+
+    // entries beyond a lowered capacity are evicted by the next set()
+    void set_capacity(size_t max_entries, size_t max_bytes = 0) {
+        lock();
+        _max_entries = max_entries;
+        _max_bytes = max_bytes;
+        if(policyT::admission) {
+            // size the sketch for the expected number of entries
+            size_t entries = max_entries > 0 ? max_entries : max_bytes / 64;
+            _sketch.resize(entries > 0 ? entries : 1024);
+        }
+        unlock();
+    }
+
+    template<class K>
+    bool check(const K &name) {
+        read_lock();
+        auto p = _find(name);
+        bool b = p != _map.end();
+        unlock();
+        return b;
+    }
+
+    bool set(const keyT &name, const valueT &value) {
+        lock();
+
+        if(policyT::admission && _sketch.need_reset()) {
+            _sketch.reset();
+        }
+
+        uint32_t written;
+        auto p = _map.find(name);
+        if(p != _map.end()) {
+            _bytes -= entry_bytes(p->second.value);
+            _bytes += entry_bytes(value);
+            p->second.value = value;
+            written = p->second.slot;
+            policyT::touch(_slots[written].meta);
+        }
+        else {
+            size_t bytes = entry_bytes(name) + entry_bytes(value);
+
+            if(policyT::admission && over(_map.size() + 1, _bytes + bytes) && !_map.empty()) {
+                // admit only if more popular than the entry it would replace
+                _sketch.increment(hash_of(name));
+                size_t candidate = policyT::victim(_slots, _hand);
+                if(_sketch.estimate(hash_of(name)) <=
+                   _sketch.estimate(hash_of(_slots[candidate].key))) {
+                    _rejections.fetch_add(1, std::memory_order_relaxed);
+                    unlock();
+                    return false;
+                }
+                evict(candidate);
+            }
+
+            while(over(_map.size() + 1, _bytes + bytes) && !_map.empty()) {
+                evict(policyT::victim(_slots, _hand));
+            }
+
+            entry &e = _map[name];
+            e.value = value;
+            e.slot = acquire(name);
+            written = e.slot;
+            _bytes += bytes;
+        }
+
+        // shrink after a lowered capacity or a grown value, never
+        // evicting the entry just written
+        while(over(_map.size(), _bytes) && _map.size() > 1) {
+            size_t index = policyT::victim(_slots, _hand);
+            if(index == written) {
+                policyT::touch(_slots[index].meta);
+                continue;
+            }
+            evict(index);
+        }
+
+        unlock();
+        return true;
+    }
+
+    template<class K>
+    valueT find(const K &name) {
+        valueT value;
+        read_lock();
+        auto p = _find(name);
+        record(name, p);
+        if(p != _map.end()) {
+            value = p->second.value;
+        }
+        unlock();
+        return value;
+    }
+
+    template<class K>
+    valueT get(const K &name, const valueT &_default) {
+        valueT value = _default;
+        read_lock();
+        auto p = _find(name);
+        record(name, p);
+        if(p != _map.end()) {
+            value = p->second.value;
+        }
+        unlock();
+        return value;
+    }
+
+    template<class K, class fnT>
+    bool visit(const K &name, fnT fn) {
+        read_lock();
+        auto p = _find(name);
+        record(name, p);
+        bool found = p != _map.end();
+        if(found) {
+            fn(p->second.value);
+        }
+        unlock();
+        return found;
+    }
+
+    size_t remove(const keyT &name) {
+        lock();
+        size_t num_erased = 0;
+        auto p = _map.find(name);
+        if(p != _map.end()) {
+            _bytes -= entry_bytes(name) + entry_bytes(p->second.value);
+            release(p->second.slot);
+            num_erased = _map.erase(name);
+        }
+        unlock();
+        return num_erased;
+    }
+
+    size_t size() {
+        read_lock();
+        size_t size = _map.size();
+        unlock();
+        return size;
+    }
+
+    size_t bytes() {
+        read_lock();
+        size_t bytes = _bytes;
+        unlock();
+        return bytes;
+    }
+
+    void swap(bounded_store<keyT,valueT,policyT,lockT,mapT> &store) {
+        lock();
+        _map.swap(store._map);
+        _slots.swap(store._slots);
+        _free.swap(store._free);
+        std::swap(_hand, store._hand);
+        std::swap(_max_entries, store._max_entries);
+        std::swap(_max_bytes, store._max_bytes);
+        std::swap(_bytes, store._bytes);
+        _sketch.swap(store._sketch);
+        unlock();
+    }
+
+    void clear() {
+        lock();
+        _map.clear();
+        _slots.clear();
+        _free.clear();
+        _bytes = 0;
+        unlock();
+    }
+
+    store_stats stats() {
+        store_stats s;
+        s.hits = _hits.load(std::memory_order_relaxed);
+        s.misses = _misses.load(std::memory_order_relaxed);
+        s.evictions = _evictions.load(std::memory_order_relaxed);
+        s.rejections = _rejections.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    void clear_stats() {
+        _hits.store(0, std::memory_order_relaxed);
+        _misses.store(0, std::memory_order_relaxed);
+        _evictions.store(0, std::memory_order_relaxed);
+        _rejections.store(0, std::memory_order_relaxed);
+    }
+};
+
+} // namespace cm_store
+
+#endif  // __BOUNDED_STORE_H
@@ -39,6 +39,7 @@
 // - remove
 // * watch #tag
 // @ watch #tag (remove on notify)
+// ~ time to live in seconds (add only: +key ~ttl value)
 
 // identifier/key
 // string/value
@@ -118,6 +119,12 @@ bool cm_cache::scanner::next_token() {
                         break;
                     } 
 
+        case '~':   if(ch == '~' && index > 0 && is_ttl()) {
+                        accept(tk_ttl);
+                        scan_identifier();
+                        break;
+                    }
+
         default:    if(is_ident(ch)) {
                         token.id = identifier;
                         scan_identifier();
@@ -145,20 +152,22 @@ void cm_cache::scanner::scan_string(char quote_ch) {
 }
 
 void cm_cache::scanner::scan_identifier() {
-    char ch;
-    while(is_ident(ch = buffer[index])) {
-        token.value.append(1,ch);
+    int start = index;
+    while(is_ident(buffer[index])) {
         index++;
-    } 
+    }
+    // one append (and at most one allocation) for the whole token
+    token.value.append(buffer + start, index - start);
 }
 
 void cm_cache::scanner::scan_raw() {
+    int start = index;
     char ch;
     while(ch = buffer[index]) {
         if(ch == '\n') break;
-        token.value.append(1,ch);
         index++;
-    } 
+    }
+    token.value.append(buffer + start, index - start);
 }
 
 bool cm_cache::cache::parse_add(cm_cache::cache_event &event) {
@@ -170,6 +179,17 @@ bool cm_cache::cache::parse_add(cm_cache::cache_event &event) {
     if(token.id == cm_cache::string || token.id == cm_cache::identifier) {
 
         next_token();
+
+        // optional time to live: +key ~seconds value
+        event.ttl = 0;
+        if(token.id == cm_cache::tk_ttl) {
+            event.ttl = (time_t) atol(token.value.c_str());
+            next_token();
+            if(token.id == cm_cache::input_end) {
+                return parse_error("add: expected value after time to live", event);
+            }
+        }
+
         rvalue = std::move(token.value);
 
         if(token.id == cm_cache::string || token.id == cm_cache::raw ||
@@ -178,6 +198,9 @@ bool cm_cache::cache::parse_add(cm_cache::cache_event &event) {
             next_token();
 
             if(token.id == cm_cache::input_end) {
+                if(event.ttl > 0) {
+                    return processor->do_add_ttl(lvalue, rvalue, event.ttl, event);
+                }
                 return processor->do_add(lvalue, rvalue, event);
             }
             return parse_error("add: expected end after value", event);
@@ -191,14 +214,16 @@ bool cm_cache::cache::parse_read(cm_cache::cache_event &event) {
 
     next_token();
 
-    std::string lvalue = std::move(token.value);
+    // swap rather than move: the key and token buffers keep their
+    // capacity, so a warm read builds no string
+    lvalue.swap(token.value);
 
     if(token.id == cm_cache::string || token.id == cm_cache::identifier) {
 
         next_token();
 
         if(token.id == cm_cache::input_end) {
-            return processor->do_read(lvalue, event);
+            return processor->do_read_view(lvalue, event);
         }
         return parse_error("read: expected end after key", event);
     }
@@ -32,6 +32,7 @@
 
 #include <exception>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -50,7 +51,8 @@ namespace cm_cache {
 
 enum token_type {
      input_end, error, comment, string, identifier, raw,
-        tk_add, tk_read, tk_read_remove, tk_remove, tk_watch, tk_watch_remove, tk_tag
+        tk_add, tk_read, tk_read_remove, tk_remove, tk_watch, tk_watch_remove, tk_tag,
+        tk_ttl
 };
 
 struct token_t {
@@ -68,6 +70,7 @@ struct cache_event {
     std::string pub_name;       // name to re-publish to
     std::string fingerprints;   // extracted fingerprints
     std::string result;
+    time_t ttl = 0;         // add: time to live in seconds (0 = none)
     bool notify = false;    // notify watchers
 
     cache_event() {}
@@ -76,7 +79,7 @@ struct cache_event {
     cache_event(int fd_, std::string request_): fd(fd_), request(request_) {}
     cache_event(const cache_event &r): fd(r.fd), request(r.request),
         name(r.name), tag(r.tag), value(r.value), pub_name(r.pub_name),
-        fingerprints(r.fingerprints), result(r.result),
+        fingerprints(r.fingerprints), result(r.result), ttl(r.ttl),
         notify(r.notify) {}
     
     cache_event &operator = (const cache_event &r) {
@@ -88,6 +91,7 @@ struct cache_event {
         pub_name = r.pub_name;
         result = r.result;
         fingerprints = r.fingerprints;
+        ttl = r.ttl;
         notify = r.notify;
         return *this;
     }
@@ -100,6 +104,7 @@ struct cache_event {
         value.clear();
         pub_name.clear();
         result.clear();
+        ttl = 0;
         notify = false;
     }
 };
@@ -108,7 +113,18 @@ class scanner_processor {
 
 public:
     virtual bool do_add(const std::string &name, const std::string &value, cache_event &event) = 0;
+    // add with a time to live (+key ~seconds value); a processor without
+    // an expiring store refuses it rather than keep the value forever
+    virtual bool do_add_ttl(const std::string &/*name*/, const std::string &/*value*/,
+        time_t /*ttl*/, cache_event &event) {
+        return do_error(event.request, "add: time to live not supported", event);
+    }
     virtual bool do_read(const std::string &name, cache_event &event) = 0;
+    // read with the key as a view into the scanner; a processor over a
+    // store can look it up in place (find/visit take a string_view)
+    virtual bool do_read_view(std::string_view name, cache_event &event) {
+        return do_read(std::string(name), event);
+    }
     virtual bool do_read_remove(const std::string &name, cache_event &event) = 0;
     virtual bool do_remove(const std::string &name, cache_event &event) = 0;
     virtual bool do_watch(const std::string &name, const std::string &tag, cache_event &event) = 0;
@@ -146,6 +162,15 @@ public:
                 ch == '=' || ch == '+' || ch == '/' || ch == '$');
     }
 
+    // ~seconds is a time to live only as '~', digits, then whitespace,
+    // so values such as ~25 or ~5m stay values
+    bool is_ttl() {
+        int n = index + 1;
+        if(!isdigit((unsigned char) buffer[n])) return false;
+        while(isdigit((unsigned char) buffer[n])) n++;
+        return buffer[n] != '\0' && isspace((unsigned char) buffer[n]);
+    }
+
     void accept(token_type id) { token.id = id; index++; }
     void skip_whitespace() { while(isspace( buffer[index] )) index++; }
     void skip_to_end() { while(buffer[index] != '\0') index++; }
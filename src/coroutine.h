@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COROUTINE_H
+#define __COROUTINE_H
+
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "thread.h"
+
+namespace cm_thread {
+
+// Coroutines on a pool. A co_task<T> is a coroutine returning T; it
+// does not run until it is awaited (or spawned), and the coroutine that
+// awaits it is resumed directly by the task's last step, so a chain of
+// nested co_awaits costs no pool round trips. co_await resume_on(p)
+// moves the running coroutine onto one of p's workers, and spawn(p, t)
+// starts t there, handing back a future for its result. A coroutine
+// that waits for something (see cm_net::io_reactor) gives its thread
+// back to the pool while it is suspended, so a few workers can carry
+// many requests in flight. Frames come from the task allocator.
+//
+// A coroutine queued on a pool that is stopped before it runs is not
+// resumed: the outermost frame of its chain (the one that is not a
+// co_task, e.g. spawn()'s) is destroyed, which destroys the co_tasks it
+// awaits, and a spawned task's future gets a "task abandoned" error.
+
+template<class T> class co_task;
+
+class co_promise_base {
+public:
+    std::coroutine_handle<> continuation;
+    std::coroutine_handle<> root;       // outermost frame of the chain
+    std::exception_ptr error;
+
+    static void *operator new(size_t size) { return task_alloc(size); }
+    static void operator delete(void *p) { task_free(p); }
+
+    // on completion, transfer to the awaiting coroutine (if any)
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> c = h.promise().continuation;
+            if(c) return c;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+// the frame that owns h's chain: destroying it destroys h
+template<class P>
+std::coroutine_handle<> co_root(std::coroutine_handle<P> h) {
+    if constexpr(std::is_base_of_v<co_promise_base, P>) {
+        if(h.promise().root) return h.promise().root;
+    }
+    return h;
+}
+
+// pool task resuming h; dropped without running (its pool stopped) it
+// destroys root instead
+class co_resume {
+    std::coroutine_handle<> h, root;
+
+    // do not implement these constructors
+    co_resume(const co_resume &r);
+    co_resume &operator = (const co_resume &r);
+
+public:
+    co_resume(std::coroutine_handle<> h_, std::coroutine_handle<> root_): h(h_), root(root_) {}
+    co_resume(co_resume &&r): h(r.h), root(r.root) { r.h = nullptr; }
+    ~co_resume() { if(h) root.destroy(); }
+
+    void operator()() {
+        std::coroutine_handle<> c = h;
+        h = nullptr;
+        c.resume();
+    }
+};
+
+template<class T>
+class co_promise: public co_promise_base {
+public:
+    std::optional<T> value;
+
+    co_task<T> get_return_object();
+
+    template<class V>
+    void return_value(V &&v) { value.emplace(std::forward<V>(v)); }
+
+    T result() {
+        if(error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<>
+class co_promise<void>: public co_promise_base {
+public:
+    co_task<void> get_return_object();
+
+    void return_void() {}
+
+    void result() {
+        if(error) std::rethrow_exception(error);
+    }
+};
+
+template<class T = void>
+class co_task {
+public:
+    using promise_type = co_promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+private:
+    handle_type handle;
+
+    // do not implement these constructors
+    co_task(const co_task &r);
+    co_task &operator = (const co_task &r);
+
+public:
+    explicit co_task(handle_type h): handle(h) {}
+    co_task(co_task &&r): handle(r.handle) { r.handle = nullptr; }
+    ~co_task() { if(handle) handle.destroy(); }
+
+    co_task &operator = (co_task &&r) {
+        if(this != &r) {
+            if(handle) handle.destroy();
+            handle = r.handle;
+            r.handle = nullptr;
+        }
+        return *this;
+    }
+
+    bool valid() { return (bool) handle; }
+
+    // co_await task: run it to completion on this thread (until it
+    // suspends), then yield its result or rethrow what it threw
+    bool await_ready() { return !handle || handle.done(); }
+
+    template<class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiting) {
+        handle.promise().continuation = awaiting;
+        handle.promise().root = co_root(awaiting);
+        return handle;
+    }
+
+    T await_resume() { return handle.promise().result(); }
+};
+
+template<class T>
+inline co_task<T> co_promise<T>::get_return_object() {
+    return co_task<T>(std::coroutine_handle<co_promise<T>>::from_promise(*this));
+}
+
+inline co_task<void> co_promise<void>::get_return_object() {
+    return co_task<void>(std::coroutine_handle<co_promise<void>>::from_promise(*this));
+}
+
+// co_await resume_on(p): continue on one of p's workers
+class resume_on {
+    pool &p;
+    task_priority prio;
+
+public:
+    resume_on(pool &p_, task_priority prio_ = task_priority::normal): p(p_), prio(prio_) {}
+
+    bool await_ready() { return false; }
+    template<class P>
+    void await_suspend(std::coroutine_handle<P> h) { p.execute(prio, co_resume(h, co_root(h))); }
+    void await_resume() {}
+};
+
+// a coroutine that starts at once and frees its own frame at the end
+class co_detached {
+public:
+    class promise_type {
+    public:
+        static void *operator new(size_t size) { return task_alloc(size); }
+        static void operator delete(void *p) { task_free(p); }
+
+        co_detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// result slot of a spawned co_task, shared with its future
+template<class T>
+class co_state: public typed_state<T> {
+
+    static void destroy_state(future_state *p) {
+        co_state *s = static_cast<co_state *>(p);
+        s->~co_state();
+        task_free(s);
+    }
+
+public:
+    co_state() { this->destroy = &destroy_state; }
+
+    // drops co_drive()'s reference when its frame goes, completing the
+    // future with an error if the frame was destroyed unfinished
+    struct holder {
+        co_state *s;
+        ~holder() {
+            if(!s->is_ready()) {
+                s->error = std::make_exception_ptr(std::runtime_error("task abandoned"));
+                s->complete();
+            }
+            s->release();
+        }
+    };
+};
+
+template<class T>
+co_detached co_drive(pool &p, co_task<T> t, co_state<T> *s) {
+    typename co_state<T>::holder hold{s};
+    co_await resume_on(p);
+    try {
+        if constexpr(std::is_void_v<T>) {
+            co_await t;
+            s->value.emplace();
+        }
+        else {
+            s->value.emplace(co_await t);
+        }
+    }
+    catch(...) {
+        s->error = std::current_exception();
+    }
+    s->complete();
+}
+
+// start t on p; the future yields its result or rethrows what it threw
+template<class T>
+future<T> spawn(pool &p, co_task<T> t) {
+    co_state<T> *s = new(task_alloc(sizeof(co_state<T>))) co_state<T>();
+    co_drive(p, std::move(t), s);
+    return future<T>(s);
+}
+
+} // namespace cm_thread
+
+#endif
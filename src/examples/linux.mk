@@ -43,13 +43,17 @@ EXE2 = rolling
 
 OBJS2 = rolling.o
 
+EXE3 = mkstore
+
+OBJS3 = mkstore.o
+
 default: all
 
 CC=g++
 CM_LIB_DIR=../
 INCLUDE = -I. -I$(CM_LIB_DIR)
-LDFLAGS = -m64 -g -lcm_64 -ldl -pthread -lssl -lcrypto -L$(CM_LIB_DIR)
-CCFLAGS = -m64 -g $(INCLUDE) -c -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE64_SOURCE
+LDFLAGS = -m64 -g -lcm_64 -ldl -pthread -lssl -lcrypto -lxml2 -L$(CM_LIB_DIR)
+CCFLAGS = -m64 -g $(INCLUDE) -c -std=c++2a -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE64_SOURCE
 
 POSIXFLAGS = -D_POSIX_PTHREAD_SEMANTICS -D_REENTRANT
 
@@ -62,12 +66,15 @@ $(EXE): $(OBJS)
 $(EXE2): $(OBJS2)
 	$(CC) $(OBJS2) $(LDFLAGS) -o $(EXE2)
 
+$(EXE3): $(OBJS3)
+	$(CC) $(OBJS3) $(LDFLAGS) -o $(EXE3)
+
 clean:
-	-@rm -rf *.o $(EXE) $(EXE2) *.log core.*
-	@echo "$(EXE) $(EXE2) $(@)ed"
+	-@rm -rf *.o $(EXE) $(EXE2) $(EXE3) *.log core.*
+	@echo "$(EXE) $(EXE2) $(EXE3) $(@)ed"
 
 all: clean prod
 
-prod: $(EXE) $(EXE2)
+prod: $(EXE) $(EXE2) $(EXE3)
 	export LD_LIBRARY_PATH=$(CM_LIB_DIR):$(LD_LIBRARY_PATH);$(PWD)/$(EXE);$(PWD)/$(EXE2)&
 
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <fstream>
+
+#include "record.h"
+#include "mapped_store.h"
+#include "util.h"
+#include "log.h"
+
+// mkstore: build a memory-mapped store (see mapped_store.h) from a
+// delimited record file, for processes that would otherwise load it with
+// cm_record::load_records_to_store at startup.
+
+int main( int argc, char* argv[] ) {
+
+    if(argc != 8) {
+        std::cerr << "usage: " << argv[0] <<
+            " spec.xml spec_name spec_version key_field value_field input output" << std::endl;
+        return 1;
+    }
+
+    std::string spec_path = argv[1];
+    std::string key_field = argv[4];
+    std::string value_field = argv[5];
+    std::string input = argv[6];
+    std::string output = argv[7];
+
+    cm_record::record_spec spec;
+    if(!cm_record::xml_load_record_spec(spec_path, argv[2], argv[3], &spec)) {
+        cm_log::error(cm_util::format("%s: spec %s:%s not found", spec_path.c_str(),
+            argv[2], argv[3]));
+        return 1;
+    }
+
+    if(spec.get_index(key_field) < 0 || spec.get_index(value_field) < 0) {
+        cm_log::error(cm_util::format("%s: unknown key or value field", spec_path.c_str()));
+        return 1;
+    }
+
+    std::ifstream is(input);
+    if(!is.is_open()) {
+        cm_log::error(cm_util::format("%s open failed", input.c_str()));
+        return 1;
+    }
+
+    cm_store::mapped_store_writer writer;
+    cm_record::record record(&spec);
+    cm_record::load_records_to_store(is, record, key_field, value_field, &writer);
+
+    if(writer.write(output) != 0) {
+        return 1;
+    }
+
+    cm_log::info(cm_util::format("%s: %lu entries", output.c_str(), writer.size()));
+    return 0;
+}
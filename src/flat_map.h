@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLAT_MAP_H
+#define __FLAT_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+
+namespace cm_store {
+
+// Open addressing hash map using Robin Hood linear probing.
+//
+// Entries are stored densely in one contiguous array (no node per entry).
+// The hash index is a separate power-of-two table of 8-byte buckets, each
+// holding the position of its entry plus a metadata word: the low 16 bits
+// hold the probe distance + 1 (0 marks an empty bucket) and the high 16
+// bits a hash fragment, so most mismatches are rejected without touching
+// the key. Robin Hood insertion keeps probe sequences short and lets a
+// lookup stop as soon as it reaches an entry closer to its home bucket
+// than the key being searched for. Erase backward shifts the index (no
+// tombstones) and moves the last entry into the hole, keeping entries
+// dense. Empty buckets cost 8 bytes rather than a whole entry, and short
+// string keys stay inline in the entry in the std::string small buffer.
+//
+// Implements the subset of the std::unordered_map interface used by
+// info_store (find, end, operator[], erase, size, swap, clear) so it can be
+// plugged in as its map type. Unlike std::unordered_map, operator[] and
+// erase may move other entries and so invalidate iterators and references.
+// Holds at most 2^32 - 1 entries.
+
+template<class keyT, class valueT, class hashT = std::hash<keyT>,
+         class equalT = std::equal_to<keyT>>
+class flat_map {
+
+public:
+    typedef keyT key_type;
+    typedef valueT mapped_type;
+    typedef std::pair<keyT,valueT> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+protected:
+    static const size_t npos = (size_t) -1;
+    static const size_t min_capacity = 16;
+    static const uint32_t dist_mask = 0xFFFF;
+
+    struct bucket {
+        uint32_t meta;
+        uint32_t index;     // position of entry in _values
+    };
+
+    std::vector<value_type> _values;
+    bucket *_buckets = nullptr;
+    size_t _capacity = 0;       // buckets: always 0 or a power of two
+    int _shift = 64;            // 64 - log2(_capacity)
+
+    hashT _hash;
+    equalT _equal;
+
+    // fibonacci hashing: spreads weak hashes (e.g. identity for ints)
+    template<class K>
+    uint64_t hash_of(const K &key) const {
+        return (uint64_t) _hash(key) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    size_t home(uint64_t h) const { return (size_t) (h >> _shift); }
+
+    // metadata word for an entry in its home bucket (distance 0)
+    static uint32_t meta_of(uint64_t h) {
+        return ((uint32_t) h & 0xFFFF0000) | 1;
+    }
+
+    // max load factor 7/8
+    size_t max_size() const { return _capacity - (_capacity >> 3); }
+
+    // returns the bucket for key or npos
+    template<class K>
+    size_t find_bucket(const K &key, uint64_t h) const {
+        if(_values.empty()) return npos;
+        size_t mask = _capacity - 1;
+        size_t i = home(h);
+        uint32_t m = meta_of(h);
+        while(true) {
+            uint32_t cur = _buckets[i].meta;
+            // empty bucket or an entry closer to home: key is not present
+            if((cur & dist_mask) < (m & dist_mask)) return npos;
+            if(cur == m && _equal(_values[_buckets[i].index].first, key)) return i;
+            i = (i + 1) & mask;
+            m++;
+        }
+    }
+
+    void place(uint32_t index, uint64_t h) {
+        size_t mask = _capacity - 1;
+        size_t i = home(h);
+        bucket b = { meta_of(h), index };
+        while(true) {
+            if(_buckets[i].meta == 0) {
+                _buckets[i] = b;
+                return;
+            }
+            if((_buckets[i].meta & dist_mask) < (b.meta & dist_mask)) {
+                // take from the rich: displace the entry closer to home
+                std::swap(b, _buckets[i]);
+            }
+            i = (i + 1) & mask;
+            if((++b.meta & dist_mask) == dist_mask) {
+                throw std::length_error("flat_map: probe length exceeded");
+            }
+        }
+    }
+
+    void rehash(size_t capacity) {
+        delete [] _buckets;
+        _buckets = new bucket[capacity]();
+        _capacity = capacity;
+        _shift = 64;
+        while(capacity > 1) {
+            capacity >>= 1;
+            _shift--;
+        }
+        for(size_t n = 0; n < _values.size(); ++n) {
+            place((uint32_t) n, hash_of(_values[n].first));
+        }
+    }
+
+    // remove bucket i from the index, backward shifting the following run
+    void unlink(size_t i) {
+        size_t mask = _capacity - 1;
+        size_t next = (i + 1) & mask;
+        while((_buckets[next].meta & dist_mask) > 1) {
+            _buckets[i] = _buckets[next];
+            _buckets[i].meta--;
+            i = next;
+            next = (next + 1) & mask;
+        }
+        _buckets[i].meta = 0;
+    }
+
+public:
+
+    flat_map() {}
+    ~flat_map() { delete [] _buckets; }
+
+    iterator begin() { return _values.begin(); }
+    iterator end() { return _values.end(); }
+    const_iterator begin() const { return _values.begin(); }
+    const_iterator end() const { return _values.end(); }
+
+    size_t size() const { return _values.size(); }
+    bool empty() const { return _values.empty(); }
+    size_t bucket_count() const { return _capacity; }
+
+    // bytes held by the map itself (not counting heap owned by entries)
+    size_t memory_usage() const {
+        return _values.capacity() * sizeof(value_type) +
+               _capacity * sizeof(bucket);
+    }
+
+    template<class K>
+    iterator find(const K &key) {
+        size_t i = find_bucket(key, hash_of(key));
+        return i == npos ? end() : begin() + _buckets[i].index;
+    }
+
+    template<class K>
+    const_iterator find(const K &key) const {
+        size_t i = find_bucket(key, hash_of(key));
+        return i == npos ? end() : begin() + _buckets[i].index;
+    }
+
+    template<class K>
+    size_t count(const K &key) const {
+        return find_bucket(key, hash_of(key)) == npos ? 0 : 1;
+    }
+
+    valueT &operator[](const keyT &key) {
+        uint64_t h = hash_of(key);
+        size_t i = find_bucket(key, h);
+        if(i != npos) return _values[_buckets[i].index].second;
+
+        if(_values.size() + 1 > max_size()) {
+            rehash(_capacity == 0 ? min_capacity : _capacity * 2);
+        }
+        _values.emplace_back(key, valueT());
+        place((uint32_t) (_values.size() - 1), h);
+        return _values.back().second;
+    }
+
+    template<class K>
+    size_t erase(const K &key) {
+        size_t i = find_bucket(key, hash_of(key));
+        if(i == npos) return 0;
+
+        uint32_t index = _buckets[i].index;
+        unlink(i);
+
+        // fill the hole with the last entry and repoint its bucket
+        uint32_t last = (uint32_t) (_values.size() - 1);
+        if(index != last) {
+            uint64_t h = hash_of(_values[last].first);
+            size_t mask = _capacity - 1;
+            size_t b = home(h);
+            while(_buckets[b].index != last || _buckets[b].meta == 0) {
+                b = (b + 1) & mask;
+            }
+            _buckets[b].index = index;
+            _values[index] = std::move(_values[last]);
+        }
+        _values.pop_back();
+        return 1;
+    }
+
+    // make room for n entries without further rehashing
+    void reserve(size_t n) {
+        size_t capacity = min_capacity;
+        while(capacity - (capacity >> 3) < n) capacity *= 2;
+        _values.reserve(n);
+        if(capacity > _capacity) rehash(capacity);
+    }
+
+    // remove all entries, keeps the allocated index
+    void clear() {
+        _values.clear();
+        for(size_t i = 0; i < _capacity; ++i) {
+            _buckets[i].meta = 0;
+        }
+    }
+
+    void swap(flat_map &r) {
+        _values.swap(r._values);
+        std::swap(_buckets, r._buckets);
+        std::swap(_capacity, r._capacity);
+        std::swap(_shift, r._shift);
+        std::swap(_hash, r._hash);
+        std::swap(_equal, r._equal);
+    }
+
+private:
+
+    // do not implement these constructors
+    flat_map(const flat_map&);
+    const flat_map& operator=(const flat_map&);
+
+};
+
+} // namespace cm_store
+
+#endif  // __FLAT_MAP_H
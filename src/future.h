@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FUTURE_H
+#define __FUTURE_H
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+namespace cm_thread {
+
+// Fixed size blocks for task state, recycled through per-thread free
+// lists (size classes of 64 bytes up to 1K, larger requests go to the
+// heap). A block freed on another thread is pushed back to the free
+// list of the thread that allocated it, so a producer submitting to a
+// pool gets its blocks back from the workers instead of allocating new
+// ones. Blocks are 16 byte aligned.
+
+#define TASK_ALLOC_ALIGN    16
+
+void *task_alloc(size_t size);
+void task_free(void *p);
+
+// State shared by a submitted task and its future. status moves from
+// pending (or pending with a continuation attached) to ready exactly
+// once; waiters block on the status word itself (futex backed atomic
+// wait), so nothing is polled and an uncontended completion makes no
+// system call. The state is freed when both the task and the future
+// have released it.
+
+class future_state {
+
+protected:
+    enum { pending = 0, ready = 1, chained = 2 };
+
+    std::atomic<uint32_t> status{pending};
+    std::atomic<int> refs{2};
+    void (*destroy)(future_state *) = nullptr;
+    void (*continuation)(void *) = nullptr;
+    void *continuation_arg = nullptr;
+
+public:
+    std::exception_ptr error;
+
+    bool is_ready() { return status.load(std::memory_order_acquire) == ready; }
+
+    void wait() {
+        uint32_t s;
+        while((s = status.load(std::memory_order_acquire)) != ready) {
+            status.wait(s, std::memory_order_acquire);
+        }
+    }
+
+    // publish the result: wake waiters, then run the continuation (if
+    // any) on this thread
+    void complete() {
+        uint32_t old = status.exchange(ready, std::memory_order_acq_rel);
+        status.notify_all();
+        if(old == chained) continuation(continuation_arg);
+    }
+
+    // run fn(arg) once the state is ready (now, if it already is); one
+    // continuation per state
+    void then(void (*fn)(void *), void *arg) {
+        continuation = fn;
+        continuation_arg = arg;
+        uint32_t expected = pending;
+        if(!status.compare_exchange_strong(expected, chained, std::memory_order_acq_rel)) {
+            fn(arg);
+        }
+    }
+
+    void release() {
+        if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy(this);
+    }
+};
+
+template<class R>
+class typed_state: public future_state {
+public:
+    using value_type = std::conditional_t<std::is_void_v<R>, std::monostate, R>;
+    std::optional<value_type> value;
+};
+
+// callable and result in one block: the task queue carries a pointer to
+// it, run() is the task function and abandon() the task dealloc
+template<class R, class F>
+class task_state: public typed_state<R> {
+
+    F fn;
+
+    static void destroy_state(future_state *p) {
+        task_state *s = static_cast<task_state *>(p);
+        s->~task_state();
+        task_free(s);
+    }
+
+public:
+    template<class G>
+    task_state(G &&g): fn(std::forward<G>(g)) { this->destroy = &destroy_state; }
+
+    static void run(void *p) {
+        task_state *s = static_cast<task_state *>(p);
+        try {
+            if constexpr(std::is_void_v<R>) {
+                std::invoke(s->fn);
+                s->value.emplace();
+            }
+            else {
+                s->value.emplace(std::invoke(s->fn));
+            }
+        }
+        catch(...) {
+            s->error = std::current_exception();
+        }
+        s->complete();
+    }
+
+    // called after run(), or instead of it when the pool shuts down
+    // with the task still queued
+    static void abandon(void *p) {
+        task_state *s = static_cast<task_state *>(p);
+        if(!s->is_ready()) {
+            s->error = std::make_exception_ptr(std::runtime_error("task abandoned"));
+            s->complete();
+        }
+        s->release();
+    }
+};
+
+template<class R>
+class future {
+
+    template<class T> friend class future;
+    friend class when_all_state;
+
+    typed_state<R> *state = nullptr;
+
+    // do not implement these constructors
+    future(const future &r);
+    future &operator = (const future &r);
+
+public:
+    future() {}
+    explicit future(typed_state<R> *s): state(s) {}
+    future(future &&r): state(r.state) { r.state = nullptr; }
+    ~future() { if(state) state->release(); }
+
+    future &operator = (future &&r) {
+        if(this != &r) {
+            if(state) state->release();
+            state = r.state;
+            r.state = nullptr;
+        }
+        return *this;
+    }
+
+    bool valid() { return state != nullptr; }
+    bool ready() { return state && state->is_ready(); }
+    void wait() { if(state) state->wait(); }
+
+    // wait for the task, then return its result or rethrow what it
+    // threw; the value is moved out, so call once
+    R get() {
+        if(!state) throw std::logic_error("future has no state");
+        state->wait();
+        if(state->error) std::rethrow_exception(state->error);
+        if constexpr(!std::is_void_v<R>) return std::move(*state->value);
+    }
+};
+
+// Counts down as the futures it watches become ready; ready itself when
+// the last one is. Holds one extra count while the continuations are
+// being attached so it cannot complete early.
+
+class when_all_state: public typed_state<void> {
+
+    std::atomic<size_t> remaining{1};
+
+    static void destroy_state(future_state *p) {
+        when_all_state *s = static_cast<when_all_state *>(p);
+        s->~when_all_state();
+        task_free(s);
+    }
+
+public:
+    when_all_state() { destroy = &destroy_state; }
+
+    static void arrive(void *p) {
+        when_all_state *s = static_cast<when_all_state *>(p);
+        if(s->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            s->value.emplace();
+            s->complete();
+            s->release();
+        }
+    }
+
+    template<class R>
+    void watch(future<R> &f) {
+        if(!f.state) return;
+        remaining.fetch_add(1, std::memory_order_relaxed);
+        f.state->then(&arrive, this);
+    }
+
+    static when_all_state *create() {
+        return new(task_alloc(sizeof(when_all_state))) when_all_state();
+    }
+};
+
+// future that becomes ready once all of the given futures are ready; it
+// carries no values (get() on each input for those, including errors).
+// A future can be watched by only one when_all.
+
+template<class... Rs>
+future<void> when_all(future<Rs> &... fs) {
+    when_all_state *s = when_all_state::create();
+    (s->watch(fs), ...);
+    when_all_state::arrive(s);
+    return future<void>(s);
+}
+
+template<class It>
+future<void> when_all(It first, It last) {
+    when_all_state *s = when_all_state::create();
+    for(; first != last; ++first) s->watch(*first);
+    when_all_state::arrive(s);
+    return future<void>(s);
+}
+
+// block until all of the futures in [first, last) are ready
+template<class It>
+void wait_all(It first, It last) {
+    for(; first != last; ++first) first->wait();
+}
+
+} // namespace cm_thread
+
+#endif
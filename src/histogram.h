@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <algorithm>
+
+#include "util.h"
+
+namespace cm_util {
+
+// Relaxed atomic access to plain 64-bit counters. These are the GCC
+// builtins rather than std::atomic members, and always inlined, because
+// the library is built -O0 by default: there an std::atomic load and
+// store pair, or a call, costs about as much as a whole pool task.
+// counter_add() is for a counter with a single writer.
+
+#define COUNTER_INLINE inline __attribute__((always_inline))
+
+COUNTER_INLINE uint64_t counter_load(const uint64_t &c) {
+    return __atomic_load_n(&c, __ATOMIC_RELAXED);
+}
+
+COUNTER_INLINE void counter_store(uint64_t &c, uint64_t v) {
+    __atomic_store_n(&c, v, __ATOMIC_RELAXED);
+}
+
+COUNTER_INLINE void counter_add(uint64_t &c, uint64_t n) {
+    __atomic_store_n(&c, __atomic_load_n(&c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// HDR style histogram of 64-bit values (nanoseconds, bytes, ...): values
+// below 16 have a bucket each, above that every power of 2 is cut into
+// 16 linear buckets, so any recorded value (min and max included) is
+// known to within 1/16 of itself. Values from 2^HDR_MAX_BITS up are
+// counted in the last bucket.
+//
+// record() is for a histogram with one writer (a worker's own): relaxed
+// loads and stores, no atomic read-modify-write. add() may be called
+// from any number of threads. Readers never lock; what they see while
+// writers run may be a few counts behind. Histograms merge by adding
+// buckets, so per thread histograms can be combined on demand.
+
+#define HDR_SUB_BITS    4
+#define HDR_SUB_BUCKETS (1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS    42      // 2^42 ns: over an hour
+#define HDR_BUCKETS     ((HDR_MAX_BITS - HDR_SUB_BITS + 1) * HDR_SUB_BUCKETS)
+
+class hdr_histogram {
+
+    uint64_t buckets[HDR_BUCKETS] = {};
+    uint64_t sum = 0;
+
+public:
+    hdr_histogram() { }
+    hdr_histogram(const hdr_histogram &r) { merge(r); }
+    hdr_histogram &operator = (const hdr_histogram &r) {
+        if(this != &r) {
+            clear();
+            merge(r);
+        }
+        return *this;
+    }
+
+    COUNTER_INLINE static int bucket_of(uint64_t v) {
+        if(v >= ((uint64_t) 1 << HDR_MAX_BITS)) v = ((uint64_t) 1 << HDR_MAX_BITS) - 1;
+        if(v < HDR_SUB_BUCKETS) return (int) v;
+        int shift = 63 - __builtin_clzll(v) - HDR_SUB_BITS;
+        return ((shift + 1) << HDR_SUB_BITS) + (int) ((v >> shift) & (HDR_SUB_BUCKETS - 1));
+    }
+
+    // smallest value counted in bucket b
+    static uint64_t bucket_low(int b) {
+        if(b < HDR_SUB_BUCKETS) return (uint64_t) b;
+        int shift = (b >> HDR_SUB_BITS) - 1;
+        return (uint64_t) (HDR_SUB_BUCKETS + (b & (HDR_SUB_BUCKETS - 1))) << shift;
+    }
+
+    // largest value counted in bucket b
+    static uint64_t bucket_high(int b) {
+        if(b < HDR_SUB_BUCKETS) return (uint64_t) b;
+        return bucket_low(b) + ((uint64_t) 1 << ((b >> HDR_SUB_BITS) - 1)) - 1;
+    }
+
+    // single writer
+    COUNTER_INLINE void record(uint64_t v) {
+        counter_add(buckets[bucket_of(v)], 1);
+        counter_add(sum, v);
+    }
+
+    // any number of writers
+    void add(uint64_t v) {
+        __atomic_fetch_add(&buckets[bucket_of(v)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sum, v, __ATOMIC_RELAXED);
+    }
+
+    // adds r's counts to this one (r may still be written to)
+    void merge(const hdr_histogram &r) {
+        for(int b = 0; b < HDR_BUCKETS; b++) {
+            uint64_t c = r.bucket_count(b);
+            if(c) __atomic_fetch_add(&buckets[b], c, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&sum, counter_load(r.sum), __ATOMIC_RELAXED);
+    }
+
+    void clear() {
+        for(auto &b: buckets) counter_store(b, 0);
+        counter_store(sum, 0);
+    }
+
+    // summed on demand: a record is one bucket and the sum
+    uint64_t count() const {
+        uint64_t n = 0;
+        for(int b = 0; b < HDR_BUCKETS; b++) n += bucket_count(b);
+        return n;
+    }
+
+    // smallest and largest value of the lowest and highest non-empty
+    // buckets
+    uint64_t min() const {
+        for(int b = 0; b < HDR_BUCKETS; b++) {
+            if(bucket_count(b)) return bucket_low(b);
+        }
+        return 0;
+    }
+
+    uint64_t max() const {
+        for(int b = HDR_BUCKETS - 1; b >= 0; b--) {
+            if(bucket_count(b)) return bucket_high(b);
+        }
+        return 0;
+    }
+
+    uint64_t bucket_count(int b) const { return counter_load(buckets[b]); }
+
+    // sum of the recorded values
+    uint64_t total() const { return counter_load(sum); }
+
+    double mean() const {
+        uint64_t n = count();
+        return n ? (double) counter_load(sum) / n : 0.0;
+    }
+
+    // largest value of the bucket holding the pct percentile
+    uint64_t percentile(double pct) const {
+        uint64_t n = count();
+        if(n == 0) return 0;
+        uint64_t rank = (uint64_t) (n * pct / 100.0), seen = 0;
+        for(int b = 0; b < HDR_BUCKETS; b++) {
+            seen += bucket_count(b);
+            if(seen > rank) return bucket_high(b);
+        }
+        return max();
+    }
+
+    // "count: 1000 min: 80 p50: 95 p90: 120 p99: 300 p99.9: 950 max: 1024 mean: 101.3"
+    std::string to_text() const {
+        return cm_util::format("count: %lu min: %lu p50: %lu p90: %lu p99: %lu p99.9: %lu max: %lu mean: %.1lf",
+            count(), min(), percentile(50), percentile(90), percentile(99), percentile(99.9),
+            max(), mean());
+    }
+
+    // summary plus the non-empty buckets as [low, high, count]
+    std::string to_json() const {
+        std::string s = cm_util::format("{\"count\":%lu,\"min\":%lu,\"max\":%lu,\"mean\":%.1lf,"
+            "\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"buckets\":[",
+            count(), min(), max(), mean(), percentile(50), percentile(90), percentile(99),
+            percentile(99.9));
+        bool first = true;
+        for(int b = 0; b < HDR_BUCKETS; b++) {
+            uint64_t c = bucket_count(b);
+            if(c == 0) continue;
+            s.append(cm_util::format("%s[%lu,%lu,%lu]", first ? "" : ",", bucket_low(b),
+                bucket_high(b), c));
+            first = false;
+        }
+        s.append("]}");
+        return s;
+    }
+};
+
+} // namespace cm_util
+
+#endif
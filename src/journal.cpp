@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "util.h"
+#include "journal.h"
+
+#define JOURNAL_HEADER_SIZE     8
+#define JOURNAL_RECORD_OVERHEAD 13      // op, key_len, value_len, checksum
+#define SNAPSHOT_BUFFER_SIZE    (1024 * 1024)
+
+static uint32_t fnv1a(const char *p, size_t sz, uint32_t h = 2166136261U) {
+    for(size_t n = 0; n < sz; n++) {
+        h ^= (unsigned char) p[n];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void put_header(std::string &buf, const char *magic) {
+    uint32_t version = JOURNAL_VERSION;
+    buf.append(magic, 4);
+    buf.append((const char *) &version, sizeof(version));
+}
+
+static void put_record(std::string &buf, char op, std::string_view name,
+    std::string_view value) {
+
+    uint32_t key_len = (uint32_t) name.size();
+    uint32_t value_len = (uint32_t) value.size();
+    size_t start = buf.size();
+
+    buf.push_back(op);
+    buf.append((const char *) &key_len, sizeof(key_len));
+    buf.append((const char *) &value_len, sizeof(value_len));
+    buf.append(name.data(), name.size());
+    buf.append(value.data(), value.size());
+
+    uint32_t checksum = fnv1a(buf.data() + start, buf.size() - start);
+    buf.append((const char *) &checksum, sizeof(checksum));
+}
+
+static int write_all(int fd, const char *p, size_t sz) {
+    while(sz > 0) {
+        ssize_t n = ::write(fd, p, sz);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+static void sync_dir(const std::string &path) {
+    size_t pos = path.rfind('/');
+    std::string dir = pos == std::string::npos ? "." :
+        (pos == 0 ? "/" : path.substr(0, pos));
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if(dfd >= 0) {
+        fsync(dfd);
+        ::close(dfd);
+    }
+}
+
+int cm_store::journal::open(const std::string &base_path) {
+    _mutex.lock();
+    base = base_path;
+    int rc = open_log();
+    _mutex.unlock();
+    return rc;
+}
+
+// open base.log, cutting off any torn tail left by a crash
+int cm_store::journal::open_log() {
+
+    std::string path = log_path();
+    off_t valid_end = 0;
+
+    if(replay(path, JOURNAL_MAGIC, [](char, std::string_view, std::string_view) {},
+        &valid_end) < 0) {
+        return -1;
+    }
+
+    fd = ::open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    if(fd < 0) {
+        cm_log::error(cm_util::format("%s open failed: %s", path.c_str(), strerror(errno)));
+        return -1;
+    }
+
+    if(valid_end < JOURNAL_HEADER_SIZE) {
+        // new or unusable file: start over with a fresh header
+        std::string header;
+        put_header(header, JOURNAL_MAGIC);
+        if(ftruncate(fd, 0) != 0 || write_all(fd, header.data(), header.size()) != 0 ||
+           fdatasync(fd) != 0) {
+            cm_log::error(cm_util::format("%s write failed: %s", path.c_str(), strerror(errno)));
+            ::close(fd);
+            fd = -1;
+            return -1;
+        }
+        sync_dir(path);
+    }
+    else {
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > valid_end) {
+            cm_log::warning(cm_util::format("%s: dropping %ld bytes of torn tail",
+                path.c_str(), (long) (st.st_size - valid_end)));
+            if(ftruncate(fd, valid_end) != 0) {
+                cm_log::error(cm_util::format("%s truncate failed: %s", path.c_str(), strerror(errno)));
+            }
+        }
+        lseek(fd, valid_end, SEEK_SET);
+    }
+
+    failed = false;
+    return 0;
+}
+
+void cm_store::journal::close() {
+    if(fd >= 0) {
+        sync();
+        _mutex.lock();
+        ::close(fd);
+        fd = -1;
+        _mutex.unlock();
+    }
+}
+
+uint64_t cm_store::journal::append(char op, std::string_view name, std::string_view value) {
+    _mutex.lock();
+    put_record(pending, op, name, value);
+    uint64_t seq = ++appended;
+    _mutex.unlock();
+    return seq;
+}
+
+// write and fdatasync everything pending; called with _mutex held and
+// flushing set, releases the mutex around the I/O
+int cm_store::journal::flush_locked() {
+
+    std::string batch;
+    batch.swap(pending);
+    uint64_t target = appended;
+
+    _mutex.unlock();
+    int rc = 0;
+    if(fd < 0 || write_all(fd, batch.data(), batch.size()) != 0 || fdatasync(fd) != 0) {
+        cm_log::error(cm_util::format("%s write failed: %s", log_path().c_str(), strerror(errno)));
+        rc = -1;
+    }
+    _mutex.lock();
+
+    if(rc == 0) {
+        synced = target;
+        batches++;
+    }
+    else {
+        failed = true;
+    }
+    return rc;
+}
+
+int cm_store::journal::commit(uint64_t seq) {
+
+    _mutex.lock();
+
+    while(synced < seq && !failed) {
+        if(flushing) {
+            // a leader is writing; our record is either in its batch or
+            // we lead the next one
+            _cond.wait(_mutex);
+            continue;
+        }
+        flushing = true;
+        flush_locked();
+        flushing = false;
+        _cond.broadcast();
+    }
+
+    int rc = synced >= seq ? 0 : -1;
+    _mutex.unlock();
+    return rc;
+}
+
+int cm_store::journal::sync() {
+    _mutex.lock();
+    uint64_t seq = appended;
+    _mutex.unlock();
+    return commit(seq);
+}
+
+int cm_store::journal::rotate() {
+
+    // no set(store, ...) / remove(store, ...) between its append and its
+    // store update: everything in the rotated log is in the store
+    _apply.lock();
+    _mutex.lock();
+
+    while(flushing) {
+        _cond.wait(_mutex);
+    }
+
+    if(!pending.empty()) {
+        flushing = true;
+        flush_locked();
+        flushing = false;
+        _cond.broadcast();
+    }
+
+    if(failed || fd < 0) {
+        _mutex.unlock();
+        _apply.unlock();
+        return -1;
+    }
+
+    // an earlier checkpoint that did not finish left base.log.old behind;
+    // keep it and leave base.log in place (replay covers both)
+    if(access(old_path().c_str(), F_OK) == 0) {
+        _mutex.unlock();
+        _apply.unlock();
+        return 0;
+    }
+
+    ::close(fd);
+    fd = -1;
+
+    int rc = 0;
+    if(rename(log_path().c_str(), old_path().c_str()) != 0) {
+        cm_log::error(cm_util::format("%s rename failed: %s", log_path().c_str(), strerror(errno)));
+        rc = -1;
+    }
+    if(open_log() != 0) {
+        rc = -1;
+    }
+
+    _mutex.unlock();
+    _apply.unlock();
+    return rc;
+}
+
+void cm_store::journal::retire() {
+    _mutex.lock();
+    unlink(old_path().c_str());
+    sync_dir(old_path());
+    _mutex.unlock();
+}
+
+uint64_t cm_store::journal::sync_count() {
+    _mutex.lock();
+    uint64_t n = batches;
+    _mutex.unlock();
+    return n;
+}
+
+int cm_store::journal::replay(const std::string &path, const char *magic,
+    replay_fn fn, off_t *valid_end) {
+
+    if(valid_end) *valid_end = 0;
+
+    int rfd = ::open(path.c_str(), O_RDONLY);
+    if(rfd < 0) {
+        if(errno == ENOENT) return 0;
+        cm_log::error(cm_util::format("%s open failed: %s", path.c_str(), strerror(errno)));
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(rfd, &st) != 0) {
+        cm_log::error(cm_util::format("%s stat failed: %s", path.c_str(), strerror(errno)));
+        ::close(rfd);
+        return -1;
+    }
+
+    size_t size = (size_t) st.st_size;
+    if(size < JOURNAL_HEADER_SIZE) {
+        ::close(rfd);
+        return 0;
+    }
+
+    const char *base = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, rfd, 0);
+    ::close(rfd);
+    if(base == MAP_FAILED) {
+        cm_log::error(cm_util::format("%s mmap failed: %s", path.c_str(), strerror(errno)));
+        return -1;
+    }
+    madvise((void *) base, size, MADV_SEQUENTIAL);
+
+    uint32_t version = 0;
+    memcpy(&version, base + 4, sizeof(version));
+    if(memcmp(base, magic, 4) != 0 || version != JOURNAL_VERSION) {
+        cm_log::error(cm_util::format("%s: not a version %d %s file", path.c_str(),
+            JOURNAL_VERSION, magic));
+        munmap((void *) base, size);
+        return -1;
+    }
+
+    int count = 0;
+    size_t pos = JOURNAL_HEADER_SIZE;
+
+    while(size - pos >= JOURNAL_RECORD_OVERHEAD) {
+        const char *p = base + pos;
+        uint32_t key_len, value_len, checksum;
+        memcpy(&key_len, p + 1, sizeof(key_len));
+        memcpy(&value_len, p + 5, sizeof(value_len));
+
+        size_t len = 9 + (size_t) key_len + (size_t) value_len;
+        if(len + 4 > size - pos) break;
+
+        memcpy(&checksum, p + len, sizeof(checksum));
+        if(checksum != fnv1a(p, len)) break;
+
+        fn(p[0], std::string_view(p + 9, key_len), std::string_view(p + 9 + key_len, value_len));
+        pos += len + 4;
+        count++;
+    }
+
+    if(valid_end) *valid_end = (off_t) pos;
+
+    munmap((void *) base, size);
+    return count;
+}
+
+int cm_store::journal::write_snapshot(const std::string &path,
+    std::function<void(replay_fn &emit)> producer) {
+
+    std::string tmp_path = path + ".tmp";
+    int wfd = ::open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(wfd < 0) {
+        cm_log::error(cm_util::format("%s open failed: %s", tmp_path.c_str(), strerror(errno)));
+        return -1;
+    }
+
+    std::string buf;
+    buf.reserve(SNAPSHOT_BUFFER_SIZE + 4096);
+    put_header(buf, SNAPSHOT_MAGIC);
+    int rc = 0;
+
+    replay_fn emit = [&](char op, std::string_view name, std::string_view value) {
+        put_record(buf, op, name, value);
+        if(buf.size() >= SNAPSHOT_BUFFER_SIZE && rc == 0) {
+            rc = write_all(wfd, buf.data(), buf.size());
+            buf.clear();
+        }
+    };
+    producer(emit);
+
+    if(rc == 0) rc = write_all(wfd, buf.data(), buf.size());
+    if(rc == 0) rc = fsync(wfd);
+    ::close(wfd);
+
+    if(rc == 0) {
+        rc = rename(tmp_path.c_str(), path.c_str());
+    }
+    if(rc != 0) {
+        cm_log::error(cm_util::format("%s write failed: %s", path.c_str(), strerror(errno)));
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    sync_dir(path);
+    return 0;
+}
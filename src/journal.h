@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "mutex.h"
+#include "store.h"
+
+namespace cm_store {
+
+// Append-only journal of store mutations plus compacted snapshots.
+//
+// Files are derived from a base path:
+//
+//   base.log       current journal
+//   base.log.old   journal rotated out by a running checkpoint
+//   base.snap      last complete snapshot
+//
+// Both files start with an 8 byte header (magic, version) followed by
+// records of:
+//
+//   op(1) key_len(4) value_len(4) key value checksum(4)
+//
+// op is '+' (set), '-' or '!' (remove). The checksum is FNV-1a over the
+// preceding bytes of the record so a torn write at the tail of the log
+// is detected and dropped on recovery.
+//
+// append() only buffers the record. commit(seq) returns once seq is on
+// disk: the first committer writes and fdatasyncs everything buffered
+// so far while later committers wait for it, so concurrent writers share
+// one fsync per batch (group commit).
+//
+// Records replay idempotently in order, so recovery loads the snapshot
+// and replays base.log.old and base.log on top of it, even when some of
+// those records predate the snapshot.
+//
+// checkpoint() may only drop base.log.old once every record in it is in
+// the store. Writers get that by journaling and applying a change with
+// set(store, ...) / remove(store, ...), which rotate() waits for, or by
+// updating the store before calling add() / remove(). set(store, ...)
+// and remove(store, ...) also journal and apply changes to one key in
+// the same order, so the store holds what recovery would rebuild.
+
+#define JOURNAL_MAGIC       "CMJ1"
+#define SNAPSHOT_MAGIC      "CMS1"
+#define JOURNAL_VERSION     1
+#define JOURNAL_KEY_STRIPES 64      // key locks of set(store, ...)
+
+class journal {
+
+protected:
+    std::string base;
+    int fd = -1;
+
+    cm::mutex _mutex;
+    cm::cond _cond;
+
+    // held shared from append to store update by set(store, ...) and
+    // remove(store, ...), exclusively by rotate()
+    cm::rwlock _apply;
+
+    // held by set(store, ...) and remove(store, ...) from append to
+    // store update, for the key's stripe
+    cm::mutex _stripes[JOURNAL_KEY_STRIPES];
+
+    cm::mutex &stripe(const std::string &name) {
+        return _stripes[std::hash<std::string>()(name) % JOURNAL_KEY_STRIPES];
+    }
+
+    std::string pending;        // buffered records not yet written
+    uint64_t appended = 0;      // sequence of the last appended record
+    uint64_t synced = 0;        // sequence of the last durable record
+    uint64_t batches = 0;       // number of fdatasync calls
+    bool flushing = false;
+    bool failed = false;
+
+    int open_log();
+    int flush_locked();
+
+public:
+    typedef std::function<void(char op, std::string_view name, std::string_view value)> replay_fn;
+
+    journal() { }
+    ~journal() { close(); }
+
+    // open (or create) base.log for appending, 0 on success
+    int open(const std::string &base_path);
+    void close();
+
+    uint64_t append(char op, std::string_view name, std::string_view value);
+
+    uint64_t add(std::string_view name, std::string_view value) {
+        return append('+', name, value);
+    }
+
+    uint64_t remove(std::string_view name) {
+        return append('-', name, std::string_view());
+    }
+
+    // journal a change and apply it to store as one step with respect to
+    // checkpoint() and to other changes of the same key; returns the
+    // sequence to commit()
+    template<class storeT>
+    uint64_t set(storeT &store, const std::string &name, const std::string &value) {
+        cm::mutex &key = stripe(name);
+        _apply.read_lock();
+        key.lock();
+        uint64_t seq = add(name, value);
+        store.set(name, value);
+        key.unlock();
+        _apply.unlock();
+        return seq;
+    }
+
+    template<class storeT>
+    uint64_t remove(storeT &store, const std::string &name) {
+        cm::mutex &key = stripe(name);
+        _apply.read_lock();
+        key.lock();
+        uint64_t seq = remove(name);
+        store.remove(name);
+        key.unlock();
+        _apply.unlock();
+        return seq;
+    }
+
+    // wait until seq is durable, 0 on success
+    int commit(uint64_t seq);
+
+    // make everything appended so far durable
+    int sync();
+
+    // rotate base.log to base.log.old (unless an earlier checkpoint left
+    // one behind), 0 on success
+    int rotate();
+
+    // drop base.log.old once the snapshot covering it is in place
+    void retire();
+
+    uint64_t sync_count();
+
+    const std::string log_path() { return base + ".log"; }
+    const std::string old_path() { return base + ".log.old"; }
+    const std::string snap_path() { return base + ".snap"; }
+
+    // replay a journal or snapshot file through fn; returns the number of
+    // records, 0 for a missing file or -1 if the file cannot be read. A
+    // torn or corrupt tail ends the replay, valid_end receives the offset
+    // of the first byte not replayed.
+    static int replay(const std::string &path, const char *magic, replay_fn fn,
+        off_t *valid_end = nullptr);
+
+    // write a snapshot atomically (tmp file, fsync, rename); producer is
+    // called with an emit function for each entry. 0 on success.
+    static int write_snapshot(const std::string &path,
+        std::function<void(replay_fn &emit)> producer);
+
+    // rebuild store from base.snap, base.log.old and base.log; returns the
+    // number of records applied or -1 on error
+    template<class storeT>
+    int recover(storeT &store) {
+        replay_fn apply = [&store](char op, std::string_view name, std::string_view value) {
+            if(op == '+') {
+                store.set(std::string(name), std::string(value));
+            }
+            else {
+                store.remove(std::string(name));
+            }
+        };
+
+        int count = 0;
+        for(const std::string &path: { snap_path(), old_path(), log_path() }) {
+            int n = replay(path, path == snap_path() ? SNAPSHOT_MAGIC : JOURNAL_MAGIC, apply);
+            if(n > 0) count += n;
+        }
+        return count;
+    }
+
+    // compact: rotate the log, snapshot store, then drop the rotated log.
+    // Entries are copied out one shard at a time (the whole map for an
+    // unsharded store) and written with no store lock held, so writers
+    // keep appending to the new log and updating the store meanwhile.
+    template<class storeT>
+    int checkpoint(storeT &store) {
+        if(rotate() != 0) {
+            return -1;
+        }
+
+        int rc = write_snapshot(snap_path(), [&store](replay_fn &emit) {
+            std::vector<std::pair<std::string,std::string>> batch;
+            auto copy = [&batch](const std::string &name, const std::string &value) {
+                batch.emplace_back(name, value);
+            };
+            auto write = [&batch, &emit]() {
+                for(auto &e: batch) emit('+', e.first, e.second);
+                batch.clear();
+            };
+
+            if constexpr(requires { store.shard_count(); }) {
+                store.for_each_shard([&copy, &write](auto &shard) {
+                    shard.for_each(copy);
+                    write();
+                });
+            }
+            else {
+                store.for_each(copy);
+                write();
+            }
+        });
+
+        if(rc == 0) {
+            retire();
+        }
+        return rc;
+    }
+
+private:
+    // do not implement these constructors
+    journal(const journal &);
+    const journal &operator=(const journal &);
+};
+
+} // namespace cm_store
+
+#endif  // __JOURNAL_H
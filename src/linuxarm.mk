@@ -40,7 +40,7 @@ POSIX_FLAGS = -D_POSIX_PTHREAD_SEMANTICS
 CM_LIB_VERSION=$(CM_VERSION)
 DEBUG= -g
 INCLUDE = -I. -I$(TOP)/ 
-CCFLAGS = $(INCLUDE) -c $(DEBUG) -fPIC -D__LINUX_BOX__
+CCFLAGS = $(INCLUDE) -c -std=c++2a $(DEBUG) -fPIC -D__LINUX_BOX__
 LDFLAGS = -pthread -ldl -lssl $(DEBUG) 
 CC=g++
 
@@ -49,8 +49,11 @@ CM_OBJS = OBJDIR_$(WORD_SIZE)/config.o \
     OBJDIR_$(WORD_SIZE)/cache.o \
     OBJDIR_$(WORD_SIZE)/network.o \
     OBJDIR_$(WORD_SIZE)/thread.o \
+    OBJDIR_$(WORD_SIZE)/parallel.o \
     OBJDIR_$(WORD_SIZE)/queue.o \
 	OBJDIR_$(WORD_SIZE)/store.o \
+	OBJDIR_$(WORD_SIZE)/journal.o \
+	OBJDIR_$(WORD_SIZE)/mapped_store.o \
 	OBJDIR_$(WORD_SIZE)/util.o \
     OBJDIR_$(WORD_SIZE)/base64.o \
 	OBJDIR_$(WORD_SIZE)/log.o \
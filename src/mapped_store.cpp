@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "util.h"
+#include "mapped_store.h"
+
+#define MAPPED_WRITE_BUFFER     (1024 * 1024)
+
+static uint64_t align8(uint64_t n) { return (n + 7) & ~7ULL; }
+
+static int write_all(int fd, const char *p, size_t sz) {
+    while(sz > 0) {
+        ssize_t n = ::write(fd, p, sz);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+int cm_store::mapped_store_writer::write(const std::string &path) {
+
+    struct item {
+        uint64_t hash;
+        const std::string *name;
+        const std::string *value;
+    };
+
+    // the file holds lengths and radix indexes as 32 bits
+    if(entries.size() > UINT32_MAX) {
+        cm_log::error(cm_util::format("%s: too many entries: %lu", path.c_str(),
+            entries.size()));
+        return -1;
+    }
+
+    std::vector<item> items;
+    items.reserve(entries.size());
+    for(auto &p: entries) {
+        if(p.first.size() > UINT32_MAX || p.second.size() > UINT32_MAX) {
+            cm_log::error(cm_util::format("%s: entry too large: %lu byte key, %lu byte value",
+                path.c_str(), p.first.size(), p.second.size()));
+            return -1;
+        }
+        items.push_back({ mapped_hash(p.first), &p.first, &p.second });
+    }
+    std::sort(items.begin(), items.end(), [](const item &a, const item &b) {
+        return a.hash != b.hash ? a.hash < b.hash : *a.name < *b.name;
+    });
+
+    // about one entry per radix bucket
+    uint32_t bits = 1;
+    while(bits < 24 && ((uint64_t) 1 << (bits + 1)) <= items.size()) bits++;
+    uint64_t buckets = (uint64_t) 1 << bits;
+
+    mapped_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAPPED_STORE_MAGIC, 4);
+    header.version = MAPPED_STORE_VERSION;
+    header.count = items.size();
+    header.radix_bits = bits;
+    header.radix_off = align8(sizeof(header));
+    header.hashes_off = align8(header.radix_off + (buckets + 1) * sizeof(uint32_t));
+    header.entries_off = header.hashes_off + items.size() * sizeof(uint64_t);
+    header.data_off = header.entries_off + items.size() * sizeof(mapped_entry);
+
+    // build the index in one buffer laid out as in the file
+    std::string index(header.data_off, '\0');
+    uint32_t *radix = (uint32_t *) &index[header.radix_off];
+    uint64_t *hashes = (uint64_t *) &index[header.hashes_off];
+    mapped_entry *out = (mapped_entry *) &index[header.entries_off];
+
+    uint64_t offset = header.data_off;
+    uint64_t bucket = 0;
+    for(size_t n = 0; n < items.size(); n++) {
+        uint64_t top = items[n].hash >> (64 - bits);
+        while(bucket <= top) radix[bucket++] = (uint32_t) n;
+        hashes[n] = items[n].hash;
+        out[n].key_off = offset;
+        out[n].key_len = (uint32_t) items[n].name->size();
+        out[n].value_len = (uint32_t) items[n].value->size();
+        offset += out[n].key_len + out[n].value_len;
+    }
+    while(bucket <= buckets) radix[bucket++] = (uint32_t) items.size();
+
+    header.file_size = offset;
+    memcpy(&index[0], &header, sizeof(header));
+
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd < 0) {
+        cm_log::error(cm_util::format("%s open failed: %s", tmp_path.c_str(), strerror(errno)));
+        return -1;
+    }
+
+    int rc = write_all(fd, index.data(), index.size());
+
+    std::string buf;
+    buf.reserve(MAPPED_WRITE_BUFFER + 4096);
+    for(size_t n = 0; n < items.size() && rc == 0; n++) {
+        buf.append(*items[n].name);
+        buf.append(*items[n].value);
+        if(buf.size() >= MAPPED_WRITE_BUFFER) {
+            rc = write_all(fd, buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+    if(rc == 0) rc = write_all(fd, buf.data(), buf.size());
+    if(rc == 0) rc = fsync(fd);
+    ::close(fd);
+
+    if(rc == 0) {
+        rc = rename(tmp_path.c_str(), path.c_str());
+    }
+    if(rc != 0) {
+        cm_log::error(cm_util::format("%s write failed: %s", path.c_str(), strerror(errno)));
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+int cm_store::mapped_store::open(const std::string &path) {
+
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        cm_log::error(cm_util::format("%s open failed: %s", path.c_str(), strerror(errno)));
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(mapped_header)) {
+        cm_log::error(cm_util::format("%s: not a mapped store", path.c_str()));
+        ::close(fd);
+        return -1;
+    }
+
+    length = (size_t) st.st_size;
+    void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) {
+        cm_log::error(cm_util::format("%s mmap failed: %s", path.c_str(), strerror(errno)));
+        length = 0;
+        return -1;
+    }
+
+    const mapped_header *h = (const mapped_header *) p;
+    uint64_t buckets = h->radix_bits > 0 && h->radix_bits < 32 ? (uint64_t) 1 << h->radix_bits : 0;
+
+    if(memcmp(h->magic, MAPPED_STORE_MAGIC, 4) != 0 || h->version != MAPPED_STORE_VERSION ||
+       buckets == 0 || h->file_size != length ||
+       h->radix_off + (buckets + 1) * sizeof(uint32_t) > h->hashes_off ||
+       h->hashes_off + h->count * sizeof(uint64_t) != h->entries_off ||
+       h->entries_off + h->count * sizeof(mapped_entry) != h->data_off ||
+       h->data_off > length) {
+        cm_log::error(cm_util::format("%s: not a version %d mapped store", path.c_str(),
+            MAPPED_STORE_VERSION));
+        munmap(p, length);
+        length = 0;
+        return -1;
+    }
+
+    base = (const char *) p;
+    header = h;
+    radix = (const uint32_t *) (base + h->radix_off);
+    hashes = (const uint64_t *) (base + h->hashes_off);
+    entries = (const mapped_entry *) (base + h->entries_off);
+    shift = 64 - h->radix_bits;
+
+    // the index is hot, the data is paged in by lookups
+    madvise(p, h->data_off, MADV_WILLNEED);
+
+    return 0;
+}
+
+void cm_store::mapped_store::close() {
+    if(base) {
+        munmap((void *) base, length);
+    }
+    base = nullptr;
+    length = 0;
+    header = nullptr;
+    radix = nullptr;
+    hashes = nullptr;
+    entries = nullptr;
+    shift = 64;
+}
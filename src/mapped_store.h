@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __MAPPED_STORE_H
+#define __MAPPED_STORE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "store.h"
+
+namespace cm_store {
+
+// Immutable string to string store in a memory-mapped file.
+//
+// mapped_store_writer collects entries (it has set() so it can be filled
+// by cm_record::load_records_to_store) and writes the file once. Any
+// number of processes can then open it with mapped_store: the file is
+// mapped read-only and shared, there is nothing to parse and pages are
+// only read from disk as lookups touch them.
+//
+// File layout (native byte order, 8 byte aligned sections):
+//
+//   mapped_header
+//   radix       uint32_t[2^radix_bits + 1]  first index per top hash bits
+//   hashes      uint64_t[count]             sorted key hashes
+//   entries     mapped_entry[count]         in hash order
+//   data        key and value bytes
+//
+// A lookup hashes the key (FNV-1a 64, stable across builds), takes the
+// range of its top bits from the radix table and binary searches the few
+// hashes in it, so it touches a handful of cache lines whatever the size.
+
+#define MAPPED_STORE_MAGIC      "CMM1"
+#define MAPPED_STORE_VERSION    1
+
+struct mapped_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    uint32_t radix_bits;
+    uint32_t reserved;
+    uint64_t radix_off;
+    uint64_t hashes_off;
+    uint64_t entries_off;
+    uint64_t data_off;
+    uint64_t file_size;
+};
+
+struct mapped_entry {
+    uint64_t key_off;       // value follows the key
+    uint32_t key_len;
+    uint32_t value_len;
+};
+
+inline uint64_t mapped_hash(std::string_view s) {
+    uint64_t h = 14695981039346656037ULL;
+    for(unsigned char ch: s) {
+        h ^= ch;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+class mapped_store_writer {
+
+protected:
+    hash_map<std::string,std::string> entries;
+
+public:
+    bool set(const std::string &name, const std::string &value) {
+        entries[name] = value;
+        return true;
+    }
+
+    size_t remove(const std::string &name) { return entries.erase(name); }
+    size_t size() { return entries.size(); }
+    void clear() { entries.clear(); }
+
+    // write the mapped file atomically (tmp file, fsync, rename),
+    // 0 on success; -1 also for more than 2^32 - 1 entries or a key or
+    // value of 4 GiB or more, which the file format cannot hold
+    int write(const std::string &path);
+};
+
+class mapped_store {
+
+protected:
+    const char *base = nullptr;
+    size_t length = 0;
+
+    const mapped_header *header = nullptr;
+    const uint32_t *radix = nullptr;
+    const uint64_t *hashes = nullptr;
+    const mapped_entry *entries = nullptr;
+    uint32_t shift = 64;
+
+    const mapped_entry *lookup(std::string_view name) const {
+        if(!header || header->count == 0) return nullptr;
+
+        uint64_t h = mapped_hash(name);
+        uint64_t top = h >> shift;
+        uint32_t lo = radix[top], hi = radix[top + 1];
+
+        while(lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if(hashes[mid] < h) lo = mid + 1;
+            else hi = mid;
+        }
+
+        for(; lo < header->count && hashes[lo] == h; lo++) {
+            const mapped_entry &e = entries[lo];
+            if(e.key_len == name.size() &&
+               memcmp(base + e.key_off, name.data(), name.size()) == 0) {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+
+    std::string_view value_of(const mapped_entry *e) const {
+        return std::string_view(base + e->key_off + e->key_len, e->value_len);
+    }
+
+public:
+    mapped_store() { }
+    ~mapped_store() { close(); }
+
+    // map path read-only, 0 on success
+    int open(const std::string &path);
+    void close();
+
+    bool is_open() const { return base != nullptr; }
+
+    template<class K>
+    bool check(const K &name) const {
+        return lookup(std::string_view(name)) != nullptr;
+    }
+
+    template<class K>
+    std::string find(const K &name) const {
+        const mapped_entry *e = lookup(std::string_view(name));
+        return e ? std::string(value_of(e)) : std::string();
+    }
+
+    template<class K>
+    std::string get(const K &name, const std::string &_default) const {
+        const mapped_entry *e = lookup(std::string_view(name));
+        return e ? std::string(value_of(e)) : _default;
+    }
+
+    // fn(std::string_view value) sees the value in place, no copy
+    template<class K, class fnT>
+    bool visit(const K &name, fnT fn) const {
+        const mapped_entry *e = lookup(std::string_view(name));
+        if(e) {
+            fn(value_of(e));
+        }
+        return e != nullptr;
+    }
+
+    // read-only: mutations are refused
+    bool set(const std::string &, const std::string &) { return false; }
+    size_t remove(const std::string &) { return 0; }
+
+    size_t size() const { return header ? (size_t) header->count : 0; }
+
+    // fn(std::string_view name, std::string_view value) in hash order
+    template<class fnT>
+    void for_each(fnT fn) const {
+        for(size_t n = 0; n < size(); n++) {
+            const mapped_entry &e = entries[n];
+            fn(std::string_view(base + e.key_off, e.key_len), value_of(&e));
+        }
+    }
+
+private:
+    // do not implement these constructors
+    mapped_store(const mapped_store &);
+    const mapped_store &operator=(const mapped_store &);
+};
+
+} // namespace cm_store
+
+#endif  // __MAPPED_STORE_H
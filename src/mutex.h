@@ -82,6 +82,54 @@ private:
 };
 
 
+// Reader/writer lock: any number of readers may hold the lock at once,
+// writers are exclusive. lock() and unlock() match cm::mutex so an rwlock
+// can stand in where writers only need exclusion. Writers are preferred
+// so a steady stream of readers cannot starve them.
+
+class rwlock {
+public:
+    rwlock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&_rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+    ~rwlock() { pthread_rwlock_destroy(&_rwlock); }
+
+    int lock() { return pthread_rwlock_wrlock(&_rwlock); }
+    int read_lock() { return pthread_rwlock_rdlock(&_rwlock); }
+    int unlock() { return pthread_rwlock_unlock(&_rwlock); }
+
+    bool try_lock() {
+        return pthread_rwlock_trywrlock(&_rwlock) == 0 ? true : false;
+    }
+
+    bool try_read_lock() {
+        return pthread_rwlock_tryrdlock(&_rwlock) == 0 ? true : false;
+    }
+
+    pthread_rwlock_t _rwlock;
+
+private:
+
+    // do not implement these constructors
+    rwlock(const rwlock&);
+    const rwlock& operator=(const rwlock&);
+
+};
+
+// shared (read) access for code templated on the lock type:
+// a plain mutex has no shared mode and is simply locked
+
+inline int read_lock(mutex &m) { return m.lock(); }
+inline int read_lock(rwlock &rw) { return rw.read_lock(); }
+
+
 } // namespace cm
 
 #endif
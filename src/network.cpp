@@ -27,7 +27,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <poll.h>
+
 #include "network.h"
+#include "ring_queue.h"
 
 // Resolve host name to its IP address
 int cm_net::resolve_host(const std::string &host, std::string &info, int flags) {
@@ -148,6 +151,15 @@ int cm_net::enable_reuseaddr(int fd) {
     return CM_NET_OK;
 }
 
+int cm_net::enable_reuseport(int fd) {
+    int enable = 1;
+    if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable))) {
+        cm_net::err("setsockopt: SO_REUSEPORT", errno);
+        return CM_NET_ERR;
+    }
+    return CM_NET_OK;
+}
+
 int cm_net::create_socket(int domain) {
 
     int fd = socket(domain, SOCK_STREAM, 0 /*protocol*/);
@@ -172,6 +184,10 @@ int cm_net::create_socket() {
 }
 
 int cm_net::server_socket_inet6(int host_port) {
+    return cm_net::server_socket_inet6(host_port, false);
+}
+
+int cm_net::server_socket_inet6(int host_port, bool reuse_port) {
 
     // create host socket
     int host_socket = cm_net::create_socket(AF_INET6);
@@ -179,6 +195,13 @@ int cm_net::server_socket_inet6(int host_port) {
         return CM_NET_ERR;
     }
 
+    // several sockets may then bind the port, the kernel spreads
+    // incoming connections across them
+    if(reuse_port && CM_NET_ERR == cm_net::enable_reuseport(host_socket)) {
+        cm_net::close_socket(host_socket);
+        return CM_NET_ERR;
+    }
+
     // bind socket to IP/port
     sockaddr_in6 server_hint;
     bzero(&server_hint, sizeof(server_hint));
@@ -266,6 +289,10 @@ int cm_net::accept_inet6(int host_socket, std::string &info) {
     bzero(&client_hint, sizeof(client_hint));
 
     while(-1 == (fd = ::accept(host_socket, (sockaddr *) &client_hint, &client_sz))) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            // non-blocking listen socket: nothing (left) to accept
+            return CM_NET_ERR;
+        }
         if(errno != EINTR) {
             cm_net::err("accept failed", errno);
             return CM_NET_ERR;
@@ -386,9 +413,32 @@ int cm_net::connect(const std::string &host, int host_port, std::string &info) {
     return fd;
 }
 
-void cm_net::send(int socket, const std::string &msg) {
-    
-    ::send(socket, msg.c_str(), msg.size(), 0 /*flags*/);
+// as much of buf as the socket takes now (all of it, for a blocking
+// socket), or -1
+static ssize_t send_some(int socket, const char *buf, size_t sz, int flags) {
+
+    size_t sent = 0;
+    while(sent < sz) {
+        ssize_t num_bytes = ::send(socket, buf + sent, sz - sent, flags | MSG_NOSIGNAL);
+        if(num_bytes >= 0) {
+            sent += num_bytes;
+            continue;
+        }
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+        cm_net::err(cm_util::format("send error: socket=%d", socket), errno);
+        return -1;
+    }
+    return sent;
+}
+
+int cm_net::send(int socket, const std::string &msg) {
+
+    // bytes sent: fewer than msg.size() only if the socket is
+    // non-blocking and full
+    ssize_t sent = send_some(socket, msg.data(), msg.size(), 0 /*flags*/);
+    return sent < 0 ? CM_NET_ERR : (int) sent;
 }
 
 void cm_net::send(int socket, char *buf, size_t buf_size, const std::string &msg) {
@@ -636,10 +686,47 @@ int cm_net::read(int fd, char *buf, size_t sz) {
     return total_bytes;
 }
 
+int cm_net::read_drain(int fd, std::string &buf, size_t budget) {
+
+    size_t start = buf.size();
+    size_t chunk = std::max(buf.capacity() - start, (size_t) INPUT_READ_MIN);
+
+    while(buf.size() - start < budget) {
+
+        size_t used = buf.size();
+        chunk = std::min(chunk, budget - (used - start));
+        buf.resize(used + chunk);
+
+        // MSG_DONTWAIT: stops at EAGAIN without changing the socket's
+        // flags (the caller may still write to it blocking)
+        ssize_t num_bytes = ::recv(fd, &buf[used], chunk, MSG_DONTWAIT);
+        if(num_bytes > 0) {
+            buf.resize(used + num_bytes);
+            // a short read emptied the socket: data arriving after it
+            // raises a new edge
+            if((size_t) num_bytes < chunk) return CM_NET_OK;
+            chunk *= 2;
+            continue;
+        }
+
+        buf.resize(used);
+        if(num_bytes == 0) return CM_NET_EOF;
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return CM_NET_OK;
+
+        cm_net::err("recv", errno);
+        return CM_NET_ERR;
+    }
+
+    return CM_NET_AGAIN;
+}
+
 //////////////////// single_thread_server  //////////////////////////////
 
 cm_net::single_thread_server::single_thread_server(int port,
     cm_net_receive(fn)): host_port(port), receive_fn(fn) {
+    set_run_mode(cm_thread::run_mode::blocking);
+
     // start processing thread
     start();
 }
@@ -655,6 +742,10 @@ bool cm_net::single_thread_server::setup() {
     if(CM_NET_ERR == epollfd) {
         return false;
     }
+    // stop() and wake() reach the thread through this
+    if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+        return false;
+    }
 
     //listen_socket = cm_net::server_socket(host_port);
     // allow both IPv4 and IPv6 clients to connect
@@ -705,10 +796,15 @@ bool cm_net::single_thread_server::process() {
 
         int fd = events[n].data.fd;
 
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
         if(fd == listen_socket) {
            conn_sock = accept();
             if(CM_NET_ERR != conn_sock) {
-                cm_net::add_socket(epollfd, conn_sock, EPOLLIN | EPOLLET);
+                cm_net::add_socket(epollfd, conn_sock, INPUT_EPOLL_FLAGS);
             }
         }
         else {
@@ -721,8 +817,9 @@ bool cm_net::single_thread_server::process() {
                 cm_log::info(cm_util::format("%d: closed connection", fd));
             }
 
-            // handle peer shutdown
-            if(events[n].events & EPOLLRDHUP) {
+            // handle peer shutdown (once the input left by the read
+            // budget, CM_NET_AGAIN, has been read)
+            if((events[n].events & EPOLLRDHUP) && CM_NET_AGAIN != result) {
                 // remove socket from interest list...
                 if(CM_NET_OK == result) {
                     delete_socket(epollfd, fd);
@@ -739,38 +836,194 @@ bool cm_net::single_thread_server::process() {
 
 int cm_net::single_thread_server::service_input_event(int fd) {
 
-    while(1) {
-        
-        int num_bytes = cm_net::read(fd, rbuf, sizeof(rbuf));
+    rbuf.clear();
+    int result = cm_net::read_drain(fd, rbuf);
 
-        if(num_bytes > 0) {
-            // give data to callback function...
-            receive_fn(fd, rbuf, num_bytes);
-            return CM_NET_OK;
-        }
-        
-        if(num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            // back to caller for the next epoll_wait()
-            return CM_NET_OK;
+    if(rbuf.size() > 0) {
+        // give data to callback function...
+        receive_fn(fd, rbuf.data(), rbuf.size());
+    }
+
+    if(CM_NET_AGAIN == result) {
+        // read budget used up: have epoll report fd again after the
+        // other ready fds
+        if(CM_NET_ERR == cm_net::modify_socket(epollfd, fd, INPUT_EPOLL_FLAGS)) {
+            return CM_NET_ERR;
         }
+    }
 
-        if(num_bytes == 0) {
-            return CM_NET_EOF;
+    return result;
+}
+
+/////////////////////// pool server //////////////////////////////
+
+// never destroyed: pool threads may release events during exit
+static cm_queue::ring_queue<cm_net::input_event *> &input_event_cache() {
+    static auto *cache = new cm_queue::ring_queue<cm_net::input_event *>(INPUT_EVENT_CACHE);
+    return *cache;
+}
+
+cm_net::input_event *cm_net::input_event::create(int fd_) {
+
+    input_event *event = nullptr;
+    if(!input_event_cache().try_pop(event)) {
+        return new input_event(fd_, std::string());
+    }
+    event->fd = fd_;
+    event->msg.clear();
+    event->eof = false;
+    event->connect = false;
+    event->frames.clear();
+    event->server = nullptr;
+    event->out.reset();
+    return event;
+}
+
+void cm_net::input_event::release(void *arg) {
+
+    input_event *event = (input_event *) arg;
+    if(event->msg.capacity() > INPUT_EVENT_MSG_MAX) {
+        std::string().swap(event->msg);
+    }
+    event->out.reset();
+    if(!input_event_cache().try_push(event)) {
+        delete event;
+    }
+}
+
+int cm_net::input_event::send(const char *buf, size_t sz) {
+
+    if(nullptr != server) {
+        // by queue, not fd: fd may be another connection's by now
+        return out ? server->send(out, buf, sz) : CM_NET_ERR;
+    }
+    return (int) sz == cm_net::write(fd, buf, sz) ? CM_NET_OK : CM_NET_ERR;
+}
+
+int cm_net::output_queue::flush(int fd, std::atomic<uint64_t> &writes) {
+
+    struct iovec iov[OUTPUT_IOV_MAX];
+
+    while(pending > 0) {
+
+        int count = 0;
+        size_t skip = offset;
+        for(auto it = chunks.begin(); it != chunks.end() && count < OUTPUT_IOV_MAX; ++it) {
+            iov[count].iov_base = (void *) (it->data() + skip);
+            iov[count].iov_len = it->size() - skip;
+            skip = 0;
+            count++;
         }
 
-        if(num_bytes == -1) {
-            cm_net::err("read", errno);
+        // writev(), without SIGPIPE from a closed peer
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t num_bytes = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        writes.fetch_add(1, std::memory_order_relaxed);
+        if(num_bytes < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return CM_NET_OK;
+            cm_net::err(cm_util::format("%d: writev", fd), errno);
             return CM_NET_ERR;
         }
+
+        // drop what was written
+        pending -= num_bytes;
+        size_t done = num_bytes;
+        while(done > 0) {
+            size_t left = chunks.front().size() - offset;
+            if(done < left) {
+                offset += done;
+                break;
+            }
+            done -= left;
+            chunks.pop_front();
+            offset = 0;
+        }
     }
+
+    return CM_NET_OK;
 }
 
-/////////////////////// pool server //////////////////////////////
+long cm_net::frame_spec::split(const char *buf, size_t sz, size_t &scanned,
+    std::vector<std::string_view> &frames) const {
+
+    size_t used = 0;
+
+    switch(mode) {
+
+    case framing::none:
+        if(sz > 0) frames.emplace_back(buf, sz);
+        return (long) sz;
+
+    case framing::line:
+        while(used < sz) {
+            size_t from = std::max(used, scanned);
+            const char *end = (const char *) memchr(buf + from, '\n', sz - from);
+            if(nullptr == end) break;
+
+            size_t len = end - (buf + used);
+            if(len > max) return -1;
+            if(len > 0 && buf[used + len - 1] == '\r') len--;
+            frames.emplace_back(buf + used, len);
+            used = end - buf + 1;
+        }
+        break;
+
+    case framing::length:
+        while(sz - used >= FRAME_LENGTH_SIZE) {
+            const unsigned char *p = (const unsigned char *) buf + used;
+            size_t len = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) |
+                ((size_t) p[2] << 8) | (size_t) p[3];
+            if(len > max) return -1;
+            if(sz - used - FRAME_LENGTH_SIZE < len) break;
+
+            frames.emplace_back(buf + used + FRAME_LENGTH_SIZE, len);
+            used += FRAME_LENGTH_SIZE + len;
+        }
+        break;
+
+    case framing::custom:
+        if(nullptr == fn) return -1;
+        while(used < sz) {
+            long len = fn(buf + used, sz - used);
+            if(len < 0 || (size_t) len > sz - used || (size_t) len > max) return -1;
+            if(0 == len) break;
+
+            frames.emplace_back(buf + used, len);
+            used += len;
+        }
+        break;
+    }
+
+    // what is left starts a frame: no longer than a frame may be, and
+    // (line mode) already searched for its end
+    if(sz - used > max + FRAME_LENGTH_SIZE) return -1;
+    scanned = sz - used;
+
+    return (long) used;
+}
 
 cm_net::pool_server::pool_server(int port, cm_thread::pool *pool_,
     cm_task_function(fn), cm_task_dealloc(dealloc_)): host_port(port),
      pool(pool_), receive_fn(fn), dealloc(dealloc_) {
 
+    set_run_mode(cm_thread::run_mode::blocking);
+
+    // start processing thread
+    start();
+}
+
+cm_net::pool_server::pool_server(int port, cm_thread::pool *pool_,
+    cm_task_function(fn), cm_task_dealloc(dealloc_), bool reuse_port_,
+    int shared_socket_): host_port(port), pool(pool_), receive_fn(fn),
+    dealloc(dealloc_), reuse_port(reuse_port_), shared_socket(shared_socket_) {
+
+    set_run_mode(cm_thread::run_mode::blocking);
+
     // start processing thread
     start();
 }
@@ -786,10 +1039,20 @@ bool cm_net::pool_server::setup() {
     if(CM_NET_ERR == epollfd) {
         return false;
     }
+    if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+        return false;
+    }
+
+    if(-1 != shared_socket) {
+        // every loop waits on the shared socket: wake just one of them
+        listen_socket = shared_socket;
+        return CM_NET_ERR != cm_net::add_socket(epollfd, listen_socket,
+            EPOLLIN | EPOLLEXCLUSIVE);
+    }
 
     //listen_socket = cm_net::server_socket(host_port);
     // allow both IPv4 and IPv6 clients to connect
-    listen_socket = cm_net::server_socket_inet6(host_port);
+    listen_socket = cm_net::server_socket_inet6(host_port, reuse_port);
     if(-1 == listen_socket) {
         return false;
     }
@@ -802,9 +1065,276 @@ bool cm_net::pool_server::setup() {
     return true;
 }
 
+void cm_net::pool_server::set_framing(framing mode, cm_net_frame(fn), size_t max) {
+
+    frame_mutex.lock();
+    framer.mode = mode;
+    framer.fn = fn;
+    framer.max = max;
+    frame_mutex.unlock();
+}
+
+std::shared_ptr<cm_net::output_queue> cm_net::pool_server::output(int fd) {
+
+    std::shared_ptr<output_queue> q;
+    outputs_mutex.lock();
+    auto it = outputs.find(fd);
+    if(it != outputs.end()) q = it->second;
+    outputs_mutex.unlock();
+    return q;
+}
+
+// arm fd for what q needs; q.mutex held
+int cm_net::pool_server::update_events(int fd, output_queue &q) {
+
+    if(q.closed) return CM_NET_OK;
+    return cm_net::modify_socket(epollfd, fd, q.epoll_flags());
+}
+
+// arm EPOLLOUT for output left queued (and stop reading past the high
+// watermark); q.mutex held
+int cm_net::pool_server::arm_output(int fd, output_queue &q) {
+
+    bool armed = q.armed;
+    bool throttled = q.throttled;
+    if(q.pending > 0) q.armed = true;
+    if(q.pending >= high_watermark) q.throttled = true;
+    if(armed != q.armed || throttled != q.throttled) {
+        return update_events(fd, q);
+    }
+    return CM_NET_OK;
+}
+
+// write held output together; q.mutex held
+int cm_net::pool_server::write_held(int fd, output_queue &q) {
+
+    q.corked = false;
+    int result = q.flush(fd, writes);
+    if(CM_NET_OK == result) {
+        result = arm_output(fd, q);
+    }
+    return result;
+}
+
+// the task of an event when coalescing: replies sent on the event's
+// connection while it runs are written when it returns
+static thread_local const cm_net::input_event *coalescing_event = nullptr;
+
+void cm_net::pool_server::run_coalesced(void *arg) {
+
+    input_event *event = (input_event *) arg;
+    pool_server *server = event->server;
+
+    coalescing_event = event;
+    server->receive_fn(arg);
+    coalescing_event = nullptr;
+
+    if(event->out) server->flush(event->out);
+}
+
+int cm_net::pool_server::send(int fd, const char *buf, size_t sz) {
+
+    return send(output(fd), buf, sz);
+}
+
+int cm_net::pool_server::send(const std::shared_ptr<output_queue> &q,
+    const char *buf, size_t sz) {
+
+    if(!q) {
+        return CM_NET_ERR;
+    }
+
+    int result = CM_NET_OK;
+
+    q->mutex.lock();
+    if(q->closed) {
+        result = CM_NET_ERR;
+    }
+    else {
+        int fd = q->fd;
+
+        // coalescing: hold it (unless it is queued for EPOLLOUT anyway)
+        bool hold = coalescing && !q->armed;
+
+        size_t sent = 0;
+        if(0 == q->pending && !hold) {
+            // nothing queued ahead of it: straight to the socket
+            ssize_t num_bytes = send_some(fd, buf, sz, MSG_DONTWAIT);
+            writes.fetch_add(1, std::memory_order_relaxed);
+            if(num_bytes < 0) result = CM_NET_ERR;
+            else sent = num_bytes;
+        }
+
+        if(CM_NET_OK == result && sent < sz) {
+            // the rest waits for the loop
+            if(q->chunks.size() > 0 && q->chunks.back().size() < OUTPUT_CHUNK_MERGE) {
+                q->chunks.back().append(buf + sent, sz - sent);
+            }
+            else {
+                q->chunks.emplace_back(buf + sent, sz - sent);
+            }
+            q->pending += sz - sent;
+
+            if(!hold) {
+                result = arm_output(fd, *q);
+            }
+            else if(q->pending >= high_watermark) {
+                result = write_held(fd, *q);
+            }
+            else if(!q->corked) {
+                q->corked = true;
+                if(nullptr == coalescing_event || coalescing_event->out != q) {
+                    // not from the event's task: the loop writes it
+                    hold_output(q);
+                }
+            }
+        }
+    }
+    q->mutex.unlock();
+
+    return CM_NET_ERR == result ? CM_NET_ERR : CM_NET_OK;
+}
+
+void cm_net::pool_server::flush(int fd) {
+
+    flush(output(fd));
+}
+
+void cm_net::pool_server::flush(const std::shared_ptr<output_queue> &q) {
+
+    if(!q) return;
+
+    q->mutex.lock();
+    if(q->corked && !q->closed) {
+        write_held(q->fd, *q);
+    }
+    q->mutex.unlock();
+}
+
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// have the loop write q's held output within coalesce_usec
+void cm_net::pool_server::hold_output(const std::shared_ptr<output_queue> &q) {
+
+    corked_mutex.lock();
+    bool wake = corked.empty() && idle;
+    if(corked.empty()) corked_since = monotonic_ns();
+    corked.push_back(q);
+    holding = true;
+    corked_mutex.unlock();
+
+    // (coalescing switched off meanwhile: the loop may not be looking)
+    if(wake || !coalescing) wakeup.wake();
+}
+
+void cm_net::pool_server::set_coalescing(bool on, long max_usec) {
+
+    coalesce_usec = max_usec;
+    coalescing = on;
+
+    // output held so far is written by the loop's next iteration
+    if(!on) wakeup.wake();
+}
+
+// epoll_wait() timeout: until held output is due, if there is any
+int cm_net::pool_server::wait_timeout() {
+
+    if(!coalescing && !holding) return timeout;
+
+    int ms = timeout;
+    corked_mutex.lock();
+    idle = corked.empty();
+    if(corked.size() > 0) {
+        uint64_t held = monotonic_ns() - corked_since;
+        uint64_t cap = coalescing ? (uint64_t) coalesce_usec * 1000 : 0;
+        int due = held >= cap ? 0 : (int) ((cap - held + 999999) / 1000000);
+        if(ms < 0 || due < ms) ms = due;
+    }
+    corked_mutex.unlock();
+    return ms;
+}
+
+// end of a loop iteration: write held output that is due (all of it
+// once coalescing is off)
+void cm_net::pool_server::flush_held() {
+
+    corked_mutex.lock();
+    idle = false;
+    if(corked.size() > 0 && (!coalescing ||
+        monotonic_ns() - corked_since >= (uint64_t) coalesce_usec * 1000)) {
+        flushing.swap(corked);
+    }
+    holding = corked.size() > 0;
+    corked_mutex.unlock();
+
+    for(auto &q: flushing) flush(q);
+    flushing.clear();
+}
+
+size_t cm_net::pool_server::output_pending(int fd) {
+
+    std::shared_ptr<output_queue> q = output(fd);
+    if(!q) return 0;
+
+    q->mutex.lock();
+    size_t pending = q->pending;
+    q->mutex.unlock();
+    return pending;
+}
+
+int cm_net::pool_server::service_output_event(int fd) {
+
+    auto it = connections.find(fd);
+    if(it == connections.end()) return CM_NET_OK;
+    output_queue &q = *it->second.out;
+
+    q.mutex.lock();
+    int result = q.flush(fd, writes);
+    if(CM_NET_OK == result) {
+        bool armed = q.armed;
+        bool throttled = q.throttled;
+        if(0 == q.pending) q.armed = false;
+        if(q.throttled && q.pending <= low_watermark) q.throttled = false;
+        if(armed != q.armed || throttled != q.throttled) {
+            // re-arming EPOLLIN reports input that waited meanwhile
+            result = update_events(fd, q);
+        }
+    }
+    q.mutex.unlock();
+
+    return result;
+}
+
 void cm_net::pool_server::cleanup() {
 
-    cm_net::close_socket(listen_socket);
+    for(auto &conn: connections) {
+        if(nullptr != conn.second.partial) input_event::release(conn.second.partial);
+    }
+    connections.clear();
+
+    // tasks still holding a queue get CM_NET_ERR, not a closed fd
+    outputs_mutex.lock();
+    for(auto &out: outputs) {
+        out.second->mutex.lock();
+        out.second->closed = true;
+        out.second->mutex.unlock();
+    }
+    outputs.clear();
+    outputs_mutex.unlock();
+
+    corked_mutex.lock();
+    corked.clear();
+    holding = false;
+    corked_mutex.unlock();
+
+    if(-1 == shared_socket) {
+        cm_net::close_socket(listen_socket);
+    }
+    ::close(epollfd);
 }
 
 int cm_net::pool_server::accept() {
@@ -825,7 +1355,7 @@ int cm_net::pool_server::accept() {
 bool cm_net::pool_server::process() {
 
     // fetch fds that are ready for I/O...
-    nfds = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+    nfds = epoll_wait(epollfd, events, MAX_EVENTS, wait_timeout());
     if(-1 == nfds) {
         cm_net::err("epoll_wait", errno);
         return false;
@@ -836,49 +1366,86 @@ bool cm_net::pool_server::process() {
 
         int fd = events[n].data.fd;
 
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
         if(fd == listen_socket) {
            conn_sock = accept();
             if(CM_NET_ERR != conn_sock) {
-                cm_net::add_socket(epollfd, conn_sock, EPOLLIN | EPOLLET | EPOLLRDHUP);
+                cm_net::add_socket(epollfd, conn_sock, INPUT_EPOLL_FLAGS);
                 cm_log::info(cm_util::format("%d: connected: %s", conn_sock, info.c_str()));
 
                 service_connect_event(conn_sock, info);
             }
         }
         else {
-            // handle IO event...
-            int result = service_input_event(fd);
+            // handle IO event: queued output first (it may lift a read
+            // throttle), then input
+            uint32_t ready = events[n].events;
+            int result = CM_NET_OK;
 
+            if(ready & EPOLLOUT) {
+                result = service_output_event(fd);
+            }
+            if(CM_NET_ERR != result && (ready & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+                result = service_input_event(fd);
+            }
+
+            // (the disconnect event goes first: it closes the output
+            // queue, so no send() can reach the fd once it is closed)
             if(CM_NET_ERR == result || CM_NET_EOF == result) {
+                service_disconnect_event(fd, info);
+
                 delete_socket(epollfd, fd);
                 cm_net::close_socket(fd);
                 cm_log::info(cm_util::format("%d: closed connection", fd));
-
-                service_disconnect_event(fd, info);
             }
 
-            // handle peer shutdown
-            if(events[n].events & EPOLLRDHUP) {
+            // handle peer shutdown (once the input left by the read
+            // budget, CM_NET_AGAIN, has been read)
+            if((events[n].events & EPOLLRDHUP) && CM_NET_AGAIN != result) {
                 // remove socket from interest list...
                 if(CM_NET_OK == result) {
+                    service_disconnect_event(fd, info);
+
                     delete_socket(epollfd, fd);
                     cm_net::close_socket(fd);
                     cm_log::info(cm_util::format("%d: closed connection (EPOLLRDHUP).", fd));
-
-                    service_disconnect_event(fd, info);
                 }
                 cm_log::info(cm_util::format("%d: peer shutdown", fd));
             }   
         }
     }
 
+    // end of the iteration: write coalesced output that is due
+    if(coalescing || holding) {
+        flush_held();
+    }
+
     return true;
 }
 
 int cm_net::pool_server::service_connect_event(int fd, const std::string info) {
+
+    connection conn;
+    frame_mutex.lock();
+    conn.spec = framer;
+    frame_mutex.unlock();
+    conn.out = std::make_shared<output_queue>();
+    conn.out->fd = fd;
+    connections[fd] = conn;
+
+    outputs_mutex.lock();
+    outputs[fd] = conn.out;
+    outputs_mutex.unlock();
     
     // give the response fd and singal connect to the thread pool
-    input_event *event = new input_event(fd, info);
+    input_event *event = input_event::create(fd);
+    event->server = this;
+    event->out = conn.out;
+    event->msg = info;
     event->connect = true;
     if(nullptr != event) {
         pool->add_task(receive_fn, event, dealloc);
@@ -892,10 +1459,34 @@ int cm_net::pool_server::service_connect_event(int fd, const std::string info) {
 }
 
 int cm_net::pool_server::service_disconnect_event(int fd, const std::string info) {
+
+    // an incomplete frame and unsent output go with the connection
+    std::shared_ptr<output_queue> out;
+    auto it = connections.find(fd);
+    if(it != connections.end()) {
+        if(nullptr != it->second.partial) input_event::release(it->second.partial);
+
+        output_queue &q = *it->second.out;
+        q.mutex.lock();
+        q.closed = true;
+        q.chunks.clear();
+        q.pending = 0;
+        q.mutex.unlock();
+        out = it->second.out;
+
+        outputs_mutex.lock();
+        outputs.erase(fd);
+        outputs_mutex.unlock();
+
+        connections.erase(it);
+    }
     
     // EOF - client disconnected
     // give the response fd and singal EOF to the thread pool
-    input_event *event = new input_event(fd, info);
+    input_event *event = input_event::create(fd);
+    event->server = this;
+    event->out = out;
+    event->msg = info;
     event->eof = true;
     if(nullptr != event) {
         pool->add_task(receive_fn, event, dealloc);
@@ -909,46 +1500,124 @@ int cm_net::pool_server::service_disconnect_event(int fd, const std::string info
 
 int cm_net::pool_server::service_input_event(int fd) {
 
-    char rbuf[4096] = {'\0'};
+    connection &conn = connections[fd];
 
-    //while(1) {
-        
-        int num_bytes = cm_net::read(fd, rbuf, sizeof(rbuf));
-        if(num_bytes > 0) {
-            // give the response fd and data to the thread pool
-            input_event *event = new input_event(fd, std::string(rbuf, num_bytes));
-            if(nullptr != event) {
-                pool->add_task(receive_fn, event, dealloc);
-            }
-            else {
-                cm_log::critical("pool_server: error: event allocation failed!");
-                return CM_NET_ERR;
-            }
-            return CM_NET_OK;
+    // drain straight into the event's message (a recycled event brings
+    // its msg capacity along, so a warm read allocates nothing); a frame
+    // left incomplete is read into further, not copied
+    input_event *event = conn.partial ? conn.partial : input_event::create(fd);
+    conn.partial = nullptr;
+    int result = cm_net::read_drain(fd, event->msg);
+
+    long used = conn.spec.split(event->msg.data(), event->msg.size(), conn.scanned,
+        event->frames);
+    if(used < 0) {
+        cm_net::err(cm_util::format("%d: invalid input frame", fd));
+        input_event::release(event);
+        return CM_NET_ERR;
+    }
+
+    if((size_t) used < event->msg.size()) {
+        if(event->frames.empty()) {
+            // nothing complete yet: keep reading into this buffer
+            conn.partial = event;
+            event = nullptr;
         }
-        
-        if(num_bytes == -1 && errno == EAGAIN) {
-            // back to caller for the next epoll_wait()
-            return CM_NET_OK;
+        else {
+            // the frames stay views of this buffer, the incomplete one
+            // moves on to the next
+            conn.partial = input_event::create(fd);
+            conn.partial->msg.assign(event->msg, used, std::string::npos);
         }
+    }
 
-        if(num_bytes == 0) {
-            return CM_NET_EOF;
+    if(nullptr != event) {
+        event->server = this;
+        event->out = conn.out;
+        if(event->frames.size() > 0) {
+            // give the response fd and frames to the thread pool
+            pool->add_task(coalescing ? &run_coalesced : receive_fn, event, dealloc);
+        }
+        else {
+            input_event::release(event);
         }
+    }
 
-        if(num_bytes == -1) {
-            cm_net::err("read", errno);
-            return CM_NET_ERR;
+    if(CM_NET_AGAIN == result) {
+        // read budget used up: have epoll report fd again after the
+        // other ready fds
+        conn.out->mutex.lock();
+        if(CM_NET_ERR == update_events(fd, *conn.out)) result = CM_NET_ERR;
+        conn.out->mutex.unlock();
+    }
+
+    return result;
+}
+
+/////////////////////// multi pool server //////////////////////////////
+
+cm_net::multi_pool_server::multi_pool_server(int port, int loop_count,
+    cm_thread::pool *pool, cm_task_function(fn), cm_task_dealloc(dealloc_),
+    bool reuse_port) {
+
+    if(!reuse_port) {
+        // loops that find another took the connection get EAGAIN
+        listen_socket = cm_net::server_socket_inet6(port);
+        if(CM_NET_ERR == listen_socket ||
+            CM_NET_ERR == cm_net::set_non_block(listen_socket, true)) {
+            return;
         }
+    }
+
+    for(int n = 0; n < loop_count; n++) {
+        loops.push_back(std::make_unique<pool_server>(port, pool, fn, dealloc_,
+            reuse_port, listen_socket));
+    }
+}
+
+cm_net::multi_pool_server::~multi_pool_server() {
+
+    // ask every loop to stop before waiting on any of them
+    for(auto &loop: loops) loop->request_stop();
+    loops.clear();
+
+    if(-1 != listen_socket) {
+        cm_net::close_socket(listen_socket);
+    }
+}
+
+bool cm_net::multi_pool_server::is_started() {
 
-	return CM_NET_OK;
-    //}
+    if(loops.empty()) return false;
+    for(auto &loop: loops) {
+        if(!loop->is_started()) return false;
+    }
+    return true;
+}
+
+int cm_net::multi_pool_server::pin_loops() {
+
+    std::vector<int> cpus;
+    for(auto &node: cm_thread::cpu_topology::get().nodes) {
+        cpus.insert(cpus.end(), node.begin(), node.end());
+    }
+    if(cpus.empty()) return -1;
+
+    int result = 0;
+    for(size_t n = 0; n < loops.size(); n++) {
+        if(-1 == loops[n]->set_affinity(std::vector<int>{ cpus[n % cpus.size()] })) {
+            result = -1;
+        }
+    }
+    return result;
 }
 
 /////////////////////// rx_thread ///////////////////////////////
 
 cm_net::rx_thread::rx_thread(int s, cm_net_receive(fn)):
      socket(s), receive_fn(fn) {
+    set_run_mode(cm_thread::run_mode::blocking);
+
     // start processing thread
     start();
 }
@@ -967,9 +1636,13 @@ bool cm_net::rx_thread::setup() {
         if(CM_NET_ERR == epollfd) {
             return false;
         }
+        if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+            return false;
+        }
     }
     
-    if(CM_NET_ERR == cm_net::add_socket(epollfd, socket, EPOLLIN | EPOLLRDHUP)) {
+
+    if(CM_NET_ERR == cm_net::add_socket(epollfd, socket, INPUT_EPOLL_FLAGS)) {
         cm_net::close_socket(socket);
         return false;
     }
@@ -998,6 +1671,11 @@ bool cm_net::rx_thread::process() {
     for(int n = 0; n < nfds; ++n) {
         int fd = events[n].data.fd;
 
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
         if(fd == socket) {
 
             // handle IO event...
@@ -1013,8 +1691,9 @@ bool cm_net::rx_thread::process() {
                 cm_log::info(cm_util::format("%d: closed connection", fd));
             }
 
-            // handle peer shutdown
-            if(events[n].events & EPOLLRDHUP) {
+            // handle peer shutdown (once the input left by the read
+            // budget, CM_NET_AGAIN, has been read)
+            if((events[n].events & EPOLLRDHUP) && CM_NET_AGAIN != result) {
                 connected = false;
                 // remove socket from interest list...
                 if(CM_NET_OK == result) {
@@ -1037,39 +1716,31 @@ bool cm_net::rx_thread::process() {
 
 int cm_net::rx_thread::service_input_event(int fd) {
 
-    char rbuf[4096] = { '\0' };
+    rbuf.clear();
+    int result = cm_net::read_drain(fd, rbuf);
 
-    while(1) {
-        
-        int num_bytes = cm_net::read(fd, rbuf, sizeof(rbuf));
-
-        if(num_bytes > 0) {
-            // give data to callback function...
-            receive_fn(fd, rbuf, num_bytes);
-            return CM_NET_OK;
-        }
-        
-        if(num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))  {
-            // back to caller for the next epoll_wait()
-            return CM_NET_OK;
-        }
-
-        if(num_bytes == 0) {
-            // EOF - client disconnected
-            return CM_NET_EOF;
-        }
+    if(rbuf.size() > 0) {
+        // give data to callback function...
+        receive_fn(fd, rbuf.data(), rbuf.size());
+    }
 
-        if(num_bytes == -1) {
-            cm_net::err("read", errno);
+    if(CM_NET_AGAIN == result) {
+        // read budget used up: have epoll report fd again (after a
+        // pending wakeup, if any)
+        if(CM_NET_ERR == cm_net::modify_socket(epollfd, fd, INPUT_EPOLL_FLAGS)) {
             return CM_NET_ERR;
         }
     }
+
+    return result;
 }
 
 //////////////////// client_thread //////////////////////////////
 
 cm_net::client_thread::client_thread(const std::string _host, int port, cm_net_receive(fn)):
      host(_host), host_port(port), receive_fn(fn) {
+    set_run_mode(cm_thread::run_mode::blocking);
+
     // start processing thread
     start();
 }
@@ -1108,9 +1779,12 @@ bool cm_net::client_thread::setup() {
         if(CM_NET_ERR == epollfd) {
             return false;
         }
+        if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+            return false;
+        }
     }
     
-    if(CM_NET_ERR == cm_net::add_socket(epollfd, socket, EPOLLIN | EPOLLRDHUP)) {
+    if(CM_NET_ERR == cm_net::add_socket(epollfd, socket, INPUT_EPOLL_FLAGS)) {
         cm_net::close_socket(socket);
         return false;
     }
@@ -1144,6 +1818,11 @@ bool cm_net::client_thread::process() {
     for(int n = 0; n < nfds; ++n) {
         int fd = events[n].data.fd;
 
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
         if(fd == socket) {
 
             // handle IO event...
@@ -1159,8 +1838,9 @@ bool cm_net::client_thread::process() {
                 cm_log::info(cm_util::format("%d: closed connection", fd));
             }
 
-            // handle peer shutdown
-            if(events[n].events & EPOLLRDHUP) {
+            // handle peer shutdown (once the input left by the read
+            // budget, CM_NET_AGAIN, has been read)
+            if((events[n].events & EPOLLRDHUP) && CM_NET_AGAIN != result) {
                 connected = false;
                 // remove socket from interest list...
                 if(CM_NET_OK == result) {
@@ -1183,38 +1863,52 @@ bool cm_net::client_thread::process() {
 
 int cm_net::client_thread::service_input_event(int fd) {
 
-    char rbuf[4096] = { '\0' };
+    rbuf.clear();
+    int result = cm_net::read_drain(fd, rbuf);
 
-    //while(1) {
-        
-        int num_bytes = cm_net::read(fd, rbuf, sizeof(rbuf));
+    if(rbuf.size() > 0) {
+        // give data to callback function...
+        receive_fn(fd, rbuf.data(), rbuf.size());
+    }
 
-        if(num_bytes > 0) {
-            // give data to callback function...
-            receive_fn(fd, rbuf, num_bytes);
-            return CM_NET_OK;
-        }
-        
-        if(num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            // back to caller for the next epoll_wait()
-            return CM_NET_OK;
+    if(CM_NET_AGAIN == result) {
+        // read budget used up: have epoll report fd again (after a
+        // pending wakeup, if any)
+        if(CM_NET_ERR == cm_net::modify_socket(epollfd, fd, INPUT_EPOLL_FLAGS)) {
+            return CM_NET_ERR;
         }
+    }
 
-        if(num_bytes == 0) {
-            // EOF - client disconnected
-            return CM_NET_EOF;
-        }
+    return result;
+}
+
+// block until the (non-blocking) socket can take more
+static int wait_writable(int fd) {
 
-        if(num_bytes == -1) {
-            cm_net::err("read", errno);
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    while(-1 == ::poll(&pfd, 1, -1)) {
+        if(EINTR != errno) {
+            cm_net::err("poll", errno);
             return CM_NET_ERR;
         }
-    //}
-        return CM_NET_OK;
+    }
+    return (pfd.revents & POLLOUT) ? CM_NET_OK : CM_NET_ERR;
 }
 
-void cm_net::client_thread::send(const std::string msg) {
-    cm_net::send(socket, msg);
+int cm_net::client_thread::send(const std::string msg) {
+
+    // all of msg: what the socket does not take now is sent once it
+    // has room
+    size_t sent = 0;
+    while(sent < msg.size()) {
+        ssize_t num_bytes = send_some(socket, msg.data() + sent, msg.size() - sent, 0);
+        if(num_bytes < 0) return CM_NET_ERR;
+        sent += num_bytes;
+        if(sent < msg.size() && CM_NET_ERR == wait_writable(socket)) {
+            return CM_NET_ERR;
+        }
+    }
+    return CM_NET_OK;
 }
 
 /////////////////////// event-driven I/O /////////////////////////////////
@@ -1265,6 +1959,8 @@ int cm_net::delete_socket(int epollfd, int fd) {
 
 cm_net::single_thread_server_ssl::single_thread_server_ssl(int port,
     ssl_receive_cb(fn)): host_port(port), receive_fn(fn) {
+    set_run_mode(cm_thread::run_mode::blocking);
+
     // start processing thread
     start();
 }
@@ -1284,6 +1980,9 @@ bool cm_net::single_thread_server_ssl::setup() {
     if(CM_NET_ERR == epollfd) {
         return false;
     }
+    if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+        return false;
+    }
 
     // allow both IPv4 and IPv6 clients to connect
     listen_socket = cm_net::server_socket_inet6(host_port);
@@ -1347,6 +2046,11 @@ bool cm_net::single_thread_server_ssl::process() {
 
         int fd = events[n].data.fd;
 
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
         if(fd == listen_socket) {
            conn_sock = single_thread_server_ssl::accept();
             if(CM_NET_ERR != conn_sock) {
@@ -1436,6 +2140,8 @@ int cm_net::single_thread_server_ssl::service_input_event(int fd) {
 cm_net::client_thread_ssl::client_thread_ssl(const std::string _host,
      int port, ssl_receive_cb(fn)): host(_host), host_port(port),
      receive_fn(fn) {
+    set_run_mode(cm_thread::run_mode::blocking);
+
     // start processing thread
     start();
 }
@@ -1473,6 +2179,9 @@ bool cm_net::client_thread_ssl::setup() {
         if(CM_NET_ERR == epollfd) {
             return false;
         }
+        if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+            return false;
+        }
     }
 
     socket = cm_net::client_thread_ssl::connect();
@@ -1538,6 +2247,11 @@ bool cm_net::client_thread_ssl::process() {
     for(int n = 0; n < nfds; ++n) {
         int fd = events[n].data.fd;
 
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
         if(fd == socket) {
 
             int result = CM_NET_ERR;
@@ -1601,3 +2315,166 @@ int cm_net::client_thread_ssl::service_input_event(int fd) {
     }
 }
 
+
+////////////////////// coroutine I/O reactor //////////////////////////
+
+cm_net::io_reactor::io_reactor(cm_thread::pool &pool_): pool(pool_) {
+
+    set_run_mode(cm_thread::run_mode::blocking);
+
+    // start processing thread
+    start();
+}
+
+cm_net::io_reactor::~io_reactor() {
+    // stop processing thread
+    stop();
+}
+
+bool cm_net::io_reactor::setup() {
+
+    epollfd = epoll_create();
+    if(CM_NET_ERR == epollfd) {
+        return false;
+    }
+    if(CM_NET_ERR == cm_net::add_socket(epollfd, wakeup.fd(), EPOLLIN)) {
+        return false;
+    }
+
+    return true;
+}
+
+void cm_net::io_reactor::cleanup() {
+
+    // waits that will not complete now: their frames go (each one
+    // destroys its awaiter, so collect them first)
+    std::vector<std::coroutine_handle<>> abandoned;
+    fds_mutex.lock();
+    for(auto &it: fds) {
+        if(it.second.reader) abandoned.push_back(it.second.reader->root);
+        if(it.second.writer) abandoned.push_back(it.second.writer->root);
+    }
+    fds.clear();
+    fds_mutex.unlock();
+    for(std::coroutine_handle<> root: abandoned) root.destroy();
+
+    ::close(epollfd);
+    epollfd = -1;
+}
+
+// arm fd for the waits pending on it; fds_mutex held
+int cm_net::io_reactor::rearm(int fd, waiters &w) {
+
+    uint32_t flags = EPOLLONESHOT;
+    if(w.reader) flags |= EPOLLIN | EPOLLRDHUP;
+    if(w.writer) flags |= EPOLLOUT;
+
+    if(!w.added) {
+        if(CM_NET_ERR == cm_net::add_socket(epollfd, fd, flags)) {
+            return CM_NET_ERR;
+        }
+        w.added = true;
+        return CM_NET_OK;
+    }
+    return cm_net::modify_socket(epollfd, fd, flags);
+}
+
+int cm_net::io_reactor::arm(io_awaiter *a) {
+
+    int result = CM_NET_OK;
+
+    // the waiter is recorded before the fd is armed: the event may
+    // fire (and the coroutine be resumed) before arm() returns
+    fds_mutex.lock();
+    waiters &w = fds[a->fd];
+    io_awaiter *&slot = (a->want == EPOLLIN) ? w.reader : w.writer;
+
+    if(nullptr != slot) {
+        cm_net::err(cm_util::format("%d: io_reactor: %s already pending", a->fd,
+            a->want == EPOLLIN ? "read" : "write"));
+        result = CM_NET_ERR;
+    }
+    else {
+        slot = a;
+        result = rearm(a->fd, w);
+        if(CM_NET_ERR == result) slot = nullptr;
+    }
+    fds_mutex.unlock();
+
+    if(CM_NET_ERR == result) {
+        a->events = EPOLLERR;
+    }
+    return result;
+}
+
+void cm_net::io_reactor::forget(int fd) {
+
+    fds_mutex.lock();
+    auto it = fds.find(fd);
+    if(it != fds.end()) {
+        if(it->second.added) cm_net::delete_socket(epollfd, fd);
+        fds.erase(it);
+    }
+    fds_mutex.unlock();
+}
+
+bool cm_net::io_reactor::process() {
+
+    // fetch fds that are ready for I/O...
+    nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+    if(-1 == nfds) {
+        if(EINTR == errno) return true;
+        cm_net::err("epoll_wait", errno);
+        return false;
+    }
+
+    io_awaiter *ready[MAX_EVENTS * 2];
+    int count = 0;
+
+    fds_mutex.lock();
+    for(int n = 0; n < nfds; ++n) {
+
+        int fd = events[n].data.fd;
+
+        if(fd == wakeup.fd()) {
+            wakeup.clear();
+            continue;
+        }
+
+        auto it = fds.find(fd);
+        if(it == fds.end()) continue;   // forgotten meanwhile
+
+        waiters &w = it->second;
+        uint32_t ev = events[n].events;
+        uint32_t fault = EPOLLERR | EPOLLHUP;
+
+        if(w.reader && (ev & (EPOLLIN | EPOLLRDHUP | fault))) {
+            w.reader->events = ev;
+            ready[count++] = w.reader;
+            w.reader = nullptr;
+        }
+        if(w.writer && (ev & (EPOLLOUT | fault))) {
+            w.writer->events = ev;
+            ready[count++] = w.writer;
+            w.writer = nullptr;
+        }
+
+        // one shot: the fd is disarmed now, arm it again for a wait
+        // that is still pending
+        if((w.reader || w.writer) && CM_NET_ERR == rearm(fd, w)) {
+            for(io_awaiter **a: { &w.reader, &w.writer }) {
+                if(nullptr == *a) continue;
+                (*a)->events = EPOLLERR;
+                ready[count++] = *a;
+                *a = nullptr;
+            }
+        }
+    }
+    fds_mutex.unlock();
+
+    for(int n = 0; n < count; ++n) {
+        pool.execute(cm_thread::co_resume(ready[n]->handle, ready[n]->root));
+    }
+
+    return true;
+}
@@ -40,16 +40,22 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <string.h>
 
+#include <coroutine>
+#include <deque>
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <algorithm>
 
 #include "util.h"
 #include "thread.h"
+#include "coroutine.h"
 #include "queue.h"
 #include "log.h"
 
@@ -68,6 +74,7 @@ namespace cm_net {
 int create_socket(int domain);
 int create_socket();
 int server_socket_inet6(int host_port);
+int server_socket_inet6(int host_port, bool reuse_port);
 int server_socket(int host_port, int domain);
 int server_socket(int host_port);
 int shutdown(int fd, int how);
@@ -80,7 +87,7 @@ int gethostbyname(const std::string &host, hostent **host_ent);
 int connect_inet6(const std::string &host, int host_port, std::string &info);
 int connect(const std::string &host, int host_port, std::string &info);
 
-void send(int socket, const std::string &msg);
+int send(int socket, const std::string &msg);
 void send(int socket, char *buf, size_t buf_size, const std::string &msg);
 
 int recv(int socket, char *buf, size_t buf_size);
@@ -92,6 +99,7 @@ int resolve_host(const std::string &host, std::string &info, int flags);
 int resolve_host(const std::string &host, std::string &info);
 int resolve_host_ip(const std::string &host, std::string &info);
 int enable_reuseaddr(int fd);
+int enable_reuseport(int fd);
 int set_IPv6_only(int fd);
 int set_non_block(int fd, bool non_block);
 int set_keep_alive(int fd);
@@ -106,6 +114,21 @@ int set_receive_timeout(int fd, long long millis);
 
 // event-driven I/O
 #define MAX_EVENTS  64
+#define INPUT_EVENT_CACHE   1024    // released input_events kept for reuse
+#define INPUT_EVENT_MSG_MAX 65536   // larger msg buffers are not kept
+
+// Input sockets are edge triggered, so each wakeup drains the socket:
+// read_drain() appends to buf, doubling the read size while reads fill
+// it, until the socket is empty (EAGAIN or a short read) or budget bytes
+// have been read. It reads with MSG_DONTWAIT, so fd may be a blocking
+// socket. CM_NET_OK: drained; CM_NET_AGAIN: budget used up, more
+// may be waiting (re-arm the fd with modify_socket() to have epoll report
+// it again after the other ready fds); CM_NET_EOF / CM_NET_ERR. Data read
+// before EOF or an error is left in buf.
+#define INPUT_EPOLL_FLAGS   (EPOLLIN | EPOLLET | EPOLLRDHUP)
+#define INPUT_READ_MIN      4096        // first read into an empty buffer
+#define INPUT_READ_BUDGET   65536       // bytes read from one fd per wakeup
+int read_drain(int fd, std::string &buf, size_t budget = INPUT_READ_BUDGET);
 int epoll_create();
 int add_socket(int epollfd, int fd, uint32_t flags);
 int modify_socket(int epollfd, int fd, uint32_t flags);
@@ -135,7 +158,7 @@ protected:
 
     cm_net_receive(receive_fn) = nullptr;
 
-    char rbuf[4096] = { '\0' };
+    std::string rbuf;   // grows to the largest drain
 
     int epollfd;
     int listen_socket;
@@ -167,7 +190,7 @@ struct rx_thread: public cm_thread::basic_thread  {
     cm_net_receive(receive_fn) = nullptr;
     rx_thread *rx = nullptr;
 
-    //char rbuf[4096] = { '\0' };
+    std::string rbuf;   // grows to the largest drain
    
     bool setup();
     void cleanup();
@@ -199,13 +222,18 @@ protected:
     cm_net_receive(receive_fn) = nullptr;
     //rx_thread *rx = nullptr;
 
+    std::string rbuf;   // grows to the largest drain
+
     bool setup();
     void cleanup();
     bool process();
 
     int connect();
     int service_input_event(int fd);
-    void send(const std::string msg);
+
+    // send all of msg (waiting for the socket to take it), from the
+    // client's thread; CM_NET_OK or CM_NET_ERR
+    int send(const std::string msg);
 
 public:
     client_thread(const std::string host, int port, cm_net_receive(fn));
@@ -260,26 +288,125 @@ public:
 
 /////////////////////////// pool server ///////////////////////////////
 
+// How pool_server cuts a connection's input into frames:
+//
+//     none    each drained read is one frame (the default)
+//     line    a frame ends with '\n' (left out, as is a '\r' before it)
+//     length  a 4 byte big endian length, then that many bytes of frame
+//     custom  fn(buf, sz) gives the length of the frame at the start of
+//             buf (all of it is the frame), 0 while it is incomplete or
+//             -1 if the input is invalid
+//
+// A frame longer than max, or invalid input, closes the connection.
+
+enum class framing { none, line, length, custom };
+
+#define cm_net_frame(fn) long (*fn)(const char *buf, size_t sz)
+#define FRAME_MAX   (1024 * 1024)
+#define FRAME_LENGTH_SIZE   4
+
+struct frame_spec {
+    framing mode = framing::none;
+    cm_net_frame(fn) = nullptr;
+    size_t max = FRAME_MAX;
+
+    // append views of the complete frames in buf[0, sz) to frames; the
+    // bytes they take up, or -1 for invalid input. Bytes [0, scanned)
+    // are known to hold no frame end (line mode: not searched again);
+    // scanned is updated for the frame left incomplete.
+    long split(const char *buf, size_t sz, size_t &scanned,
+        std::vector<std::string_view> &frames) const;
+};
+
+// Output of a pool_server connection that its socket has not taken yet.
+// pool_server::send() writes straight to the socket while nothing is
+// queued; what the socket does not take is queued here, and the server's
+// loop writes it (writev, up to OUTPUT_IOV_MAX chunks at a time) when
+// epoll reports the socket writable. EPOLLOUT is armed only while there
+// is output queued. Past the high watermark the connection's input is
+// not read (EPOLLIN disarmed) until its output drains below the low one.
+
+#define OUTPUT_IOV_MAX          64
+#define OUTPUT_CHUNK_MERGE      4096    // smaller sends join the last chunk
+#define OUTPUT_HIGH_WATERMARK   (1024 * 1024)
+#define OUTPUT_LOW_WATERMARK    (256 * 1024)
+#define COALESCE_MAX_USEC       500     // longest the loop holds output
+
+struct output_queue {
+    cm::mutex mutex;
+    std::deque<std::string> chunks;
+    size_t offset = 0;          // of chunks.front() already written
+    size_t pending = 0;         // bytes queued
+    bool armed = false;         // EPOLLOUT armed
+    bool throttled = false;     // EPOLLIN disarmed
+    bool corked = false;        // held to be written together (coalescing)
+    bool closed = false;        // connection gone
+    int fd = -1;                // its socket (only while not closed)
+
+    uint32_t epoll_flags() {
+        return EPOLLET | EPOLLRDHUP | (throttled ? 0u : (uint32_t) EPOLLIN) |
+            (armed ? (uint32_t) EPOLLOUT : 0u);
+    }
+
+    // write queued output until it is all written or the socket is full,
+    // counting the write calls in writes; CM_NET_OK or CM_NET_ERR. Called
+    // with mutex held.
+    int flush(int fd, std::atomic<uint64_t> &writes);
+};
+
+class pool_server;
+
 struct input_event {
     int fd = -1;        // response socket
     std::string msg;    // input data
     bool eof = false;       // signals EOF (disonnected)
     bool connect = false;   // signals connect event
 
+    // complete frames, as views into msg (one view of all of msg when
+    // the connection is not framed)
+    std::vector<std::string_view> frames;
+
+    pool_server *server = nullptr;  // that read it (must outlive the task)
+    std::shared_ptr<output_queue> out;  // of the connection it came from
+
+    // reply on fd: queued on the connection's output (plain cm_net::write
+    // for an event that did not come from a server); CM_NET_OK, or
+    // CM_NET_ERR once that connection is gone, even if fd is reused
+    int send(const char *buf, size_t sz);
+    int send(const std::string &msg) { return send(msg.data(), msg.size()); }
+
     input_event() {}
     ~input_event() {}
 
     input_event(int fd_): fd(fd_), eof(true) {}
     input_event(int fd_, std::string msg_): fd(fd_), msg(msg_) {}
     input_event(const input_event &r): fd(r.fd), msg(r.msg), eof(r.eof),
-        connect(r.connect) {}
+        connect(r.connect), server(r.server), out(r.out) { copy_frames(r); }
     input_event &operator = (const input_event &r) {
         fd = r.fd;
         msg = r.msg;
         eof = r.eof;
         connect = r.connect;
+        copy_frames(r);
+        server = r.server;
+        out = r.out;
         return *this;
     }
+
+    // the same frames, in our copy of msg
+    void copy_frames(const input_event &r) {
+        frames.clear();
+        for(std::string_view f: r.frames) {
+            frames.emplace_back(msg.data() + (f.data() - r.msg.data()), f.size());
+        }
+    }
+
+    // pool_server events are recycled: create() reuses a released event,
+    // msg capacity included, so a read costs no allocation once warm.
+    // release() is the cm_task_dealloc for them (plain delete also works,
+    // the event is just not reused).
+    static input_event *create(int fd_);
+    static void release(void *arg);
 };
 
 class pool_server: public cm_thread::basic_thread  {
@@ -298,19 +425,155 @@ protected:
     struct epoll_event ev, events[MAX_EVENTS];
     int conn_sock, nfds, timeout = -1;    // ms timeout
 
+    bool reuse_port = false;    // listen on an SO_REUSEPORT socket
+    int shared_socket = -1;     // accept from this one, not our own
+
+    // input state of a connection: a frame left incomplete by the last
+    // read stays in partial's msg and the next read appends to it
+    struct connection {
+        frame_spec spec;
+        input_event *partial = nullptr;
+        size_t scanned = 0;
+        std::shared_ptr<output_queue> out;
+    };
+    std::unordered_map<int, connection> connections;
+
+    // the output queues again, for send() from other threads
+    cm::mutex outputs_mutex;
+    std::unordered_map<int, std::shared_ptr<output_queue>> outputs;
+    std::atomic<size_t> high_watermark{OUTPUT_HIGH_WATERMARK};
+    std::atomic<size_t> low_watermark{OUTPUT_LOW_WATERMARK};
+
+    std::shared_ptr<output_queue> output(int fd);
+    int update_events(int fd, output_queue &q);
+    int arm_output(int fd, output_queue &q);
+    int write_held(int fd, output_queue &q);
+
+    // write combining: queues with output held outside an event's task,
+    // since corked_since; idle: the loop waits with nothing held;
+    // holding: corked is not empty (read without corked_mutex)
+    std::atomic<bool> coalescing{false};
+    std::atomic<long> coalesce_usec{COALESCE_MAX_USEC};
+    cm::mutex corked_mutex;
+    std::vector<std::shared_ptr<output_queue>> corked, flushing;
+    uint64_t corked_since = 0;
+    bool idle = false;
+    std::atomic<bool> holding{false};
+
+    std::atomic<uint64_t> writes{0};
+
+    static void run_coalesced(void *arg);
+    void hold_output(const std::shared_ptr<output_queue> &q);
+    int wait_timeout();
+    void flush_held();
+
+    cm::mutex frame_mutex;
+    frame_spec framer;          // for connections accepted from now on
+
     bool setup();
     void cleanup();
     bool process();
 
     int accept();
     int service_input_event(int fd);
+    int service_output_event(int fd);
     int service_connect_event(int fd, const std::string info);
     int service_disconnect_event(int fd, const std::string info);
     
 public:
     pool_server(int port, cm_thread::pool *pool,
          cm_task_function(fn), cm_task_dealloc(dealloc_));
+
+    // one loop of a multi_pool_server: binds its own SO_REUSEPORT socket
+    // or, given a (non-blocking) shared_socket, accepts from that
+    pool_server(int port, cm_thread::pool *pool,
+         cm_task_function(fn), cm_task_dealloc(dealloc_),
+         bool reuse_port_, int shared_socket_ = -1);
     ~pool_server();
+
+    // cut the input of connections accepted from now on into frames
+    void set_framing(framing mode, cm_net_frame(fn) = nullptr, size_t max = FRAME_MAX);
+
+    // send on fd (a connection of this server) from any thread, without
+    // blocking: what the socket does not take now is queued and written
+    // by the loop. CM_NET_OK, or CM_NET_ERR if the connection is gone or
+    // the write failed.
+    int send(int fd, const char *buf, size_t sz);
+    int send(int fd, const std::string &msg) { return send(fd, msg.data(), msg.size()); }
+
+    // send on the connection that owns q (an input_event's out); the
+    // same, but CM_NET_ERR once that connection is gone
+    int send(const std::shared_ptr<output_queue> &q, const char *buf, size_t sz);
+
+    // bytes queued for fd
+    size_t output_pending(int fd);
+
+    void set_watermarks(size_t high, size_t low) {
+        high_watermark = high;
+        low_watermark = low;
+    }
+
+    // Write combining for pipelining clients. The replies an event's task
+    // sends on its connection are held and written together (one writev)
+    // when the task returns, so a read of many requests costs one write.
+    // Output sent from anywhere else is held until the end of a loop
+    // iteration at least max_usec after it was first held (an idle loop
+    // is woken for it), and output over the high watermark is written at
+    // once. Off by default; switching it off writes what is held.
+    void set_coalescing(bool on, long max_usec = COALESCE_MAX_USEC);
+
+    // write fd's held output now
+    void flush(int fd);
+    void flush(const std::shared_ptr<output_queue> &q);
+
+    // socket write calls made for send(), all connections
+    uint64_t write_count() { return writes; }
+};
+
+// N pool_server event loops on one port. Each loop has its own epoll set
+// and services only the connections it accepted, so a connection stays
+// on its loop for life; reads go to the pool exactly as for pool_server
+// (same input_event and callback). With reuse_port each loop binds its
+// own SO_REUSEPORT socket and the kernel spreads new connections across
+// them; otherwise the loops share one listen socket, each waiting on it
+// with EPOLLEXCLUSIVE so a connection wakes only one of them.
+
+class multi_pool_server {
+
+protected:
+
+    std::vector<std::unique_ptr<pool_server>> loops;
+    int listen_socket = -1;
+
+    // do not implement these constructors
+    multi_pool_server(const multi_pool_server &r);
+    multi_pool_server &operator = (const multi_pool_server &r);
+
+public:
+    multi_pool_server(int port, int loop_count, cm_thread::pool *pool,
+         cm_task_function(fn), cm_task_dealloc(dealloc_), bool reuse_port = true);
+    ~multi_pool_server();
+
+    // every loop is running
+    bool is_started();
+
+    int loop_count() { return (int) loops.size(); }
+    pool_server &loop(int n) { return *loops[n]; }
+
+    // run loop n on the n-th allowed CPU (wrapping); 0 or -1
+    int pin_loops();
+
+    void set_framing(framing mode, cm_net_frame(fn) = nullptr, size_t max = FRAME_MAX) {
+        for(auto &loop: loops) loop->set_framing(mode, fn, max);
+    }
+
+    void set_watermarks(size_t high, size_t low) {
+        for(auto &loop: loops) loop->set_watermarks(high, low);
+    }
+
+    void set_coalescing(bool on, long max_usec = COALESCE_MAX_USEC) {
+        for(auto &loop: loops) loop->set_coalescing(on, max_usec);
+    }
 };
 
 ////////////////////// SSL client_thread //////////////////////////
@@ -360,6 +623,84 @@ public:
 
 };
 
+////////////////////// coroutine I/O reactor //////////////////////////
+
+// Resumes coroutines when their sockets are ready:
+//
+//     uint32_t ev = co_await reactor.readable(fd);
+//
+// suspends the calling coroutine until fd can be read (writable(fd):
+// written) and resumes it on one of the pool's workers; the result is
+// the epoll events seen, so EPOLLHUP / EPOLLERR show up there too. The
+// worker is free for other coroutines meanwhile. One thread waits in
+// epoll for all fds; an fd is added on its first wait and armed one
+// shot for the waits pending on it. At most one reader and one writer
+// may wait on an fd at a time, and forget(fd) must be called (with no
+// waits pending) before the fd is closed. A wait that cannot be armed
+// completes at once with EPOLLERR. Waits still pending when the reactor
+// stops are abandoned like a resume on a stopped pool (coroutine.h):
+// the frames of their chains are destroyed.
+
+class io_reactor: public cm_thread::basic_thread  {
+
+public:
+    class io_awaiter {
+        friend class io_reactor;
+
+        io_reactor &reactor;
+        int fd;
+        uint32_t want;              // EPOLLIN or EPOLLOUT
+        uint32_t events = 0;        // what epoll reported
+        std::coroutine_handle<> handle;
+        std::coroutine_handle<> root;   // frame that owns handle's chain
+
+    public:
+        io_awaiter(io_reactor &r, int fd_, uint32_t want_): reactor(r), fd(fd_), want(want_) {}
+
+        bool await_ready() { return false; }
+        template<class P>
+        bool await_suspend(std::coroutine_handle<P> h) {
+            handle = h;
+            root = cm_thread::co_root(h);
+            return CM_NET_ERR != reactor.arm(this);
+        }
+        uint32_t await_resume() { return events; }
+    };
+
+protected:
+
+    struct waiters {
+        io_awaiter *reader = nullptr;
+        io_awaiter *writer = nullptr;
+        bool added = false;         // fd is in the epoll set
+    };
+
+    cm_thread::pool &pool;
+
+    int epollfd = -1;
+    struct epoll_event events[MAX_EVENTS];
+    int nfds;
+
+    cm::mutex fds_mutex;
+    std::unordered_map<int, waiters> fds;
+
+    bool setup();
+    void cleanup();
+    bool process();
+
+    int arm(io_awaiter *a);
+    int rearm(int fd, waiters &w);
+
+public:
+    io_reactor(cm_thread::pool &pool_);
+    ~io_reactor();
+
+    io_awaiter readable(int fd) { return io_awaiter(*this, fd, EPOLLIN); }
+    io_awaiter writable(int fd) { return io_awaiter(*this, fd, EPOLLOUT); }
+
+    void forget(int fd);
+};
+
 } // namespace cm_net
 
 #endif
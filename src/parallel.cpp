@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <exception>
+
+#include "parallel.h"
+
+
+namespace {
+
+// one parallel_chunks() call: shared by the caller and its helper tasks,
+// freed by the last of them (a helper may only run after the call has
+// returned, and then finds nothing left to claim)
+
+struct chunk_run {
+
+    std::atomic<size_t> next{0};        // next chunk to claim
+    std::atomic<size_t> finished{0};
+    std::atomic<int> refs;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+
+    size_t chunks;
+    void (*chunk)(void *, size_t);
+    void *body;
+
+    chunk_run(size_t chunks_, void (*chunk_)(void *, size_t), void *body_, int refs_):
+        refs(refs_), chunks(chunks_), chunk(chunk_), body(body_) { }
+
+    void work() {
+        size_t c;
+        while((c = next.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+            if(!failed.load(std::memory_order_relaxed)) {
+                try {
+                    chunk(body, c);
+                }
+                catch(...) {
+                    bool expected = false;
+                    if(failed.compare_exchange_strong(expected, true)) {
+                        error = std::current_exception();
+                    }
+                }
+            }
+            if(finished.fetch_add(1, std::memory_order_acq_rel) + 1 == chunks) {
+                finished.notify_all();
+            }
+        }
+    }
+
+    void wait() {
+        size_t n;
+        while((n = finished.load(std::memory_order_acquire)) < chunks) {
+            finished.wait(n, std::memory_order_acquire);
+        }
+    }
+
+    void release() {
+        if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+
+    static void help(void *arg) { static_cast<chunk_run *>(arg)->work(); }
+    static void dealloc(void *arg) { static_cast<chunk_run *>(arg)->release(); }
+};
+
+}
+
+void cm_thread::parallel_chunks(pool &p, size_t chunks, void (*chunk)(void *, size_t),
+    void *body) {
+
+    if(chunks == 0) return;
+
+    size_t helpers = std::min(chunks - 1, std::max(p.thread_count(), (size_t) 1));
+    chunk_run *run = new chunk_run(chunks, chunk, body, (int) helpers + 1);
+
+    for(size_t n = 0; n < helpers; n++) {
+        p.add_task(&chunk_run::help, run, &chunk_run::dealloc);
+    }
+
+    run->work();
+    run->wait();
+
+    std::exception_ptr error = run->error;
+    run->release();
+    if(error) std::rethrow_exception(error);
+}
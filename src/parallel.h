@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+#include "thread.h"
+
+namespace cm_thread {
+
+// Bulk loops on a pool. A range is cut into chunks of grain items (by
+// default about PARALLEL_CHUNKS chunks, whatever its size); the calling
+// thread and up to one helper task per pool worker claim chunks until
+// none are left, so a busy or slow worker just claims fewer of them. The
+// caller always works through the chunks itself and only waits for the
+// chunks already claimed by others, so these calls nest: a task on the
+// pool may start another loop on the same pool without tying up a worker.
+//
+// Results do not depend on timing or on the number of workers: chunk
+// bounds follow only from the range and the grain, parallel_reduce
+// combines chunk results in chunk order, and parallel_sort gives the
+// order std::stable_sort would. The first exception thrown by a chunk is
+// thrown again from the call once all claimed chunks are finished
+// (chunks not yet started are skipped).
+
+#define PARALLEL_CHUNKS     256     // chunks a range is cut into by default
+#define PARALLEL_SORT_RUNS  64      // parallel_sort: sorted runs by default
+#define PARALLEL_SORT_GRAIN 4096    // and their least size
+
+// runs chunk(body, c) for every c in [0, chunks) on the calling thread
+// and the pool, returns when all have run
+void parallel_chunks(pool &p, size_t chunks, void (*chunk)(void *, size_t), void *body);
+
+inline size_t parallel_grain(size_t n, size_t grain) {
+    if(grain == 0) grain = (n + PARALLEL_CHUNKS - 1) / PARALLEL_CHUNKS;
+    return std::max(grain, (size_t) 1);
+}
+
+// fn(c, begin, end) for chunk c of [first, last)
+template<class F>
+void parallel_chunk_range(pool &p, size_t first, size_t last, size_t grain, F &&fn) {
+
+    if(last <= first) return;
+    size_t chunks = (last - first + grain - 1) / grain;
+    if(chunks == 1) {
+        fn((size_t) 0, first, last);
+        return;
+    }
+
+    struct body_t {
+        std::remove_reference_t<F> &fn;
+        size_t first, last, grain;
+    } body = { fn, first, last, grain };
+
+    parallel_chunks(p, chunks, [](void *arg, size_t c) {
+        body_t *body = static_cast<body_t *>(arg);
+        size_t begin = body->first + c * body->grain;
+        size_t end = std::min(begin + body->grain, body->last);
+        body->fn(c, begin, end);
+    }, &body);
+}
+
+// fn(begin, end) over [first, last) in chunks
+template<class F>
+void parallel_for_range(pool &p, size_t first, size_t last, F &&fn, size_t grain = 0) {
+    if(last <= first) return;
+    parallel_chunk_range(p, first, last, parallel_grain(last - first, grain),
+        [&fn](size_t, size_t begin, size_t end) { fn(begin, end); });
+}
+
+// fn(i) for each i in [first, last)
+template<class F>
+void parallel_for(pool &p, size_t first, size_t last, F &&fn, size_t grain = 0) {
+    parallel_for_range(p, first, last, [&fn](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) fn(i);
+    }, grain);
+}
+
+// reduce(... reduce(reduce(identity, map(first)), map(first + 1)) ...)
+// folded per chunk from identity, then the chunk results folded in
+// order; reduce should be associative and identity its identity
+template<class T, class M, class R>
+T parallel_reduce(pool &p, size_t first, size_t last, T identity, M &&map,
+    R &&reduce, size_t grain = 0) {
+
+    if(last <= first) return identity;
+    grain = parallel_grain(last - first, grain);
+
+    // a struct per chunk: std::vector<bool> would pack the chunks'
+    // results into shared words
+    struct chunk_result { T value; };
+    std::vector<chunk_result> partial((last - first + grain - 1) / grain, chunk_result{identity});
+    parallel_chunk_range(p, first, last, grain, [&](size_t c, size_t begin, size_t end) {
+        T acc = identity;
+        for(size_t i = begin; i < end; i++) acc = reduce(std::move(acc), map(i));
+        partial[c].value = std::move(acc);
+    });
+
+    T result = std::move(identity);
+    for(auto &chunk: partial) result = reduce(std::move(result), std::move(chunk.value));
+    return result;
+}
+
+// std::transform over random access iterators; returns the end of out
+template<class InIt, class OutIt, class F>
+OutIt parallel_transform(pool &p, InIt first, InIt last, OutIt out, F &&fn,
+    size_t grain = 0) {
+
+    size_t n = std::distance(first, last);
+    parallel_for_range(p, 0, n, [&](size_t begin, size_t end) {
+        std::transform(first + begin, first + end, out + begin, std::ref(fn));
+    }, grain);
+    return out + n;
+}
+
+// merge position: items of a taken when the first k of the merge of
+// sorted a and b are taken (equal items: a's first)
+template<class It, class Compare>
+size_t merge_split(It a, size_t na, It b, size_t nb, size_t k, Compare &comp) {
+    size_t lo = k > nb ? k - nb : 0;
+    size_t hi = std::min(k, na);
+    while(lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        if(!comp(b[k - i - 1], a[i])) lo = i + 1;
+        else hi = i;
+    }
+    return lo;
+}
+
+// merges runs of width in src in pairs into dst, in pieces of grain
+// (width is a multiple of grain, so no piece spans two pairs)
+template<class SrcIt, class DstIt, class Compare>
+void parallel_merge_runs(pool &p, SrcIt src, DstIt dst, size_t n, size_t width,
+    size_t grain, Compare &comp) {
+
+    parallel_chunk_range(p, 0, n, grain, [&](size_t, size_t k0, size_t k1) {
+        size_t start = k0 / (2 * width) * (2 * width);
+        size_t mid = std::min(start + width, n);
+        size_t end = std::min(start + 2 * width, n);
+        SrcIt a = src + start, b = src + mid;
+        size_t na = mid - start, nb = end - mid;
+        size_t i0 = merge_split(a, na, b, nb, k0 - start, comp);
+        size_t i1 = merge_split(a, na, b, nb, k1 - start, comp);
+        size_t j0 = k0 - start - i0, j1 = k1 - start - i1;
+        std::merge(std::make_move_iterator(a + i0), std::make_move_iterator(a + i1),
+            std::make_move_iterator(b + j0), std::make_move_iterator(b + j1),
+            dst + k0, comp);
+    });
+}
+
+// stable sort: runs of grain items sorted on the pool, then merged in
+// pairs, each merge cut into pieces that also run on the pool; the
+// element type must be default constructible (for the merge buffer)
+template<class RandIt, class Compare = std::less<>>
+void parallel_sort(pool &p, RandIt first, RandIt last, Compare comp = Compare(),
+    size_t grain = 0) {
+
+    using value_type = typename std::iterator_traits<RandIt>::value_type;
+
+    size_t n = std::distance(first, last);
+    if(grain == 0) {
+        grain = std::max((size_t) PARALLEL_SORT_GRAIN,
+            (n + PARALLEL_SORT_RUNS - 1) / PARALLEL_SORT_RUNS);
+    }
+    if(n <= grain) {
+        std::stable_sort(first, last, comp);
+        return;
+    }
+
+    parallel_for_range(p, 0, n, [&](size_t begin, size_t end) {
+        std::stable_sort(first + begin, first + end, comp);
+    }, grain);
+
+    std::vector<value_type> buf(n);
+    bool in_buf = false;
+    for(size_t width = grain; width < n; width *= 2) {
+        if(in_buf) parallel_merge_runs(p, buf.begin(), first, n, width, grain, comp);
+        else parallel_merge_runs(p, first, buf.begin(), n, width, grain, comp);
+        in_buf = !in_buf;
+    }
+
+    if(in_buf) {
+        parallel_for_range(p, 0, n, [&](size_t begin, size_t end) {
+            std::move(buf.begin() + begin, buf.begin() + end, first + begin);
+        }, grain);
+    }
+}
+
+} // namespace cm_thread
+
+#endif
@@ -32,6 +32,10 @@
 
 #include <string>
 #include <deque>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <utility>
 
 #include "mutex.h"
 
@@ -64,6 +68,19 @@ public:
         in_mutex.unlock();
     }
 
+    void push_back(valueT &&value) {
+        in_mutex.lock();
+        in.push_back(std::move(value));
+        in_mutex.unlock();
+    }
+
+    template<class... Args>
+    void emplace_back(Args&&... args) {
+        in_mutex.lock();
+        in.emplace_back(std::forward<Args>(args)...);
+        in_mutex.unlock();
+    }
+
     void push_back(std::deque<valueT> &q) {
         in_mutex.lock();
         for(auto &value : q) {
@@ -72,18 +89,48 @@ public:
         in_mutex.unlock();
     }
 
+    // append a whole batch with one lock and leave q empty: when the input
+    // side is empty the deques are swapped (O(1)), otherwise the values are
+    // moved, never copied
+    void push_back(std::deque<valueT> &&q) {
+        in_mutex.lock();
+        if(in.empty()) {
+            in.swap(q);
+        }
+        else {
+            in.insert(in.end(), std::make_move_iterator(q.begin()),
+                std::make_move_iterator(q.end()));
+        }
+        in_mutex.unlock();
+        q.clear();
+    }
+
     valueT pop_front() {
-        valueT value;
+        valueT value = valueT();
         out_mutex.lock();
         if(out.empty()) _swap();
         if(!out.empty()) {
-            value = out.front();
+            value = std::move(out.front());
             out.pop_front();
         }
         out_mutex.unlock();
         return value;
     }
 
+    // move up to max values to the back of v with one lock round-trip,
+    // returns the number of values moved
+    size_t pop_front(std::vector<valueT> &v, size_t max) {
+        size_t count = 0;
+        out_mutex.lock();
+        if(out.empty()) _swap();
+        count = std::min(max, (size_t) out.size());
+        v.insert(v.end(), std::make_move_iterator(out.begin()),
+            std::make_move_iterator(out.begin() + count));
+        out.erase(out.begin(), out.begin() + count);
+        out_mutex.unlock();
+        return count;
+    }
+
     void swap_out(std::deque<valueT> &q) {
         out_mutex.lock();
         if(out.empty()) _swap();
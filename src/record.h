@@ -237,7 +237,22 @@ public:
 
 
 // load records from inputstream into specified store in memory
-bool load_records_to_store(istream &is, record &record, string key_field_name, string value_field_name, cm_store::info_store<std::string,std::string> *store);
+// (any store with the info_store interface, e.g. info_store or sharded_store)
+template<class storeT>
+bool load_records_to_store(istream &is, record &record, string key_field_name, string value_field_name, storeT *store) {
+
+    string input;
+    while(getline(is, input)) {
+        // parse the input string
+        record.parse(input);
+        // add entry to store (map)
+        string key = record.get(key_field_name);
+        string value = record.get(value_field_name);
+        store->set(key, value);
+    }
+
+    return true;
+}
 
 }
 
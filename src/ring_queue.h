@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RING_QUEUE_H
+#define __RING_QUEUE_H
+
+#include <sched.h>
+
+#include <string>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include "mutex.h"
+
+#define RING_QUEUE_CAPACITY     4096
+#define RING_QUEUE_SPINS        100     // attempts before a blocking call parks
+#define RING_QUEUE_ALIGN        64      // cache line
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ring_queue_pause()      __builtin_ia32_pause()
+#else
+#define ring_queue_pause()      ((void) 0)
+#endif
+
+namespace cm_queue {
+
+// Bounded lock-free multi-producer/multi-consumer FIFO queue (D. Vyukov's
+// array queue). Each cell carries a sequence number that tells producers
+// and consumers whether it is free or filled for their lap of the ring,
+// so a push or pop is one CAS on the tail or head plus one release store;
+// nothing is allocated after construction. Capacity is rounded up to a
+// power of two.
+//
+// The API follows double_queue: push_back, pop_front and swap_out, plus
+//
+//   try_push/try_pop      one attempt, false if full/empty
+//   spin_push/spin_pop    retry until done, never sleep
+//   push_back/pop_wait    spin briefly, then sleep on a condition until
+//                         a consumer/producer makes room/an item
+//
+// pop_front() does not block: as with double_queue it returns a default
+// constructed value when the queue is empty. The condition is only
+// signalled while a thread is actually parked on it.
+
+template<class valueT>
+class ring_queue {
+
+protected:
+    struct cell {
+        std::atomic<size_t> seq;
+        valueT value;
+    };
+
+    alignas(RING_QUEUE_ALIGN) std::atomic<size_t> tail{0};     // next push
+    alignas(RING_QUEUE_ALIGN) std::atomic<size_t> head{0};     // next pop
+    alignas(RING_QUEUE_ALIGN) std::unique_ptr<cell[]> cells;
+    size_t mask;
+
+    // parking for the blocking variants
+    std::atomic<int> push_waiters{0};
+    std::atomic<int> pop_waiters{0};
+    cm::mutex wait_mutex;
+    cm::cond not_full;
+    cm::cond not_empty;
+
+    static size_t round_up(size_t n) {
+        size_t capacity = 2;
+        while(capacity < n) capacity <<= 1;
+        return capacity;
+    }
+
+    template<class V>
+    bool _push(V &&value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while(true) {
+            cell &c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+            if(dif == 0) {
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = std::forward<V>(value);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(dif < 0) {
+                return false;   // full
+            }
+            else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool _pop(valueT &value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while(true) {
+            cell &c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if(dif == 0) {
+                if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(c.value);
+                    c.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(dif < 0) {
+                return false;   // empty
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // wake a parked thread; the seq_cst fence pairs with the one in
+    // park() so either the waiter sees our change or we see the waiter
+    void wake(std::atomic<int> &waiters, cm::cond &cond, bool all) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_relaxed) > 0) {
+            wait_mutex.lock();
+            if(all) cond.broadcast();
+            else cond.signal();
+            wait_mutex.unlock();
+        }
+    }
+
+    template<class tryT>
+    void park(std::atomic<int> &waiters, cm::cond &cond, tryT attempt) {
+        for(int n = 0; n < RING_QUEUE_SPINS; n++) {
+            if(attempt()) return;
+            ring_queue_pause();
+        }
+        wait_mutex.lock();
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while(!attempt()) {
+            cond.wait(wait_mutex);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        wait_mutex.unlock();
+    }
+
+    bool pushed(bool ok) {
+        if(ok) wake(pop_waiters, not_empty, false);
+        return ok;
+    }
+
+    bool popped(bool ok, bool all = false) {
+        if(ok) wake(push_waiters, not_full, all);
+        return ok;
+    }
+
+public:
+
+    explicit ring_queue(size_t capacity = RING_QUEUE_CAPACITY) {
+        size_t n = round_up(capacity);
+        cells.reset(new cell[n]);
+        for(size_t i = 0; i < n; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        mask = n - 1;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // a snapshot only while other threads are pushing or popping
+    size_t size() const {
+        size_t h = head.load(std::memory_order_acquire);
+        size_t t = tail.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    bool try_push(const valueT &value) { return pushed(_push(value)); }
+    bool try_push(valueT &&value) { return pushed(_push(std::move(value))); }
+
+    bool try_pop(valueT &value) { return popped(_pop(value)); }
+
+    void spin_push(const valueT &value) {
+        while(!_push(value)) ring_queue_pause();
+        pushed(true);
+    }
+
+    void spin_pop(valueT &value) {
+        while(!_pop(value)) ring_queue_pause();
+        popped(true);
+    }
+
+    // blocks while the queue is full
+    void push_back(const valueT &value) {
+        park(push_waiters, not_full, [&]() { return _push(value); });
+        pushed(true);
+    }
+
+    void push_back(valueT &&value) {
+        park(push_waiters, not_full, [&]() { return _push(std::move(value)); });
+        pushed(true);
+    }
+
+    void push_back(std::deque<valueT> &q) {
+        for(auto &value : q) {
+            push_back(value);
+        }
+    }
+
+    // blocks while the queue is empty
+    void pop_wait(valueT &value) {
+        park(pop_waiters, not_empty, [&]() { return _pop(value); });
+        popped(true);
+    }
+
+    valueT pop_front() {
+        valueT value = valueT();
+        try_pop(value);
+        return value;
+    }
+
+    // move everything currently queued to the back of q
+    void swap_out(std::deque<valueT> &q) {
+        valueT value;
+        bool any = false;
+        while(_pop(value)) {
+            q.push_back(std::move(value));
+            any = true;
+        }
+        popped(any, true);
+    }
+
+private:
+    // do not implement these constructors
+    ring_queue(const ring_queue &);
+    const ring_queue &operator=(const ring_queue &);
+};
+
+} // namespace cm_queue
+
+#endif	// __RING_QUEUE_H
@@ -267,6 +267,9 @@ protected:
         if(-1 == epollfd) {
             return false;
         }
+        if(-1 == cm_sio::add_fd(epollfd, wakeup.fd(), EPOLLIN)) {
+            return false;
+        }
 
         for(auto &port: ports) {
             if(port_setup(port.c_str(), B9600)) {
@@ -302,6 +305,11 @@ protected:
 
             int fd = events[n].data.fd;
 
+            if(fd == wakeup.fd()) {
+                wakeup.clear();
+                continue;
+            }
+
             //if(fd != epollfd) {
                 int result = 0;
                 if(events[n].events & EPOLLIN) {
@@ -345,6 +353,8 @@ protected:
 public:
     sio_server(const std::vector<std::string> &_ports, sio_callback(fn)): ports(_ports),
      receive_fn(fn) {
+        set_run_mode(cm_thread::run_mode::blocking);
+
         // start processing thread
         start();
     }
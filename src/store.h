@@ -30,26 +30,95 @@
 #ifndef __STORE_H
 #define __STORE_H
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <functional>
 
 #include "mutex.h"
+#include "flat_map.h"
 
 namespace cm_store {
 
+// Transparent hash for string keys: lets check/find/get/visit accept a
+// std::string_view or const char * and probe the map without building a
+// temporary std::string (heterogeneous lookup, C++20 library).
+
+struct string_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const {
+        return std::hash<std::string_view>()(s);
+    }
+};
+
+template<class keyT>
+struct store_traits {
+    typedef std::hash<keyT> hash;
+    typedef std::equal_to<keyT> equal;
+};
+
+template<>
+struct store_traits<std::string> {
+    typedef string_hash hash;
+    typedef std::equal_to<> equal;
+};
+
+// map types for info_store: node based (default) and open addressing
+
+template<class keyT, class valueT>
+using hash_map = std::unordered_map<keyT,valueT,
+    typename store_traits<keyT>::hash, typename store_traits<keyT>::equal>;
 
 template<class keyT, class valueT>
-class info_store: protected cm::mutex {
+using open_map = flat_map<keyT,valueT,
+    typename store_traits<keyT>::hash, typename store_traits<keyT>::equal>;
+
+
+// lockT selects the locking mode: cm::mutex (default) serializes every
+// call, cm::rwlock lets concurrent readers (check, find, get, visit, size)
+// share the lock while writers (set, remove, swap, clear) remain exclusive.
+//
+// Lookups are templated on the key argument so string stores can be
+// probed with a std::string_view in a single hash/probe. visit() hands
+// the value to a callback by const reference while the lock is held,
+// avoiding the copy find() makes; the callback must not call back into
+// the same store.
+//
+// mapT selects the table: hash_map (std::unordered_map, the default) or
+// open_map (flat_map, one contiguous table without per-entry nodes,
+// for large stores of small entries).
+
+template<class keyT, class valueT, class lockT = cm::mutex,
+         class mapT = hash_map<keyT,valueT>>
+class info_store: protected lockT {
 
 protected:
+    typedef mapT map_type;
+
     // unordered map for faster access vs. map using buckets
-    std::unordered_map<keyT,valueT> _map;
+    map_type _map;
+
+    void read_lock() { cm::read_lock(*this); }
+
+    template<class K>
+    typename map_type::const_iterator _find(const K &name) const {
+#ifdef __cpp_lib_generic_unordered_lookup
+        return _map.find(name);
+#else
+        return _map.find(keyT(name));
+#endif
+    }
+
+    using lockT::lock;
+    using lockT::unlock;
 
 public:
 
-    bool check(const keyT &name) {
-        lock();
-        bool b = _map.find(name) != _map.end();
+    template<class K>
+    bool check(const K &name) {
+        read_lock();
+        bool b = _find(name) != _map.end();
         unlock();
         return b;
     }
@@ -61,25 +130,42 @@ public:
         return true;
     }
 
-    valueT find(const keyT &name) {
+    template<class K>
+    valueT find(const K &name) {
         valueT value;
-        lock();
-        if( _map.find(name) != _map.end() ) {
-            value = _map[name];
+        read_lock();
+        auto p = _find(name);
+        if(p != _map.end()) {
+            value = p->second;
         }
         unlock();
         return value;
     }
 
-    valueT get(const keyT &name, const valueT &_default) {
+    template<class K>
+    valueT get(const K &name, const valueT &_default) {
         valueT value = _default;
-        lock();
-        if(_map.find(name) != _map.end()) {
-           value = _map[name]; 
+        read_lock();
+        auto p = _find(name);
+        if(p != _map.end()) {
+            value = p->second;
         }
         unlock();
         return value;
     }
+
+    // call fn(const valueT &) with the lock held; returns false if not found
+    template<class K, class fnT>
+    bool visit(const K &name, fnT fn) {
+        read_lock();
+        auto p = _find(name);
+        bool found = p != _map.end();
+        if(found) {
+            fn(p->second);
+        }
+        unlock();
+        return found;
+    }
     
     size_t remove(const keyT &name) {
         lock();
@@ -89,13 +175,13 @@ public:
     }
 
     size_t size() {
-        lock();
+        read_lock();
         size_t size = _map.size();
         unlock();
         return size;
     }
 
-    void swap(info_store<keyT,valueT> &store) {
+    void swap(info_store<keyT,valueT,lockT,mapT> &store) {
         lock();
         _map.swap(store._map);
         unlock();
@@ -106,6 +192,130 @@ public:
         _map.clear();
         unlock();
     }
+
+    // call fn(name, value) for every entry with the read lock held;
+    // fn must not call back into the store
+    template<class fnT>
+    void for_each(fnT fn) {
+        read_lock();
+        for(auto &p : _map) {
+            fn(p.first, p.second);
+        }
+        unlock();
+    }
+};
+
+
+// Implements a lock-striped store with the same interface as info_store.
+// Entries are spread over shardsN independently locked info_store shards
+// selected by key hash, so threads working on different keys rarely
+// contend for the same mutex. shardsN must be a power of two.
+//
+// size() sums the shards one at a time and is therefore only a point in
+// time estimate while other threads are writing. lockT and mapT are
+// passed on to the shards (see info_store). storeT replaces the shard
+// type with another store of the same interface (e.g. bounded_store),
+// configured per shard through for_each_shard().
+
+template<class keyT, class valueT, size_t shardsN = 16, class lockT = cm::mutex,
+         class mapT = hash_map<keyT,valueT>,
+         class storeT = info_store<keyT,valueT,lockT,mapT>>
+class sharded_store {
+
+    static_assert(shardsN > 0 && (shardsN & (shardsN - 1)) == 0,
+        "sharded_store: shardsN must be a power of two");
+
+protected:
+    // pad each shard to its own cache lines to avoid false sharing
+    struct alignas(64) shard: public storeT { };
+
+    shard _shards[shardsN];
+
+    template<class K>
+    shard &shard_for(const K &name) {
+        uint64_t h = typename store_traits<keyT>::hash()(name);
+        // fold high bits down so identity hashes (ints) still spread; on
+        // uint64_t so the shift is defined where size_t is 32 bits
+        h ^= (h >> 32);
+        h ^= (h >> 16);
+        return _shards[h & (shardsN - 1)];
+    }
+
+public:
+
+    template<class K>
+    bool check(const K &name) {
+        return shard_for(name).check(name);
+    }
+
+    bool set(const keyT &name, const valueT &value) {
+        return shard_for(name).set(name, value);
+    }
+
+    template<class K>
+    valueT find(const K &name) {
+        return shard_for(name).find(name);
+    }
+
+    template<class K>
+    valueT get(const K &name, const valueT &_default) {
+        return shard_for(name).get(name, _default);
+    }
+
+    template<class K, class fnT>
+    bool visit(const K &name, fnT fn) {
+        return shard_for(name).visit(name, fn);
+    }
+
+    size_t remove(const keyT &name) {
+        return shard_for(name).remove(name);
+    }
+
+    size_t size() {
+        size_t size = 0;
+        for(auto &s : _shards) {
+            size += s.size();
+        }
+        return size;
+    }
+
+    void swap(sharded_store<keyT,valueT,shardsN,lockT,mapT,storeT> &store) {
+        for(size_t n = 0; n < shardsN; ++n) {
+            _shards[n].swap(store._shards[n]);
+        }
+    }
+
+    void clear() {
+        for(auto &s : _shards) {
+            s.clear();
+        }
+    }
+
+    // visits one shard at a time (see info_store::for_each)
+    template<class fnT>
+    void for_each(fnT fn) {
+        for(auto &s : _shards) {
+            s.for_each(fn);
+        }
+    }
+
+    template<class fnT>
+    void for_each_shard(fnT fn) {
+        for(auto &s : _shards) {
+            fn(static_cast<storeT &>(s));
+        }
+    }
+
+    // sum of per-shard counters, for shard types providing stats()
+    auto stats() {
+        auto total = _shards[0].stats();
+        for(size_t n = 1; n < shardsN; ++n) {
+            total += _shards[n].stats();
+        }
+        return total;
+    }
+
+    size_t shard_count() const { return shardsN; }
 };
 
 
@@ -27,16 +27,159 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <fstream>
+
 #include "thread.h"
 
 
+///////////////////// cpu topology /////////////////////////////
+
+// "0-3,8-11"
+static std::vector<int> parse_cpulist(const std::string &list) {
+
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while(pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if(end == std::string::npos) end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        int first, last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if(n == 1) last = first;
+        if(n >= 1) {
+            for(int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+static cm_thread::cpu_topology read_topology() {
+
+    cm_thread::cpu_topology topology;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for(int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    std::vector<int> node_ids;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if(dir) {
+        struct dirent *entry;
+        while((entry = readdir(dir)) != nullptr) {
+            int id;
+            if(sscanf(entry->d_name, "node%d", &id) == 1) node_ids.push_back(id);
+        }
+        closedir(dir);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+
+    for(int id: node_ids) {
+        std::ifstream in(cm_util::format("/sys/devices/system/node/node%d/cpulist", id));
+        std::string list;
+        std::getline(in, list);
+        std::vector<int> cpus;
+        for(int cpu: parse_cpulist(list)) {
+            if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+        if(!cpus.empty()) topology.nodes.push_back(cpus);
+    }
+
+    if(topology.nodes.empty()) {
+        std::vector<int> cpus;
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+        topology.nodes.push_back(cpus);
+    }
+
+    return topology;
+}
+
+const cm_thread::cpu_topology &cm_thread::cpu_topology::get() {
+    static const cpu_topology topology = read_topology();
+    return topology;
+}
+
+int cm_thread::cpu_topology::cpu_count() const {
+    int count = 0;
+    for(auto &cpus: nodes) count += (int) cpus.size();
+    return count;
+}
+
+int cm_thread::cpu_topology::node_of(int cpu) const {
+    for(size_t node = 0; node < nodes.size(); node++) {
+        for(int c: nodes[node]) {
+            if(c == cpu) return (int) node;
+        }
+    }
+    return -1;
+}
+
+// prefer memory of a node for the calling thread (no libnuma needed)
+static void prefer_node(int node) {
+    unsigned long mask[4] = {0};
+    if(node < 0 || node >= (int) (sizeof(mask) * 8)) return;
+    mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+    if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+        cm_log::warning(cm_util::format("set_mempolicy node %d failed: %s", node, strerror(errno)));
+    }
+}
+
+///////////////////// wake event /////////////////////////////
+
+cm_thread::wake_event::wake_event() {
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(-1 == efd) {
+        cm_log::error(cm_util::format("eventfd failed: %s", strerror(errno)));
+    }
+}
+
+cm_thread::wake_event::~wake_event() {
+    if(-1 != efd) close(efd);
+}
+
+void cm_thread::wake_event::wake() {
+    uint64_t one = 1;
+    ssize_t n = write(efd, &one, sizeof(one));
+    (void) n;   // EAGAIN: the counter is already set
+}
+
+bool cm_thread::wake_event::park(const timespec *timeout) {
+    pollfd pfd = { efd, POLLIN, 0 };
+    int n = ppoll(&pfd, 1, timeout, nullptr);
+    if(n <= 0) return false;    // timeout (or signal)
+    clear();
+    return true;
+}
+
+void cm_thread::wake_event::clear() {
+    uint64_t value;
+    ssize_t n = read(efd, &value, sizeof(value));
+    (void) n;
+}
+
+///////////////////// basic thread /////////////////////////////
+
 extern "C" {
 
+// tid is kept so the thread can still be joined
 void cm_thread::basic_thread::cleanup_handler(void *p) {
     cm_thread::basic_thread *tp = (cm_thread::basic_thread*)p;
-    tp->tid = 0;
-    tp->done = true;
     tp->cleanup();
+    tp->set_state(tp->done);
 }
 
 void *cm_thread::basic_thread::run_handler(void *p) {
@@ -46,10 +189,16 @@ void *cm_thread::basic_thread::run_handler(void *p) {
 
     tp->sys_tid = cm_util::tid();
 
+    if(tp->numa_node >= 0) {
+        prefer_node(tp->numa_node);
+    }
+
     if(tp->setup()) {
-        tp->started = true;
-        while(tp->process()) {
-            nanosleep(&tp->delay, NULL);
+        tp->set_state(tp->started);
+        while(!tp->stopping && tp->process()) {
+            if(tp->mode == run_mode::delayed) {
+                tp->wakeup.park(&tp->delay);
+            }
         }
     }
 
@@ -65,23 +214,47 @@ cm_thread::basic_thread::basic_thread():
 }
 
 cm_thread::basic_thread::~basic_thread() {
-    if(is_started() && !is_done()) stop();
+    stop();
+}
+
+void cm_thread::basic_thread::set_state(std::atomic<bool> &state) {
+    state_mutex.lock();
+    state = true;
+    state_cond.broadcast();
+    state_mutex.unlock();
 }
 
 void cm_thread::basic_thread::start() {
-   
+
+    if(tid != 0 && is_done()) {
+        join();
+    }
+
     if(tid == 0) {
         started = done = false;
+        stopping = false;
+        wakeup.clear();
 
         rc = pthread_attr_init(&attr);
 
         rc = pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
 
+        if(affinity) {
+            rc = pthread_attr_setaffinity_np(&attr, sizeof(cpu_mask), &cpu_mask);
+        }
+
         rc = pthread_create(&tid, &attr, &run_handler, (void*) this);
+        if(rc != 0) {
+            tid = 0;
+            done = true;
+            return;
+        }
 
+        state_mutex.lock();
         while(!is_started() && !is_done()) {
-            nanosleep(&delay, NULL);
+            state_cond.wait(state_mutex);
         }
+        state_mutex.unlock();
     }
 }
 
@@ -92,124 +265,850 @@ void cm_thread::basic_thread::stop() {
             // self terminating
             pthread_exit(NULL);
         }
-        else if(is_started()) {
+        else {
             // being terminated by another thread
-            pthread_cancel(tid);        /* request thread cancel */
-            pthread_join(tid, NULL);/* wait here until its done */
+            if(!is_done()) {
+                request_stop();
+                timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += THREAD_STOP_GRACE_MILLIS / 1000;
+                ts.tv_nsec += (THREAD_STOP_GRACE_MILLIS % 1000) * 1000000L;
+                if(ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                if(pthread_timedjoin_np(tid, NULL, &ts) == 0) {
+                    tid = 0;
+                    return;
+                }
+                cm_log::warning(cm_util::format("thread %d did not stop, cancelling", sys_tid));
+                pthread_cancel(tid);    /* request thread cancel */
+            }
+            pthread_join(tid, NULL);    /* wait here until its done */
+            tid = 0;
+        }
+    }
+}
+
+int cm_thread::basic_thread::set_affinity(const std::vector<int> &cpus) {
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for(int cpu: cpus) {
+        if(cpu < 0 || cpu >= CPU_SETSIZE) {
+            cm_log::error(cm_util::format("set_affinity: invalid cpu %d", cpu));
+            return -1;
         }
+        CPU_SET(cpu, &mask);
+    }
+    if(CPU_COUNT(&mask) == 0) {
+        cm_log::error("set_affinity: no cpus");
+        return -1;
+    }
+
+    cpu_mask = mask;
+    affinity = true;
+
+    if(tid != 0 && !is_done()) {
+        int err = pthread_setaffinity_np(tid, sizeof(cpu_mask), &cpu_mask);
+        if(err != 0) {
+            cm_log::error(cm_util::format("set_affinity failed: %s", strerror(err)));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int cm_thread::basic_thread::set_node(int node) {
+
+    const cpu_topology &topology = cpu_topology::get();
+    if(node < 0 || node >= topology.node_count()) {
+        cm_log::error(cm_util::format("set_node: invalid node %d", node));
+        return -1;
+    }
+    numa_node = node;
+    return set_affinity(topology.nodes[node]);
+}
+
+void cm_thread::basic_thread::join() {
+
+    if(tid != 0 && pthread_self() != tid) {
+        pthread_join(tid, NULL);
+        tid = 0;
+    }
+}
+
+///////////////////// task allocator /////////////////////////////
+
+#define TASK_ALLOC_CLASSES  5       // 64, 128, 256, 512, 1024 bytes
+
+namespace {
+
+struct task_cache;
+
+// in front of every block: where it goes back to
+struct alignas(TASK_ALLOC_ALIGN) block_header {
+    task_cache *cache;              // nullptr: heap block
+    size_t size_class;
+};
+
+struct free_block {
+    free_block *next;
+};
+
+struct task_cache {
+    free_block *local[TASK_ALLOC_CLASSES] = {};              // owner only
+    std::atomic<free_block *> remote[TASK_ALLOC_CLASSES] = {};  // freed elsewhere
+    task_cache *next_orphan = nullptr;
+};
+
+void free_list(free_block *b) {
+    while(b) {
+        free_block *next = b->next;
+        ::operator delete((void *) b);
+        b = next;
+    }
+}
+
+// Caches of exited threads, adopted by new threads. A cache outlives its
+// thread because blocks it handed out may still be freed to it; reusing
+// it keeps those blocks (and the cache itself) from leaking as threads
+// come and go. A plain pthread mutex: threads may exit during static
+// destruction.
+pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+task_cache *orphans = nullptr;
+
+task_cache *adopt_cache() {
+    pthread_mutex_lock(&orphans_mutex);
+    task_cache *cache = orphans;
+    if(cache) orphans = cache->next_orphan;
+    pthread_mutex_unlock(&orphans_mutex);
+    if(!cache) return new task_cache();
+    cache->next_orphan = nullptr;
+    return cache;
+}
+
+// on thread exit: free the cached blocks, including those other threads
+// freed to it so far, and leave the cache for the next thread
+struct cache_holder {
+    task_cache *cache = nullptr;
+    ~cache_holder() {
+        if(!cache) return;
+        for(int c = 0; c < TASK_ALLOC_CLASSES; c++) {
+            free_list(cache->local[c]);
+            cache->local[c] = nullptr;
+            free_list(cache->remote[c].exchange(nullptr, std::memory_order_acquire));
+        }
+        pthread_mutex_lock(&orphans_mutex);
+        cache->next_orphan = orphans;
+        orphans = cache;
+        pthread_mutex_unlock(&orphans_mutex);
+        cache = nullptr;
+    }
+};
+
+thread_local cache_holder this_cache;
+
+inline size_t class_size(size_t c) { return (size_t) 64 << c; }
+
+static_assert(sizeof(cm_thread::task) + sizeof(block_header) <= 128,
+    "task record no longer fits a 128 byte block");
+
+}
+
+void *cm_thread::task_alloc(size_t size) {
+
+    size_t total = size + sizeof(block_header);
+    size_t c = 0;
+    while(c < TASK_ALLOC_CLASSES && class_size(c) < total) c++;
+
+    if(c == TASK_ALLOC_CLASSES) {
+        block_header *h = (block_header *) ::operator new(total);
+        h->cache = nullptr;
+        h->size_class = c;
+        return h + 1;
+    }
+
+    task_cache *cache = this_cache.cache;
+    if(!cache) cache = this_cache.cache = adopt_cache();
+
+    free_block *b = cache->local[c];
+    if(!b) {
+        // take back everything other threads have freed
+        b = cache->remote[c].exchange(nullptr, std::memory_order_acquire);
+    }
+
+    block_header *h;
+    if(b) {
+        cache->local[c] = b->next;
+        h = (block_header *) b;
+    }
+    else {
+        h = (block_header *) ::operator new(class_size(c));
+    }
+    h->cache = cache;
+    h->size_class = c;
+    return h + 1;
+}
+
+void cm_thread::task_free(void *p) {
+
+    if(!p) return;
+
+    block_header *h = (block_header *) p - 1;
+    task_cache *cache = h->cache;
+    size_t c = h->size_class;
+
+    if(!cache) {
+        ::operator delete((void *) h);
+        return;
+    }
+
+    free_block *b = (free_block *) h;
+    if(cache == this_cache.cache) {
+        b->next = cache->local[c];
+        cache->local[c] = b;
+        return;
+    }
+
+    b->next = cache->remote[c].load(std::memory_order_relaxed);
+    while(!cache->remote[c].compare_exchange_weak(b->next, b,
+            std::memory_order_release, std::memory_order_relaxed)) {
     }
 }
 
 ///////////////////// thread pool ////////////////////////////////
 
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+using cm_util::counter_add;
+using cm_util::counter_load;
+
+void cm_thread::worker_stats::clear() {
+    for(auto &h: lane_wait) h.clear();
+    run.clear();
+    cm_util::counter_store(tasks, 0);
+    cm_util::counter_store(steals, 0);
+    cm_util::counter_store(idle_ns, 0);
+}
+
+void cm_thread::pool_stats::merge(const worker_stats &w) {
+    workers++;
+    for(int n = 0; n < POOL_LANES; n++) {
+        wait.merge(w.lane_wait[n]);
+        lane_wait[n].merge(w.lane_wait[n]);
+    }
+    run.merge(w.run);
+    tasks += counter_load(w.tasks);
+    steals += counter_load(w.steals);
+    busy_ns += w.run.total();
+    idle_ns += counter_load(w.idle_ns);
+}
+
+void cm_thread::pool_stats::merge(const pool_stats &r) {
+    workers += r.workers;
+    wait.merge(r.wait);
+    for(int n = 0; n < POOL_LANES; n++) {
+        lane_wait[n].merge(r.lane_wait[n]);
+    }
+    run.merge(r.run);
+    tasks += r.tasks;
+    steals += r.steals;
+    busy_ns += r.busy_ns;
+    idle_ns += r.idle_ns;
+}
+
+double cm_thread::pool_stats::utilization() const {
+    uint64_t total = busy_ns + idle_ns;
+    return total ? (double) busy_ns / total : 0.0;
+}
+
+std::string cm_thread::pool_stats::to_text() const {
+    return cm_util::format("workers: %d tasks: %lu steals: %lu busy ms: %.1lf idle ms: %.1lf utilization: %.1lf%%\n"
+        "wait ns: %s\nrun ns: %s\n", workers, tasks, steals, busy_ns / 1e6, idle_ns / 1e6,
+        utilization() * 100.0, wait.to_text().c_str(), run.to_text().c_str());
+}
+
+std::string cm_thread::pool_stats::to_json() const {
+    return cm_util::format("{\"workers\":%d,\"tasks\":%lu,\"steals\":%lu,\"busy_ns\":%lu,"
+        "\"idle_ns\":%lu,\"utilization\":%.4lf,\"wait_ns\":%s,\"run_ns\":%s}", workers,
+        tasks, steals, busy_ns, idle_ns, utilization(), wait.to_json().c_str(),
+        run.to_json().c_str());
+}
+
+// worker running on this thread, if any (routes subtasks to its deque)
+static thread_local cm_thread::worker_thread *current_worker = nullptr;
+
+bool cm_thread::worker_thread::setup() {
+    current_worker = this;
+    run_start = 0;
+    idle_start = monotonic_ns();    // idle from here to the first task
+    return true;
+}
+
 bool cm_thread::worker_thread::process() {
+
+    if(thread_pool->mode == pool_mode::work_stealing) {
+        return thread_pool->run_stealing(this);
+    }
     
-    bool do_work = thread_pool->next_task(thread_work_task);
+    task *t = thread_pool->next_task(this);
+    if(t == nullptr) return false;
+
     thread_pool->task_begin();
-    if(do_work) {
-        thread_work_task.function(thread_work_task.arg);
-        thread_work_task.done = true;
-        if(thread_work_task.arg && thread_work_task.dealloc) {
-            thread_work_task.dealloc(thread_work_task.arg);
-        }
-        task_count++;
-    }
+    thread_pool->record_start(t, this);
+    task::finish(t);
+    thread_pool->record_end(this);
     thread_pool->task_end();
-    return do_work;
+    thread_pool->task_done();
+    return true;
 }
 
-cm_thread::worker_thread::worker_thread(cm_thread::pool *p): thread_pool(p),
-    task_count(0) {
-    start();
+cm_thread::worker_thread::worker_thread(cm_thread::pool *p): thread_pool(p) {
+    // waits for tasks on the pool's conditions
+    set_run_mode(run_mode::blocking);
 }
 
 cm_thread::worker_thread::~worker_thread() { stop(); }
 
-cm_thread::pool::pool(int size): shutdown(false), running_count(0) {
+// absolute CLOCK_REALTIME time for cond::timed_wait
+static timespec realtime_after(uint64_t ns) {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    return ts;
+}
 
-    for(int n = 0; n < size; ++n) {
-        worker_thread *p = new worker_thread(this);
-        threads.push_back(p);
+cm_thread::pool::pool(int size, pool_mode mode_, pool_placement placement_):
+    pool(size, size, mode_, placement_) {
+}
+
+cm_thread::pool::pool(int min_threads_, int max_threads_, pool_mode mode_,
+    pool_placement placement_): mode(mode_), placement(placement_),
+    threads(std::max(max_threads_, 1)), min_threads(std::max(min_threads_, 0)),
+    max_threads(std::max(max_threads_, 1)) {
+
+    if(min_threads > max_threads) min_threads = max_threads;
+
+    grow_mutex.lock();
+    for(int n = 0; n < min_threads; ++n) {
+        spawn_worker();
     }
+    grow_mutex.unlock();
 }
 
 cm_thread::pool::~pool() {
 
     shutdown = true;
+
+    // a spawn in progress finishes first, later ones see shutdown
+    grow_mutex.lock();
+    grow_mutex.unlock();
+
+    // waiters check shutdown under these mutexes, so one broadcast each
+    // reaches every worker that is or is about to be waiting
+    que_mutex.lock();
     que_access.broadcast();
+    que_mutex.unlock();
+
+    park_mutex.lock();
+    park_cond.broadcast();
+    park_mutex.unlock();
+
+    int slots = thread_slots;
+    for(int n = 0; n < slots; n++) {
+        threads[n].load()->join();
+    }
+
+    // release tasks that never ran
+    task *t;
+    for(auto &lane: lanes) {
+        while((t = lane.pop_front()) != nullptr) {
+            task::finish(t, false);
+        }
+    }
+
+    for(int n = 0; n < slots; n++) {
+        worker_thread *p = threads[n];
+        while((t = p->local.take()) != nullptr) {
+            task::finish(t, false);
+        }
+        delete p;
+        threads[n] = nullptr;
+    }
+}
+
+// under grow_mutex: restart a retired worker that has finished, or fill
+// the next slot
+bool cm_thread::pool::spawn_worker() {
+
+    if(shutdown || live_count >= max_threads) return false;
+
+    worker_thread *p = nullptr;
+    int slots = thread_slots;
+    for(int n = 0; n < slots; n++) {
+        worker_thread *q = threads[n];
+        if(q->retired && q->is_done()) {
+            p = q;
+            break;
+        }
+    }
+
+    if(!p) {
+        if(slots == max_threads) return false;
+        p = new worker_thread(this);
+        p->slot = slots;
+        place_worker(p);
+        threads[slots].store(p, std::memory_order_release);
+        thread_slots.store(slots + 1, std::memory_order_release);
+    }
+
+    p->retired = false;
+    live_count++;
+    p->start();
+    return true;
+}
+
+void cm_thread::pool::place_worker(worker_thread *p) {
+
+    if(placement == pool_placement::none) return;
+
+    const cpu_topology &topology = cpu_topology::get();
+    int nodes = topology.node_count();
+
+    if(placement == pool_placement::per_node) {
+        p->node = p->slot % nodes;
+        p->set_node(p->node);
+        return;
+    }
+
+    int cpu;
+    if(placement == pool_placement::spread) {
+        const std::vector<int> &cpus = topology.nodes[p->slot % nodes];
+        cpu = cpus[(p->slot / nodes) % cpus.size()];
+    }
+    else {
+        int n = p->slot % topology.cpu_count();
+        size_t node = 0;
+        while(n >= (int) topology.nodes[node].size()) {
+            n -= (int) topology.nodes[node].size();
+            node++;
+        }
+        cpu = topology.nodes[node][n];
+    }
+
+    p->node = topology.node_of(cpu);
+    p->numa_node = p->node;
+    p->set_affinity(std::vector<int>{ cpu });
+}
+
+// add a worker when work has waited past the grow wait and no worker is
+// idle, at most one per grow wait period; always when none is running
+void cm_thread::pool::maybe_grow(uint64_t waited_ns) {
+
+    if(live_count >= max_threads || shutdown) return;
 
-    for(auto p: threads) {
-        while(!p->is_done()) {
-            que_access.broadcast();
+    uint64_t now = monotonic_ns();
+    uint64_t last = last_grow;
+    if(live_count > 0) {
+        if(sleepers > 0 || waited_ns < grow_wait_ns) return;
+        if(now - last < grow_wait_ns) return;
+    }
+    if(!last_grow.compare_exchange_strong(last, now)) return;
+
+    grow_mutex.lock();
+    spawn_worker();
+    grow_mutex.unlock();
+}
+
+// an idle worker leaves while more than min_threads are running
+bool cm_thread::pool::try_retire(worker_thread *self) {
+
+    int n = live_count;
+    while(n > min_threads) {
+        if(live_count.compare_exchange_weak(n, n - 1)) {
+            self->retired = true;
+            return true;
         }
     }
+    return false;
+}
+
+// under que_mutex: how long the oldest queued task has waited
+uint64_t cm_thread::pool::oldest_wait(uint64_t now) {
 
-    for(auto it = threads.begin(); it != threads.end();) {
-        delete (*it);
-        it = threads.erase(it);
+    uint64_t oldest = now;
+    for(auto &lane: lanes) {
+        if(lane.head && lane.head->enqueued < oldest) oldest = lane.head->enqueued;
     }
+    return now - oldest;
 }
 
 void cm_thread::pool::add_task(cm_task_function(fn), void *arg, cm_task_dealloc(dealloc)) {
+    push_task(task::create(fn, arg, dealloc));
+}
+
+void cm_thread::pool::add_task(task_priority prio, cm_task_function(fn), void *arg,
+    cm_task_dealloc(dealloc)) {
+    push_task(task::create(fn, arg, dealloc), prio);
+}
 
-    task work_task(fn, arg, dealloc);
+void cm_thread::pool::push_task(task *t, task_priority prio) {
 
-    que_mutex.lock();
-    work_queue.push_back(work_task);
-    que_mutex.unlock();
+    uint64_t now = monotonic_ns();
+    uint64_t waited = 0;
+
+    t->lane = (uint8_t) prio;
+    t->enqueued = now;
+
+    pending++;
+
+    // counted before it is visible so wait_all never misses it
+    queued++;
+
+    if(mode == pool_mode::work_stealing) {
+        worker_thread *self = current_worker;
+        if(self && self->thread_pool == this && prio == task_priority::normal) {
+            self->local.push(t);
+        }
+        else {
+            que_mutex.lock();
+            lanes[t->lane].push_back(t);
+            if(elastic()) waited = oldest_wait(now);
+            que_mutex.unlock();
+        }
+        wake_one();
+    }
+    else {
+        que_mutex.lock();
+        lanes[t->lane].push_back(t);
+        if(elastic()) waited = oldest_wait(now);
+        que_mutex.unlock();
 
-    que_access.signal();
+        que_access.signal();
+    }
+
+    if(elastic()) maybe_grow(waited);
 }
 
-bool cm_thread::pool::next_task(task &work_task) {
+bool cm_thread::pool::lanes_empty() {
+    for(auto &lane: lanes) {
+        if(!lane.empty()) return false;
+    }
+    return true;
+}
 
-    if(shutdown) return false;
+// under que_mutex: the lane head that has the best rank, where waiting
+// one aging period is worth one lane; ties go to the higher lane
+cm_thread::task *cm_thread::pool::pop_lane() {
+
+    uint64_t now = monotonic_ns();
+    int64_t aging = (int64_t) aging_ns.load(std::memory_order_relaxed);
+
+    int best = -1;
+    int64_t best_rank = 0;
+    for(int n = 0; n < POOL_LANES; n++) {
+        task *head = lanes[n].head;
+        if(!head) continue;
+        int64_t rank = n * aging - (int64_t) (now - head->enqueued);
+        if(best < 0 || rank < best_rank) {
+            best = n;
+            best_rank = rank;
+        }
+    }
+
+    return best < 0 ? nullptr : lanes[best].pop_front();
+}
+
+cm_thread::task *cm_thread::pool::next_task(worker_thread *self) {
+
+    if(shutdown) return nullptr;
 
     que_mutex.lock();
-    while(work_queue.empty()) {
+    while(lanes_empty()) {
         if(shutdown) {
             que_mutex.unlock();
-            que_access.broadcast();
-            return false;
+            return nullptr;
+        }
+
+        if(self) record_idle(self);
+        sleepers++;
+        if(self && elastic()) {
+            timespec ts = realtime_after(idle_ns);
+            int rc = que_access.timed_wait(que_mutex, ts);
+            sleepers--;
+            if(rc == ETIMEDOUT && lanes_empty() && try_retire(self)) {
+                que_mutex.unlock();
+                return nullptr;
+            }
+        }
+        else {
+            que_access.wait(que_mutex);
+            sleepers--;
         }
-        que_access.wait(que_mutex);
     }
 
-    work_task = work_queue.pop_front();
+    // push_task signals once per task, so no need to pass the signal on
+    task *t = pop_lane();
+    queued--;
 
     que_mutex.unlock();
-    que_access.signal();
 
-    return true;
+    return t;
+}
+
+// work_stealing mode: the injection queue
+cm_thread::task *cm_thread::pool::pop_task() {
+
+    if(lanes_empty()) return nullptr;
+
+    que_mutex.lock();
+    task *t = pop_lane();
+    que_mutex.unlock();
+    return t;
+}
+
+// the previous task's run ends where this one starts, unless the worker
+// has been idle since
+void cm_thread::pool::record_start(task *t, worker_thread *self) {
+    uint64_t now = monotonic_ns();
+    uint64_t waited = now - t->enqueued;
+    if(stats_on.load(std::memory_order_relaxed)) {
+        worker_stats &w = self->stats;
+        w.lane_wait[t->lane].record(waited);
+        if(self->run_start) {
+            w.run.record(now - self->run_start);
+        }
+        else if(self->idle_start) {
+            counter_add(w.idle_ns, now - self->idle_start);
+        }
+        self->run_start = now;
+    }
+    else {
+        self->run_start = self->idle_start = 0;
+    }
+    if(elastic()) maybe_grow(waited);
+}
+
+// timed now only when nothing is queued (the worker is about to look for
+// work, maybe park), else at the next start; run_start is 0 when stats
+// are off
+void cm_thread::pool::record_end(worker_thread *self) {
+    counter_add(self->stats.tasks, 1);
+    if(self->run_start && queued.load(std::memory_order_relaxed) <= 0) {
+        record_idle(self);
+    }
+}
+
+// closes the running task's time before the worker waits for work
+void cm_thread::pool::record_idle(worker_thread *self) {
+    if(self->run_start) {
+        uint64_t now = monotonic_ns();
+        self->stats.run.record(now - self->run_start);
+        self->run_start = 0;
+        self->idle_start = now;
+    }
+}
+
+// high lane, own deque (newest first), then the injection queue, then
+// steal the oldest task of another worker starting from a random victim
+cm_thread::task *cm_thread::pool::find_task(worker_thread *self) {
+
+    task *t;
+    if(!lanes[(int) task_priority::high].empty()) {
+        t = pop_task();
+        if(t) return t;
+    }
+
+    t = self->local.take();
+    if(t) return t;
+
+    t = pop_task();
+    if(t) return t;
+
+    // placed workers: own node first, then the rest
+    size_t n = (size_t) thread_slots.load(std::memory_order_acquire);
+    size_t start = (size_t) cm_util::tid() + self->count();
+    int passes = self->node >= 0 ? 2 : 1;
+    for(int pass = 0; pass < passes; pass++) {
+        for(size_t i = 0; i < n; i++) {
+            worker_thread *victim = threads[(start + i) % n].load(std::memory_order_acquire);
+            if(victim == self) continue;
+            if(passes == 2 && (victim->node == self->node) != (pass == 0)) continue;
+            t = victim->local.steal();
+            if(t) {
+                counter_add(self->stats.steals, 1);
+                return t;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// sleep until work is queued; false on shutdown or when an elastic
+// pool's worker has been idle long enough to retire
+bool cm_thread::pool::park(worker_thread *self) {
+    bool retire = false;
+    record_idle(self);
+    park_mutex.lock();
+    sleepers++;
+    while(!shutdown && queued == 0) {
+        if(elastic()) {
+            timespec ts = realtime_after(idle_ns);
+            if(park_cond.timed_wait(park_mutex, ts) == ETIMEDOUT &&
+                    queued == 0 && try_retire(self)) {
+                retire = true;
+                break;
+            }
+        }
+        else {
+            park_cond.wait(park_mutex);
+        }
+    }
+    sleepers--;
+    park_mutex.unlock();
+    return !shutdown && !retire;
+}
+
+// only pay for the signal when a worker is actually parked; seq_cst
+// queued/sleepers updates make either the parker see the task or us
+// see the parker
+void cm_thread::pool::wake_one() {
+    if(sleepers > 0) {
+        park_mutex.lock();
+        park_cond.signal();
+        park_mutex.unlock();
+    }
+}
+
+// work_stealing worker loop: runs until shutdown without returning to
+// the basic_thread loop between tasks
+bool cm_thread::pool::run_stealing(worker_thread *self) {
+
+    while(!shutdown) {
+        task *t = find_task(self);
+        if(t == nullptr) {
+            if(!park(self)) break;
+            continue;
+        }
+
+        // running before no longer queued, so wait_all never sees neither
+        task_begin();
+        queued--;
+        record_start(t, self);
+        task::finish(t);
+        record_end(self);
+        task_end();
+        task_done();
+    }
+    return false;
+}
+
+// seq_cst pending/idle_waiters updates: either the waiter sees zero or
+// the last task to finish sees the waiter and wakes it
+void cm_thread::pool::task_done() {
+    if(--pending == 0 && idle_waiters > 0) {
+        idle_mutex.lock();
+        idle_cond.broadcast();
+        idle_mutex.unlock();
+    }
 }
 
 void cm_thread::pool::wait_all() {
 
-    while(!work_queue.empty() || running_tasks() > 0) {
-        timespec delay = {0, 100000000};   // 100 ms
-        nanosleep(&delay, NULL);           
+    idle_mutex.lock();
+    idle_waiters++;
+    while(pending > 0) {
+        idle_cond.wait(idle_mutex);
+    }
+    idle_waiters--;
+    idle_mutex.unlock();
+}
+
+cm_thread::pool_stats cm_thread::pool::stats() {
+    pool_stats merged;
+    int slots = thread_slots;
+    for(int n = 0; n < slots; n++) {
+        merged.merge(threads[n].load()->stats);
+    }
+    return merged;
+}
+
+cm_thread::pool_stats cm_thread::pool::stats(int slot) {
+    pool_stats one;
+    if(slot >= 0 && slot < thread_slots) {
+        one.merge(threads[slot].load()->stats);
+    }
+    return one;
+}
+
+void cm_thread::pool::clear_stats() {
+    int slots = thread_slots;
+    for(int n = 0; n < slots; n++) {
+        worker_thread *p = threads[n];
+        cm_util::counter_store(p->counted, 0);
+        p->stats.clear();
     }
 }
 
 void cm_thread::pool::log_counts() {
 
-    size_t n = threads.size();
-    cm_log::info(cm_util::format("Threads in pool: %lu", n));
+    int slots = thread_slots;
+    cm_log::info(cm_util::format("Threads in pool: %lu", thread_count()));
+    if(elastic()) {
+        cm_log::info(cm_util::format("Threads min: %d max: %d started: %d",
+            min_threads, max_threads, slots));
+    }
 
     size_t total_count = 0;
-    for(auto p: threads) {
-        total_count += p->count();
+    for(int n = 0; n < slots; n++) {
+        total_count += threads[n].load()->count();
     }
 
-    for(auto p: threads) {
+    pool_stats merged;
+    for(int n = 0; n < slots; n++) {
+        worker_thread *p = threads[n];
         size_t count = p->count();
         double percent = ((double) count / (double) total_count) * 100;
+        pool_stats one;
+        one.merge(p->stats);
+        merged.merge(one);
 
-        cm_log::info(cm_util::format("Thread(%5d): %10lu:%7.2lf%%",
-             p->thread_id(), count, percent));
+        std::string line = cm_util::format("Thread(%5d): %10lu:%7.2lf%%",
+            p->thread_id(), count, percent);
+        if(mode == pool_mode::work_stealing) {
+            line += cm_util::format(" steals: %lu", p->steals());
+        }
+        if(stats_on) {
+            line += cm_util::format(" busy: %5.1lf%%", one.utilization() * 100.0);
+        }
+        cm_log::info(line);
 
         p->count_clear();
     }
 
     cm_log::info(cm_util::format("Total tasks completed: %lu", total_count));
+    if(stats_on) {
+        cm_log::info(cm_util::format("Wait ns: %s", merged.wait.to_text().c_str()));
+        cm_log::info(cm_util::format("Run ns: %s", merged.run.to_text().c_str()));
+    }
+
+    const char *names[POOL_LANES] = { "high", "normal", "low" };
+    for(int n = 0; n < POOL_LANES; n++) {
+        cm_util::hdr_histogram &h = merged.lane_wait[n];
+        if(stats_on) {
+            cm_log::info(cm_util::format("Lane %-6s: depth: %lu tasks: %lu wait us p50: %lu p99: %lu max: %lu",
+                names[n], lanes[n].size(), h.count(), h.percentile(50) / 1000, h.percentile(99) / 1000,
+                h.max() / 1000));
+        }
+        else {
+            cm_log::info(cm_util::format("Lane %-6s: depth: %lu", names[n], lanes[n].size()));
+        }
+    }
 }
@@ -34,10 +34,18 @@
 
 
 #include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
 
 #include "util.h"
 #include "mutex.h"
 #include "queue.h"
+#include "ws_deque.h"
+#include "future.h"
+#include "histogram.h"
 #include "log.h"
 
 #define THREAD_PAGE_SIZE 4096
@@ -45,6 +53,60 @@
 
 namespace cm_thread {
 
+// CPUs of each NUMA node (from /sys/devices/system/node), limited to the
+// CPUs this process may run on; one node holding every allowed CPU when
+// the kernel does not report nodes. Read once.
+
+struct cpu_topology {
+
+    std::vector<std::vector<int>> nodes;
+
+    static const cpu_topology &get();
+
+    int node_count() const { return (int) nodes.size(); }
+    int cpu_count() const;
+    int node_of(int cpu) const;    // -1: not an allowed CPU
+};
+
+// An eventfd one thread parks on and other threads wake. A wake() that
+// comes before park() is not lost: park() returns at once. fd() can be
+// watched by epoll so a thread blocked in epoll_wait() can be woken too
+// (clear() it when it is reported readable).
+
+class wake_event {
+
+    int efd = -1;
+
+    // do not implement these constructors
+    wake_event(const wake_event &);
+    const wake_event &operator = (const wake_event &);
+
+public:
+    wake_event();
+    ~wake_event();
+
+    int fd() { return efd; }
+
+    void wake();
+
+    // waits for a wake() or the (relative) timeout, nullptr: no timeout;
+    // false on timeout
+    bool park(const timespec *timeout = nullptr);
+
+    // drops a pending wake()
+    void clear();
+};
+
+// delayed: process() is called again after the thread's delay, or as soon
+// as it is woken.
+// blocking: process() blocks on its own (epoll_wait, a condition) and is
+// called again at once. It should return soon after wake(); an epoll loop
+// can add wakeup.fd() to its set for this.
+
+enum class run_mode { delayed, blocking };
+
+#define THREAD_STOP_GRACE_MILLIS 2000   // stop() waits this long before
+                                        // it cancels the thread
 
 class basic_thread: public cm::mutex {
 
@@ -59,8 +121,20 @@ protected:
     int rc = 0;
 
     timespec delay = {0, 1000000}; 
-    bool started = false;
-    bool done = false;
+    run_mode mode = run_mode::delayed;
+    std::atomic<bool> started{false};
+    std::atomic<bool> done{false};
+    std::atomic<bool> stopping{false};
+
+    wake_event wakeup;
+
+    // start() waits on this for started or done
+    cm::mutex state_mutex;
+    cm::cond state_cond;
+
+    cpu_set_t cpu_mask;
+    bool affinity = false;
+    int numa_node = -1;
 
     static void cleanup_handler(void *);    
     static void *run_handler(void*);
@@ -68,6 +142,12 @@ protected:
     void set_delay(timespec &ts) { delay = ts; }
     timespec get_delay() { return delay; }
 
+    // set before start()
+    void set_run_mode(run_mode m) { mode = m; }
+    run_mode get_run_mode() { return mode; }
+
+    void set_state(std::atomic<bool> &state);
+
     virtual bool setup() { return true; }
     virtual void cleanup() { }
     virtual bool process() {  return true; }
@@ -82,12 +162,34 @@ public:
     bool is_done() { return done; }
     bool is_valid() { return rc == 0; }
 
-    // starts thread if not already started
+    // starts thread if not already started (a thread that has finished
+    // is joined and started again)
     void start();
 
-    // stops running thread
+    // stops running thread: asks it to stop and wakes it, then cancels it
+    // if it has not finished within THREAD_STOP_GRACE_MILLIS
     void stop();
 
+    // sets the stop flag and wakes the thread; the run loop ends once the
+    // current process() returns
+    void request_stop() { stopping = true; wakeup.wake(); }
+    bool stop_requested() { return stopping; }
+
+    // ends a delayed wait early, or wakes an epoll loop watching wakeup.fd()
+    void wake() { wakeup.wake(); }
+
+    // waits for the thread to finish on its own
+    void join();
+
+    // run only on these CPUs: applied at start(), or at once if running;
+    // 0 or -1
+    int set_affinity(const std::vector<int> &cpus);
+
+    // run on the CPUs of a NUMA node and prefer its memory (the memory
+    // policy is set as the thread starts); 0 or -1
+    int set_node(int node);
+    int get_node() { return numa_node; }
+
 };
 
 ////////////////////// thread pool //////////////////////////////
@@ -96,96 +198,381 @@ public:
 #define cm_task_function(fn) void (*fn)(void *)
 #define cm_task_dealloc(fn) void (*fn)(void *)
 
+#define TASK_INLINE_SIZE 48     // callable bytes stored in the task itself
+                                // (keeps a task record in a 128 byte block)
+#define POOL_LANES 3
+#define POOL_GROW_WAIT_USECS 1000       // queue wait that adds a worker
+#define POOL_IDLE_USECS 10000000        // idle time that retires one
+#define POOL_AGING_USECS 10000  // default wait that lifts a task one lane
+
+// high runs before normal before low; see pool::set_aging()
+enum class task_priority { high = 0, normal = 1, low = 2 };
+
+// A task runs function(arg), then dealloc(arg) if both are set. Task
+// records come from the task allocator and are linked straight into the
+// pool's queues, so queueing one allocates nothing. A callable given to
+// pool::execute() is constructed in storage (arg points at it) when it
+// fits, else in its own block from the task allocator.
+
 struct task {
 
+    alignas(TASK_ALLOC_ALIGN) unsigned char storage[TASK_INLINE_SIZE];
+
     cm_task_function(function) = nullptr;
     void *arg = nullptr;
     cm_task_dealloc(dealloc) = nullptr;
+    task *next = nullptr;       // queue link
+    uint64_t enqueued = 0;      // monotonic ns
+    uint8_t lane = (uint8_t) task_priority::normal;
     bool done = false;
-    
+
     task() {}
 
     task(cm_task_function(fn), void *arg_, cm_task_dealloc(dealloc_)):
-        function(fn), arg(arg_), done(false), dealloc(dealloc_) { }
+        function(fn), arg(arg_), dealloc(dealloc_), done(false) { }
 
     ~task() { }
 
+    static task *create(cm_task_function(fn), void *arg_, cm_task_dealloc(dealloc_)) {
+        return new(task_alloc(sizeof(task))) task(fn, arg_, dealloc_);
+    }
 
-    task(const task &r):
-        function(r.function), arg(r.arg), done(r.done), dealloc(r.dealloc) { }
+    template<class F>
+    static task *create(F &&fn) {
+        using fn_t = std::decay_t<F>;
+        task *t = new(task_alloc(sizeof(task))) task();
+        if constexpr(sizeof(fn_t) <= TASK_INLINE_SIZE && alignof(fn_t) <= TASK_ALLOC_ALIGN) {
+            t->arg = new(t->storage) fn_t(std::forward<F>(fn));
+            t->dealloc = [](void *p) { static_cast<fn_t *>(p)->~fn_t(); };
+        }
+        else {
+            static_assert(alignof(fn_t) <= TASK_ALLOC_ALIGN, "callable is over-aligned");
+            t->arg = new(task_alloc(sizeof(fn_t))) fn_t(std::forward<F>(fn));
+            t->dealloc = [](void *p) { static_cast<fn_t *>(p)->~fn_t(); task_free(p); };
+        }
+        t->function = [](void *p) { (*static_cast<fn_t *>(p))(); };
+        return t;
+    }
 
-    task &operator = (const task &r) {
-        function = r.function;
-        arg = r.arg;
-        done = r.done;
-        dealloc = r.dealloc;
-        return *this;
+    // run it (or, with run false, only release what it holds) and free
+    // the record
+    static void finish(task *t, bool run = true) {
+        if(run) {
+            t->function(t->arg);
+            t->done = true;
+        }
+        if(t->arg && t->dealloc) {
+            t->dealloc(t->arg);
+        }
+        t->~task();
+        task_free(t);
     }
 
+private:
+    // do not implement these constructors
+    task(const task &r);
+    task &operator = (const task &r);
+};
+
+// intrusive FIFO of tasks; callers lock
+struct task_queue {
+
+    task *head = nullptr;
+    task *tail = nullptr;
+    std::atomic<size_t> count{0};
+
+    bool empty() { return count.load(std::memory_order_relaxed) == 0; }
+    size_t size() { return count; }
+
+    void push_back(task *t) {
+        t->next = nullptr;
+        if(tail) tail->next = t;
+        else head = t;
+        tail = t;
+        count++;
+    }
+
+    task *pop_front() {
+        task *t = head;
+        if(t) {
+            head = t->next;
+            if(!head) tail = nullptr;
+            count--;
+        }
+        return t;
+    }
+};
+
+// What one worker did: enqueue to start wait of each task by priority
+// lane and run time of each task (ns), time spent running tasks and idle
+// between them (looking for work or parked), tasks run and tasks stolen.
+// Written by the worker only.
+
+struct alignas(64) worker_stats {
+
+    cm_util::hdr_histogram lane_wait[POOL_LANES];  // merged: the wait
+    cm_util::hdr_histogram run;     // its total() is the busy time
+    uint64_t tasks = 0;             // cm_util::counter_*()
+    uint64_t steals = 0;
+    uint64_t idle_ns = 0;
+
+    void clear();
+};
+
+// Worker stats merged (pool::stats()); text or JSON for logs and
+// dashboards.
+
+struct pool_stats {
+
+    int workers = 0;
+    cm_util::hdr_histogram wait;    // all lanes
+    cm_util::hdr_histogram lane_wait[POOL_LANES];
+    cm_util::hdr_histogram run;
+    uint64_t tasks = 0;
+    uint64_t steals = 0;
+    uint64_t busy_ns = 0;
+    uint64_t idle_ns = 0;
+
+    void merge(const worker_stats &w);
+    void merge(const pool_stats &r);
+
+    // busy share of busy + idle time, 0..1
+    double utilization() const;
+
+    std::string to_text() const;
+    std::string to_json() const;
 };
 
 class pool;
 
 class worker_thread: public basic_thread {
 
+    friend class pool;
+
     pool *thread_pool;  
-    task thread_work_task;
-    size_t task_count = 0;
+    worker_stats stats;
+    uint64_t run_start = 0;     // monotonic ns: start of the task not yet
+                                // timed, or 0
+    uint64_t idle_start = 0;    // when it last went idle, or 0
+    uint64_t counted = 0;       // stats.tasks at the last log_counts()
+
+    ws_deque<task *> local;     // work_stealing mode: this worker's tasks
+    std::atomic<bool> retired{false};
+    int slot = 0;
+    int node = -1;              // NUMA node it is placed on
   
+    bool setup();
     bool process();
 
 public:
     worker_thread(pool *p);
     ~worker_thread();
 
-    size_t count() { return task_count; }  
-    void count_clear() { task_count = 0; }  
+    // tasks run since the last count_clear() (log_counts()); that only
+    // moves the mark, the worker's own counters are left alone
+    size_t count() {
+        return cm_util::counter_load(stats.tasks) - cm_util::counter_load(counted);
+    }
+    int get_slot() { return slot; }
+    size_t steals() { return cm_util::counter_load(stats.steals); }
+    void count_clear() { cm_util::counter_store(counted, cm_util::counter_load(stats.tasks)); }
+    const worker_stats &get_stats() { return stats; }
 };
 
 
+// shared: one FIFO queue shared by all workers.
+// work_stealing: each worker runs tasks from its own Chase-Lev deque, tasks
+// added from outside the pool go to an injection queue, tasks added by a
+// running task (subtasks) go to the deque of the worker running it. Idle
+// workers take from the injection queue, then steal from other workers
+// before they park.
+//
+// Both modes queue by priority lane (in work_stealing mode the lanes are
+// the injection queue; subtasks added with a priority other than normal
+// go there too, and a worker looks at the high lane before its deque).
+
+enum class pool_mode { shared, work_stealing };
+
+// Where workers run (by slot, so an elastic pool's restarted worker keeps
+// its place):
+//   none        anywhere the scheduler likes
+//   spread      one CPU each, round robin over the NUMA nodes
+//   compact     one CPU each, filling a node before the next
+//   per_node    round robin over the nodes, free to run on any CPU of
+//               their node; in work_stealing mode a worker steals from
+//               workers on its own node before it tries other nodes
+// Placed workers prefer their node's memory, so what a task allocates
+// stays local.
+
+enum class pool_placement { none, spread, compact, per_node };
+
 class pool {
 
-    std::vector<worker_thread *> threads;
-    cm_queue::double_queue<task> work_queue;
+    friend class worker_thread;
+
+    pool_mode mode;
+    pool_placement placement;
+
+    // Worker slots, filled as the pool grows and never emptied: a retired
+    // worker keeps its slot (and empty deque) and is restarted there when
+    // the pool grows again, so thieves walk the slots without locking.
+    std::vector<std::atomic<worker_thread *>> threads;
+    std::atomic<int> thread_slots{0};
+    std::atomic<int> live_count{0};
+
+    int min_threads;
+    int max_threads;
+    std::atomic<uint64_t> grow_wait_ns{POOL_GROW_WAIT_USECS * 1000ull};
+    std::atomic<uint64_t> idle_ns{POOL_IDLE_USECS * 1000ull};
+    std::atomic<uint64_t> last_grow{0};
+    cm::mutex   grow_mutex;
+
+    bool elastic() { return min_threads < max_threads; }
+    bool spawn_worker();
+    void place_worker(worker_thread *p);
+    void maybe_grow(uint64_t waited_ns);
+    bool try_retire(worker_thread *self);
+    uint64_t oldest_wait(uint64_t now);
+
+    // one FIFO per priority (work_stealing mode: the injection queue)
+    task_queue  lanes[POOL_LANES];
+    std::atomic<uint64_t> aging_ns{POOL_AGING_USECS * 1000ull};
 
     cm::mutex   que_mutex;
     cm::cond    que_access;
-    cm::mutex   count_mutex;
 
-    volatile bool shutdown = false;
-    volatile size_t running_count = 0;
+    std::atomic<bool> shutdown{false};
+    std::atomic<size_t> running_count{0};
+
+    // added but not yet finished (both modes); wait_all sleeps on
+    // idle_cond until it drops to zero
+    std::atomic<size_t> pending{0};
+    std::atomic<int> idle_waiters{0};
+    cm::mutex   idle_mutex;
+    cm::cond    idle_cond;
+
+    void push_task(task *t, task_priority prio = task_priority::normal);
+    task *pop_lane();
+    task *pop_task();
+    std::atomic<bool> stats_on{false};
+
+    void record_start(task *t, worker_thread *self);
+    void record_end(worker_thread *self);
+    void record_idle(worker_thread *self);
+    void task_done();
+    bool lanes_empty();
+
+    std::atomic<int64_t> queued{0};     // added but not yet started
+    std::atomic<int> sleepers{0};       // idle workers
+
+    // work_stealing mode
+    cm::mutex   park_mutex;
+    cm::cond    park_cond;
+
+    task *find_task(worker_thread *self);
+    bool park(worker_thread *self);
+    void wake_one();
+    bool run_stealing(worker_thread *self);
 
 public:
-    pool(int size);
+    pool(int size, pool_mode mode_ = pool_mode::shared,
+        pool_placement placement_ = pool_placement::none);
+
+    // Elastic pool: starts min_threads_ workers and adds one (up to
+    // max_threads_) when a task has waited longer than the grow wait
+    // with no worker idle; a worker idle for the idle timeout retires
+    // while more than min_threads_ are running.
+    pool(int min_threads_, int max_threads_, pool_mode mode_ = pool_mode::shared,
+        pool_placement placement_ = pool_placement::none);
     ~pool();
 
+    void set_grow_wait(uint64_t usecs) { grow_wait_ns = usecs * 1000; }
+    void set_idle_timeout(uint64_t usecs) { idle_ns = usecs * 1000; }
+
     void task_begin() {
-        count_mutex.lock();
         running_count++;
-        count_mutex.unlock();
     }
     
     void task_end() {
-        count_mutex.lock();
-        if(running_count > 0)
-            running_count--;
-        count_mutex.unlock();
+        running_count--;
     }
 
     size_t running_tasks() {
-        count_mutex.lock();
-        size_t count = running_count;
-        count_mutex.unlock();
-        return count;
+        return running_count;
     }
 
-    size_t work_queue_count() { return work_queue.size(); }
-    size_t thread_count() { return threads.size(); }
+    size_t work_queue_count() { return (size_t) queued.load(); }
+    size_t lane_count(task_priority prio) { return lanes[(int) prio].size(); }
+    size_t thread_count() { return (size_t) live_count.load(); }
+    size_t min_thread_count() { return (size_t) min_threads; }
+    size_t max_thread_count() { return (size_t) max_threads; }
+    pool_mode get_mode() { return mode; }
+    pool_placement get_placement() { return placement; }
+
+    // A worker takes the head of the highest non-empty lane, except that
+    // a task gains one lane for every usecs it has waited: a low task
+    // queued 2 * usecs ago runs before a high task queued just now, so
+    // bulk work is delayed but never starved. 0 makes the lanes one FIFO.
+    void set_aging(uint64_t usecs) { aging_ns = usecs * 1000; }
+    uint64_t get_aging() { return aging_ns / 1000; }
 
     void add_task(cm_task_function(fn), void *arg, cm_task_dealloc(dealloc_) = nullptr);
-    bool next_task(task &work_task);
+    void add_task(task_priority prio, cm_task_function(fn), void *arg,
+        cm_task_dealloc(dealloc_) = nullptr);
+
+    // run fn() on the pool, no result; small callables are stored in
+    // the task record itself
+    template<class F>
+    void execute(F &&fn) {
+        push_task(task::create(std::forward<F>(fn)));
+    }
+
+    template<class F>
+    void execute(task_priority prio, F &&fn) {
+        push_task(task::create(std::forward<F>(fn)), prio);
+    }
+
+    // shared mode: block for the next task; nullptr on shutdown (or, for
+    // an elastic pool's worker, when it is to retire)
+    task *next_task(worker_thread *self = nullptr);
+
+    // run fn() on the pool; the future yields its result or rethrows
+    // what it threw. fn may be move-only; it is moved, together with
+    // the result slot, into one block from the task allocator.
+    template<class F, class R = std::invoke_result_t<std::decay_t<F> &>>
+    future<R> submit(F &&fn) {
+        return submit(task_priority::normal, std::forward<F>(fn));
+    }
+
+    template<class F, class R = std::invoke_result_t<std::decay_t<F> &>>
+    future<R> submit(task_priority prio, F &&fn) {
+        using state_t = task_state<R, std::decay_t<F>>;
+        static_assert(alignof(state_t) <= TASK_ALLOC_ALIGN, "callable is over-aligned");
+        state_t *s = new(task_alloc(sizeof(state_t))) state_t(std::forward<F>(fn));
+        add_task(prio, &state_t::run, s, &state_t::abandon);
+        return future<R>(s);
+    }
+
+    // block until every task added so far (and any they add) has
+    // finished; do not call from a task of this pool
     void wait_all();
 
+    // Per worker wait/run histograms and busy/idle time, off by default
+    // (they cost a few percent of a null task).
+    // A task's start is read from the clock anyway (for its wait); its
+    // run time is taken to last until the worker's next clock read: the
+    // start of its next task or, once the queues are empty, its end. So
+    // back to back tasks take no extra clock read, and their run times
+    // include the hand over to the next one. Task and steal counts are
+    // kept when stats are off.
+    void set_stats(bool on) { stats_on = on; }
+    bool stats_enabled() { return stats_on; }
+
+    // all workers' stats merged, or one worker's (by slot)
+    pool_stats stats();
+    pool_stats stats(int slot);
+    void clear_stats();
+
     void log_counts();
     
 };
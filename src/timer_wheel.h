@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include <utility>
+
+#define TIMER_WHEEL_BITS    8
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS  4
+
+namespace cm_time {
+
+// Hierarchical timer wheel (Varghese & Lauck). Time is measured in
+// caller-defined ticks. Level 0 has one slot per tick; each higher level
+// has slots 256 times wider, so four levels cover 2^32 ticks (over 13
+// years at 100 ms ticks). A timer is filed in the level matching its
+// distance from the current tick and is cascaded down a level each time
+// the lower wheel wraps, so schedule and expiry are O(1) amortized per
+// timer no matter how many are pending. Timers cannot be cancelled: the
+// owner checks whether an expired key is still current when it fires.
+// Not thread safe, the owner provides locking.
+
+template<class keyT>
+class timer_wheel {
+
+protected:
+    struct timer {
+        keyT key;
+        uint64_t expires;
+    };
+
+    std::vector<timer> wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t current = 0;   // last processed tick
+    size_t count = 0;
+
+    void insert(timer &&t) {
+        // already due: fire on the next tick
+        uint64_t expires = t.expires > current ? t.expires : current + 1;
+        uint64_t delta = expires - current;
+
+        int level = 0;
+        while(level < TIMER_WHEEL_LEVELS - 1 &&
+              delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+            level++;
+        }
+
+        // beyond the top level: park in the furthest slot, re-filed on cascade
+        uint64_t range = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+        if(delta >= range) {
+            expires = current + range - 1;
+        }
+
+        size_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        wheel[level][slot].push_back(std::move(t));
+    }
+
+    // re-file the timers of a higher level slot into the levels below
+    void cascade(int level, size_t slot) {
+        std::vector<timer> timers;
+        timers.swap(wheel[level][slot]);
+        for(auto &t: timers) {
+            insert(std::move(t));
+        }
+    }
+
+    template<class fnT>
+    size_t tick(fnT fn) {
+        current++;
+
+        // cascade from the highest wrapped level down so timers can drop
+        // through several levels in one tick
+        int top = 0;
+        while(top < TIMER_WHEEL_LEVELS - 1 &&
+              ((current >> (TIMER_WHEEL_BITS * top)) & TIMER_WHEEL_MASK) == 0) {
+            top++;
+        }
+        for(int level = top; level > 0; level--) {
+            cascade(level, (current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        std::vector<timer> timers;
+        timers.swap(wheel[0][current & TIMER_WHEEL_MASK]);
+
+        size_t fired = 0;
+        for(auto &t: timers) {
+            if(t.expires <= current) {
+                count--;
+                fired++;
+                fn(t.key, t.expires);
+            }
+            else {
+                insert(std::move(t));
+            }
+        }
+        return fired;
+    }
+
+public:
+    timer_wheel(uint64_t now = 0): current(now) { }
+
+    uint64_t now() const { return current; }
+    size_t size() const { return count; }
+
+    void schedule(const keyT &key, uint64_t expires) {
+        insert(timer{key, expires});
+        count++;
+    }
+
+    // advance to tick now calling fn(key, expires) for each expired timer,
+    // returns the number of timers fired
+    template<class fnT>
+    size_t advance(uint64_t now, fnT fn) {
+        if(count == 0) {
+            if(now > current) current = now;
+            return 0;
+        }
+        size_t fired = 0;
+        while(current < now) {
+            fired += tick(fn);
+        }
+        return fired;
+    }
+
+    void clear() {
+        for(auto &level: wheel) {
+            for(auto &slot: level) {
+                slot.clear();
+            }
+        }
+        count = 0;
+    }
+};
+
+} // namespace cm_time
+
+#endif  // __TIMER_WHEEL_H
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2019, Tom Oleson <tom dot oleson at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * The names of its contributors may NOT be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TTL_STORE_H
+#define __TTL_STORE_H
+
+#include <string>
+#include <time.h>
+
+#include "timer_wheel.h"
+#include "thread.h"
+#include "store.h"
+
+// expiry resolution
+#define TTL_TICK_MILLIS 100
+
+namespace cm_store {
+
+// Store with per-key time to live. Provides the info_store interface plus
+// set(name, value, ttl) where ttl is in seconds (0 = never expires).
+//
+// Expired entries are invisible to readers as soon as their deadline
+// passes and are removed by a background expiry thread that advances a
+// hierarchical timer wheel every TTL_TICK_MILLIS, so expiry costs O(1)
+// amortized per key instead of a scan of the store. Deadlines are taken
+// from CLOCK_MONOTONIC_COARSE, a vDSO read, so neither set nor find make
+// a clock system call. Re-setting or removing a key leaves its old timer
+// in the wheel; it is ignored when it fires because the deadline no
+// longer matches.
+// size() may include expired entries the thread has not removed yet.
+
+template<class keyT, class valueT, class lockT = cm::mutex,
+         template<class,class> class mapT = hash_map>
+class ttl_store: protected lockT {
+
+protected:
+    struct entry {
+        valueT value;
+        uint64_t expires = 0;   // tick, 0 = never
+    };
+
+    typedef mapT<keyT,entry> map_type;
+
+    map_type _map;
+    cm_time::timer_wheel<keyT> _wheel;
+
+    void read_lock() { cm::read_lock(*this); }
+
+    using lockT::lock;
+    using lockT::unlock;
+
+    static bool live(const entry &e, uint64_t now) {
+        return e.expires == 0 || e.expires > now;
+    }
+
+    template<class K>
+    typename map_type::const_iterator _find(const K &name) const {
+#ifdef __cpp_lib_generic_unordered_lookup
+        return _map.find(name);
+#else
+        return _map.find(keyT(name));
+#endif
+    }
+
+    class expiry_thread: public cm_thread::basic_thread {
+        ttl_store *store;
+        bool process() { store->expire(); return true; }
+    public:
+        expiry_thread(ttl_store *s): store(s) {
+            timespec ts = {0, TTL_TICK_MILLIS * 1000000L};
+            set_delay(ts);
+            start();
+        }
+        ~expiry_thread() { stop(); }
+    };
+
+    // declared last: stopped before the map and wheel are destroyed
+    expiry_thread _expiry;
+
+public:
+    ttl_store(): _wheel(now_tick()), _expiry(this) { }
+
+    // current coarse monotonic tick: a step of the wall clock neither
+    // expires fresh keys nor keeps old ones
+    static uint64_t now_tick() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TTL_TICK_MILLIS;
+    }
+
+    template<class K>
+    bool check(const K &name) {
+        uint64_t now = now_tick();
+        read_lock();
+        auto p = _find(name);
+        bool b = p != _map.end() && live(p->second, now);
+        unlock();
+        return b;
+    }
+
+    bool set(const keyT &name, const valueT &value) {
+        return set(name, value, 0);
+    }
+
+    bool set(const keyT &name, const valueT &value, time_t ttl) {
+        uint64_t expires = 0;
+        if(ttl > 0) {
+            expires = now_tick() + ((uint64_t) ttl * 1000) / TTL_TICK_MILLIS;
+        }
+        lock();
+        entry &e = _map[name];
+        e.value = value;
+        e.expires = expires;
+        if(expires != 0) {
+            _wheel.schedule(name, expires);
+        }
+        unlock();
+        return true;
+    }
+
+    template<class K>
+    valueT find(const K &name) {
+        valueT value;
+        uint64_t now = now_tick();
+        read_lock();
+        auto p = _find(name);
+        if(p != _map.end() && live(p->second, now)) {
+            value = p->second.value;
+        }
+        unlock();
+        return value;
+    }
+
+    template<class K>
+    valueT get(const K &name, const valueT &_default) {
+        valueT value = _default;
+        uint64_t now = now_tick();
+        read_lock();
+        auto p = _find(name);
+        if(p != _map.end() && live(p->second, now)) {
+            value = p->second.value;
+        }
+        unlock();
+        return value;
+    }
+
+    template<class K, class fnT>
+    bool visit(const K &name, fnT fn) {
+        uint64_t now = now_tick();
+        read_lock();
+        auto p = _find(name);
+        bool found = p != _map.end() && live(p->second, now);
+        if(found) {
+            fn(p->second.value);
+        }
+        unlock();
+        return found;
+    }
+
+    // remaining time to live in seconds: 0 = no ttl, -1 = not found
+    template<class K>
+    time_t ttl(const K &name) {
+        time_t remaining = -1;
+        uint64_t now = now_tick();
+        read_lock();
+        auto p = _find(name);
+        if(p != _map.end() && live(p->second, now)) {
+            remaining = 0;
+            if(p->second.expires != 0) {
+                remaining = (time_t) (((p->second.expires - now) * TTL_TICK_MILLIS + 999) / 1000);
+            }
+        }
+        unlock();
+        return remaining;
+    }
+
+    size_t remove(const keyT &name) {
+        lock();
+        size_t num_erased = _map.erase(name);
+        unlock();
+        return num_erased;
+    }
+
+    size_t size() {
+        read_lock();
+        size_t size = _map.size();
+        unlock();
+        return size;
+    }
+
+    void swap(ttl_store<keyT,valueT,lockT,mapT> &store) {
+        lock();
+        _map.swap(store._map);
+        std::swap(_wheel, store._wheel);
+        unlock();
+    }
+
+    void clear() {
+        lock();
+        _map.clear();
+        _wheel.clear();
+        unlock();
+    }
+
+    // remove entries whose deadline has passed, returns number removed
+    // (called by the expiry thread)
+    size_t expire() {
+        uint64_t now = now_tick();
+        size_t removed = 0;
+        lock();
+        _wheel.advance(now, [this, &removed](const keyT &key, uint64_t expires) {
+            auto p = _map.find(key);
+            if(p != _map.end() && p->second.expires == expires) {
+                _map.erase(key);
+                removed++;
+            }
+        });
+        unlock();
+        return removed;
+    }
+
+    // timers pending in the wheel (including superseded ones)
+    size_t timer_count() {
+        lock();
+        size_t count = _wheel.size();
+        unlock();
+        return count;
+    }
+};
+
+} // namespace cm_store
+
+#endif  // __TTL_STORE_H
@@ -15,10 +15,28 @@ CPPUNIT_TEST_SUITE_REGISTRATION( cacheTest );
 
 class unit_processor: public cm_cache::scanner_processor {
 
+    // entries added with a time to live
+    cm_store::ttl_store<std::string,std::string> timed;
+
 public:
+    bool do_add_ttl(const std::string &name, const std::string &value, time_t ttl,
+        cm_cache::cache_event &event) {
+        cm_log::info(cm_util::format("add: %s ~%ld %s", name.c_str(), (long) ttl, value.c_str()));
+
+        cm_store::mem_store.remove(name);
+        timed.set(name, value, ttl);
+        event.name.assign(name);
+        event.value.assign(value);
+        event.result.assign("OK");
+        return do_result(event);
+    }
+
+    time_t ttl(const std::string &name) { return timed.ttl(name); }
+
     bool do_add(const std::string &name, const std::string &value, cm_cache::cache_event &event) {
         cm_log::info(cm_util::format("add: %s %s", name.c_str(), value.c_str()));
 
+        timed.remove(name);
         cm_store::mem_store.set(name, value);
         event.name.assign(name);
         event.value.assign(value);
@@ -40,6 +58,18 @@ public:
         return do_result(event);
     }
 
+    bool do_read_view(std::string_view name, cm_cache::cache_event &event) {
+
+        event.value.clear();
+        auto copy = [&event](const std::string &value) { event.value.assign(value); };
+        if(!timed.visit(name, copy)) {
+            cm_store::mem_store.visit(name, copy);
+        }
+        event.name.assign(name);
+        event.result.assign(event.value.size() > 0 ? event.value : "NF");
+        return do_result(event);
+    }
+
     bool do_read_remove(const std::string &name, cm_cache::cache_event &event) {
         cm_log::info(cm_util::format("read_remove: %s", name.c_str()));
 
@@ -139,6 +169,9 @@ void cacheTest::test_cache() {
 
     cache.eval("+age 56", event);
     cache.eval("$age", event);
+    CPPUNIT_ASSERT( event.name == "age" && event.result == "56" );
+    cache.eval("$missing", event);
+    CPPUNIT_ASSERT( event.result == "NF" );
 
     cache.eval("+bin 'x:deadbeef'", event);
     cache.eval("$bin", event);
@@ -149,6 +182,46 @@ void cacheTest::test_cache() {
 
     cache.eval("-bin", event);
 
+    // add with time to live: kept by the processor's ttl_store
+    cache.eval("+session ~300 'token'", event);
+    CPPUNIT_ASSERT( event.ttl == 300 );
+    CPPUNIT_ASSERT( processor.ttl("session") > 0 && processor.ttl("session") <= 300 );
+    CPPUNIT_ASSERT( cm_store::mem_store.check("session") == false );
+
+    cache.eval("+session 'token'", event);
+    CPPUNIT_ASSERT( event.ttl == 0 );
+    CPPUNIT_ASSERT( processor.ttl("session") == -1 );
+    CPPUNIT_ASSERT( cm_store::mem_store.find("session") == "'token'" );
+
+    // and expires
+    cache.eval("+brief ~1 'gone'", event);
+    cache.eval("$brief", event);
+    CPPUNIT_ASSERT( event.result == "'gone'" );
+    for(int n = 0; n < 300 && event.result != "NF"; n++) {
+        timespec delay = {0, 10000000};   // 10 ms
+        nanosleep(&delay, NULL);
+        cache.eval("$brief", event);
+    }
+    CPPUNIT_ASSERT( event.result == "NF" );
+
+    // '~' not followed by digits and whitespace is still a raw value
+    cache.eval("+home ~/tom", event);
+    CPPUNIT_ASSERT( event.ttl == 0 );
+    CPPUNIT_ASSERT( cm_store::mem_store.find("home") == "~/tom" );
+
+    cache.eval("+temp ~25", event);
+    CPPUNIT_ASSERT( event.ttl == 0 );
+    CPPUNIT_ASSERT( cm_store::mem_store.find("temp") == "~25" );
+
+    cache.eval("+span ~5m", event);
+    CPPUNIT_ASSERT( event.ttl == 0 );
+    CPPUNIT_ASSERT( cm_store::mem_store.find("span") == "~5m" );
+
+    // a time to live needs a value after it
+    CPPUNIT_ASSERT( cache.eval("+empty ~30 ", event) == false );
+    CPPUNIT_ASSERT( processor.ttl("empty") == -1 );
+    CPPUNIT_ASSERT( cm_store::mem_store.check("empty") == false );
+
     cache.eval("+object {name = 'Tom', id = 369}", event);
     cache.eval("$object", event);
 
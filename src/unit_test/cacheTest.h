@@ -6,6 +6,7 @@
 
 #include <string.h>
 #include "cache.h"
+#include "ttl_store.h"
 #include "log.h" 
 #include "base64.h"
 
@@ -0,0 +1,122 @@
+
+#include <cppunit/config/SourcePrefix.h>
+
+#include <iostream>	// for cout
+#include <string>
+#include <unordered_map>
+
+#include "flat_mapTest.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION( flat_mapTest );
+
+//void flat_mapTest::setUp() { }
+//void flat_mapTest::tearDown() { }
+
+void flat_mapTest::test_flat_map() {
+
+    cm_store::flat_map<std::string,std::string> map;
+    CPPUNIT_ASSERT( map.size() == 0 );
+    CPPUNIT_ASSERT( map.begin() == map.end() );
+    CPPUNIT_ASSERT( map.find("missing") == map.end() );
+
+    // grow through several rehashes
+    for(int n = 0; n < 10000; n++) {
+        map[cm_util::format("key%d", n)] = cm_util::format("value%d", n);
+    }
+    CPPUNIT_ASSERT( map.size() == 10000 );
+    CPPUNIT_ASSERT( map.bucket_count() >= 10000 );
+
+    for(int n = 0; n < 10000; n++) {
+        auto p = map.find(cm_util::format("key%d", n));
+        CPPUNIT_ASSERT( p != map.end() );
+        CPPUNIT_ASSERT( p->second == cm_util::format("value%d", n) );
+    }
+    CPPUNIT_ASSERT( map.find("key10000") == map.end() );
+
+    // update in place
+    map["key42"] = "updated";
+    CPPUNIT_ASSERT( map.size() == 10000 );
+    CPPUNIT_ASSERT( map.find("key42")->second == "updated" );
+
+    // iteration visits every entry once
+    size_t count = 0;
+    for(auto &entry: map) {
+        CPPUNIT_ASSERT( entry.first.compare(0, 3, "key") == 0 );
+        count++;
+    }
+    CPPUNIT_ASSERT( count == 10000 );
+
+    cm_store::flat_map<std::string,std::string> other;
+    map.swap(other);
+    CPPUNIT_ASSERT( map.size() == 0 );
+    CPPUNIT_ASSERT( other.size() == 10000 );
+
+    size_t capacity = other.bucket_count();
+    other.clear();
+    CPPUNIT_ASSERT( other.size() == 0 );
+    CPPUNIT_ASSERT( other.bucket_count() == capacity );
+    CPPUNIT_ASSERT( other.find("key1") == other.end() );
+}
+
+void flat_mapTest::test_flat_map_erase() {
+
+    // compare against std::unordered_map through random inserts/erases
+    cm_store::flat_map<int,int> map;
+    std::unordered_map<int,int> ref;
+
+    unsigned int seed = 42;
+    for(int n = 0; n < 200000; n++) {
+        int key = rand_r(&seed) % 5000;
+        if(rand_r(&seed) % 3 == 0) {
+            CPPUNIT_ASSERT( map.erase(key) == ref.erase(key) );
+        }
+        else {
+            map[key] = n;
+            ref[key] = n;
+        }
+    }
+
+    CPPUNIT_ASSERT( map.size() == ref.size() );
+    for(auto &entry: ref) {
+        auto p = map.find(entry.first);
+        CPPUNIT_ASSERT( p != map.end() );
+        CPPUNIT_ASSERT( p->second == entry.second );
+    }
+    for(int key = 0; key < 5000; key++) {
+        CPPUNIT_ASSERT( map.count(key) == ref.count(key) );
+    }
+
+    // erase everything
+    for(int key = 0; key < 5000; key++) {
+        map.erase(key);
+    }
+    CPPUNIT_ASSERT( map.size() == 0 );
+    CPPUNIT_ASSERT( map.begin() == map.end() );
+}
+
+void flat_mapTest::test_flat_store() {
+
+    cm_store::info_store<std::string,std::string,cm::mutex,
+        cm_store::open_map<std::string,std::string>> store;
+
+    store.set("host", cm_util::get_hostname());
+    CPPUNIT_ASSERT( store.find("host") == cm_util::get_hostname() );
+    CPPUNIT_ASSERT( store.check("host") == true );
+    CPPUNIT_ASSERT( store.get("some_option", "none") == "none" );
+
+    // string_view lookup goes through the transparent hash
+    std::string_view key("host");
+    CPPUNIT_ASSERT( store.check(key) == true );
+    CPPUNIT_ASSERT( store.visit(key, [](const std::string &value) {}) );
+
+    CPPUNIT_ASSERT( store.remove("host") == 1 );
+    CPPUNIT_ASSERT( store.size() == 0 );
+
+    cm_store::sharded_store<std::string,std::string,4,cm::rwlock,
+        cm_store::open_map<std::string,std::string>> sharded;
+    for(int n = 0; n < 1000; n++) {
+        sharded.set(cm_util::format("key%d", n), "value");
+    }
+    CPPUNIT_ASSERT( sharded.size() == 1000 );
+    CPPUNIT_ASSERT( sharded.find("key999") == "value" );
+}
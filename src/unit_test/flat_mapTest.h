@@ -0,0 +1,34 @@
+
+#ifndef CPP_UNIT_FLAT_MAP_TEST_H
+#define CPP_UNIT_FLAT_MAP_TEST_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <string.h>
+#include "flat_map.h"
+#include "store.h"
+#include "log.h"
+
+
+using namespace std;
+
+class flat_mapTest : public CPPUNIT_NS::TestFixture {
+
+  CPPUNIT_TEST_SUITE( flat_mapTest );
+    CPPUNIT_TEST( test_flat_map );
+    CPPUNIT_TEST( test_flat_map_erase );
+    CPPUNIT_TEST( test_flat_store );
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  //void setUp();
+  //void tearDown();
+
+protected:
+    void test_flat_map();
+    void test_flat_map_erase();
+    void test_flat_store();
+};
+
+
+#endif
@@ -0,0 +1,298 @@
+
+#include <cppunit/config/SourcePrefix.h>
+
+#include <iostream>	// for cout
+#include <string>
+#include <vector>
+#include <atomic>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <functional>
+#include <sys/stat.h>
+
+#include "journalTest.h"
+#include "util.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION( journalTest );
+
+//void journalTest::setUp() { }
+//void journalTest::tearDown() { }
+
+static void remove_files(const std::string &base) {
+    unlink((base + ".log").c_str());
+    unlink((base + ".log.old").c_str());
+    unlink((base + ".snap").c_str());
+}
+
+static void *journal_writer(void *arg) {
+    static std::atomic<int> next_id{1};
+    cm_store::journal *j = (cm_store::journal *) arg;
+    int id = next_id++;
+    for(int n = 0; n < 100; n++) {
+        j->commit(j->add(cm_util::format("t%d:%d", id, n), "x"));
+    }
+    return NULL;
+}
+
+void journalTest::test_journal_recover() {
+
+    std::string base = "journal_recover";
+    remove_files(base);
+
+    {
+        cm_store::journal j;
+        CPPUNIT_ASSERT( j.open(base) == 0 );
+
+        j.add("host", "localhost");
+        j.add("port", "56000");
+        j.add("temp", "value");
+        j.remove("temp");
+        uint64_t seq = j.add("port", "56001");
+        CPPUNIT_ASSERT( seq == 5 );
+        CPPUNIT_ASSERT( j.commit(seq) == 0 );
+        CPPUNIT_ASSERT( j.commit(seq) == 0 );   // already durable
+        CPPUNIT_ASSERT( j.sync_count() == 1 );
+    }
+
+    cm_store::journal j;
+    CPPUNIT_ASSERT( j.open(base) == 0 );
+
+    cm_store::info_store<std::string,std::string> store;
+    CPPUNIT_ASSERT( j.recover(store) == 5 );
+    CPPUNIT_ASSERT( store.size() == 2 );
+    CPPUNIT_ASSERT( store.find("host") == "localhost" );
+    CPPUNIT_ASSERT( store.find("port") == "56001" );
+    CPPUNIT_ASSERT( store.check("temp") == false );
+
+    // concurrent committers share fsyncs
+    uint64_t before = j.sync_count();
+    pthread_t tids[4];
+    for(int n = 0; n < 4; n++) {
+        pthread_create(&tids[n], NULL, journal_writer, &j);
+    }
+    for(int n = 0; n < 4; n++) {
+        pthread_join(tids[n], NULL);
+    }
+    CPPUNIT_ASSERT( j.sync_count() - before <= 400 );
+
+    cm_store::info_store<std::string,std::string> store2;
+    j.close();
+    CPPUNIT_ASSERT( j.open(base) == 0 );
+    CPPUNIT_ASSERT( j.recover(store2) == 405 );
+    CPPUNIT_ASSERT( store2.size() == 402 );
+    CPPUNIT_ASSERT( store2.find("t4:99") == "x" );
+
+    remove_files(base);
+}
+
+void journalTest::test_journal_checkpoint() {
+
+    std::string base = "journal_checkpoint";
+    remove_files(base);
+    cm_store::journal j;
+    CPPUNIT_ASSERT( j.open(base) == 0 );
+
+    cm_store::info_store<std::string,std::string> store;
+    for(int n = 0; n < 1000; n++) {
+        std::string key = cm_util::format("key%d", n % 100);
+        store.set(key, cm_util::format("%d", n));
+        j.add(key, store.find(key));
+    }
+    CPPUNIT_ASSERT( j.sync() == 0 );
+
+    // snapshot holds 100 entries, the log starts over
+    CPPUNIT_ASSERT( j.checkpoint(store) == 0 );
+    CPPUNIT_ASSERT( access(j.old_path().c_str(), F_OK) != 0 );
+    CPPUNIT_ASSERT( access(j.snap_path().c_str(), F_OK) == 0 );
+
+    store.remove("key0");
+    j.remove("key0");
+    store.set("key1", "tail");
+    j.add("key1", "tail");
+    CPPUNIT_ASSERT( j.sync() == 0 );
+    j.close();
+
+    cm_store::journal r;
+    CPPUNIT_ASSERT( r.open(base) == 0 );
+    cm_store::info_store<std::string,std::string> recovered;
+    CPPUNIT_ASSERT( r.recover(recovered) == 102 );
+    CPPUNIT_ASSERT( recovered.size() == 99 );
+    CPPUNIT_ASSERT( recovered.check("key0") == false );
+    CPPUNIT_ASSERT( recovered.find("key1") == "tail" );
+    CPPUNIT_ASSERT( recovered.find("key99") == "999" );
+
+    // a checkpoint interrupted after rotation still recovers
+    r.add("key2", "rotated");
+    CPPUNIT_ASSERT( r.rotate() == 0 );
+    r.add("key3", "after");
+    r.close();
+
+    cm_store::journal r2;
+    CPPUNIT_ASSERT( r2.open(base) == 0 );
+    cm_store::info_store<std::string,std::string> recovered2;
+    r2.recover(recovered2);
+    CPPUNIT_ASSERT( recovered2.find("key2") == "rotated" );
+    CPPUNIT_ASSERT( recovered2.find("key3") == "after" );
+    CPPUNIT_ASSERT( r2.checkpoint(recovered2) == 0 );
+    CPPUNIT_ASSERT( access(r2.old_path().c_str(), F_OK) != 0 );
+
+    remove_files(base);
+}
+
+struct checkpoint_writer {
+    cm_store::journal *j;
+    cm_store::sharded_store<std::string,std::string,4> *store;
+    int id;
+};
+
+static void *store_writer(void *arg) {
+    checkpoint_writer *w = (checkpoint_writer *) arg;
+    for(int n = 0; n < 2000; n++) {
+        std::string key = cm_util::format("w%d:%d", w->id, n % 50);
+        if(n % 7 == 6) w->j->remove(*w->store, key);
+        else w->j->set(*w->store, key, cm_util::format("%d", n));
+    }
+    return NULL;
+}
+
+void journalTest::test_journal_checkpoint_writers() {
+
+    std::string base = "journal_checkpoint_writers";
+    remove_files(base);
+    cm_store::journal j;
+    CPPUNIT_ASSERT( j.open(base) == 0 );
+
+    // checkpoints while writers journal and apply changes
+    cm_store::sharded_store<std::string,std::string,4> store;
+    checkpoint_writer writers[4];
+    pthread_t tids[4];
+    for(int n = 0; n < 4; n++) {
+        writers[n] = { &j, &store, n };
+        pthread_create(&tids[n], NULL, store_writer, &writers[n]);
+    }
+    for(int n = 0; n < 20; n++) {
+        CPPUNIT_ASSERT( j.checkpoint(store) == 0 );
+    }
+    for(int n = 0; n < 4; n++) {
+        pthread_join(tids[n], NULL);
+    }
+    CPPUNIT_ASSERT( j.sync() == 0 );
+    j.close();
+
+    // snapshot plus the logs left hold exactly the store
+    cm_store::journal r;
+    CPPUNIT_ASSERT( r.open(base) == 0 );
+    cm_store::info_store<std::string,std::string> recovered;
+    CPPUNIT_ASSERT( r.recover(recovered) > 0 );
+    CPPUNIT_ASSERT( recovered.size() == store.size() );
+    store.for_each([&recovered](const std::string &name, const std::string &value) {
+        CPPUNIT_ASSERT( recovered.find(name) == value );
+    });
+
+    remove_files(base);
+}
+
+// a store that pauses (for up to 100 us) between a change being
+// journaled and applied, so writers of one key overtake each other
+struct pausing_store: public cm_store::sharded_store<std::string,std::string,4> {
+    static void pause(const std::string &s) {
+        timespec delay = {0, (long) (std::hash<std::string>()(s) % 100) * 1000};
+        nanosleep(&delay, NULL);
+    }
+    bool set(const std::string &name, const std::string &value) {
+        pause(value);
+        return sharded_store::set(name, value);
+    }
+    size_t remove(const std::string &name) {
+        pause(name);
+        return sharded_store::remove(name);
+    }
+};
+
+struct same_key_writer {
+    cm_store::journal *j;
+    pausing_store *store;
+    pthread_barrier_t *round;
+    int id;
+};
+
+// each round, every writer changes the same key at once
+static void *same_key_write(void *arg) {
+    same_key_writer *w = (same_key_writer *) arg;
+    for(int n = 0; n < 50; n++) {
+        std::string key = cm_util::format("k%d", n);
+        pthread_barrier_wait(w->round);
+        if(n % 5 == 4 && w->id == 0) w->j->remove(*w->store, key);
+        else w->j->set(*w->store, key, cm_util::format("%d:%d", w->id, n));
+    }
+    return NULL;
+}
+
+void journalTest::test_journal_same_key() {
+
+    std::string base = "journal_same_key";
+    remove_files(base);
+    cm_store::journal j;
+    CPPUNIT_ASSERT( j.open(base) == 0 );
+
+    // writers racing on the same few keys
+    pausing_store store;
+    pthread_barrier_t round;
+    pthread_barrier_init(&round, NULL, 4);
+    same_key_writer writers[4];
+    pthread_t tids[4];
+    for(int n = 0; n < 4; n++) {
+        writers[n] = { &j, &store, &round, n };
+        pthread_create(&tids[n], NULL, same_key_write, &writers[n]);
+    }
+    for(int n = 0; n < 4; n++) {
+        pthread_join(tids[n], NULL);
+    }
+    pthread_barrier_destroy(&round);
+    CPPUNIT_ASSERT( j.sync() == 0 );
+    j.close();
+
+    // the log replays to what the store holds
+    cm_store::journal r;
+    CPPUNIT_ASSERT( r.open(base) == 0 );
+    cm_store::info_store<std::string,std::string> recovered;
+    CPPUNIT_ASSERT( r.recover(recovered) > 0 );
+    CPPUNIT_ASSERT( recovered.size() == store.size() );
+    store.for_each([&recovered](const std::string &name, const std::string &value) {
+        CPPUNIT_ASSERT( recovered.find(name) == value );
+    });
+
+    remove_files(base);
+}
+
+void journalTest::test_journal_torn_tail() {
+
+    std::string base = "journal_torn";
+    remove_files(base);
+    cm_store::journal j;
+    CPPUNIT_ASSERT( j.open(base) == 0 );
+    j.add("a", "1");
+    j.add("b", "2");
+    j.close();
+
+    // simulate a crash part way through a record
+    struct stat st;
+    CPPUNIT_ASSERT( stat(j.log_path().c_str(), &st) == 0 );
+    CPPUNIT_ASSERT( truncate(j.log_path().c_str(), st.st_size - 3) == 0 );
+
+    cm_store::journal r;
+    CPPUNIT_ASSERT( r.open(base) == 0 );
+    r.add("c", "3");
+    r.close();
+
+    cm_store::journal r2;
+    CPPUNIT_ASSERT( r2.open(base) == 0 );
+    cm_store::info_store<std::string,std::string> store;
+    CPPUNIT_ASSERT( r2.recover(store) == 2 );
+    CPPUNIT_ASSERT( store.find("a") == "1" );
+    CPPUNIT_ASSERT( store.check("b") == false );
+    CPPUNIT_ASSERT( store.find("c") == "3" );
+
+    remove_files(base);
+}
@@ -0,0 +1,35 @@
+#ifndef CPP_UNIT_JOURNAL_TEST_H
+#define CPP_UNIT_JOURNAL_TEST_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <string.h>
+#include "journal.h"
+
+
+using namespace std;
+
+class journalTest : public CPPUNIT_NS::TestFixture {
+
+  CPPUNIT_TEST_SUITE( journalTest );
+    CPPUNIT_TEST( test_journal_recover );
+    CPPUNIT_TEST( test_journal_checkpoint );
+    CPPUNIT_TEST( test_journal_checkpoint_writers );
+    CPPUNIT_TEST( test_journal_same_key );
+    CPPUNIT_TEST( test_journal_torn_tail );
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  //void setUp();
+  //void tearDown();
+
+protected:
+    void test_journal_recover();
+    void test_journal_checkpoint();
+    void test_journal_checkpoint_writers();
+    void test_journal_same_key();
+    void test_journal_torn_tail();
+};
+
+
+#endif
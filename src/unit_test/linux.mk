@@ -46,6 +46,10 @@ OBJS =	utilTest.o \
     networkTest.o \
     queueTest.o \
     storeTest.o \
+    flat_mapTest.o \
+    timer_wheelTest.o \
+    journalTest.o \
+    mapped_storeTest.o \
     configTest.o \
     timewatcherTest.o \
     logTest.o \
@@ -63,7 +67,7 @@ CC=g++
 CM_LIB_DIR=../
 INCLUDE = -I. -I$(CM_LIB_DIR) -I/usr/include/libxml2
 LDFLAGS = -m64 -g -lcm_64 -ldl -lcppunit -pthread -lssl -lcrypto -lxml2 -L$(CM_LIB_DIR)
-CCFLAGS = -m64 -g $(INCLUDE) -c -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE64_SOURCE -DASSERT
+CCFLAGS = -m64 -g $(INCLUDE) -c -std=c++2a -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE64_SOURCE -DASSERT
 
 POSIXFLAGS = -D_POSIX_PTHREAD_SEMANTICS -D_REENTRANT
 
@@ -45,6 +45,10 @@ OBJS =	utilTest.o \
     networkTest.o \
     queueTest.o \
     storeTest.o \
+    flat_mapTest.o \
+    timer_wheelTest.o \
+    journalTest.o \
+    mapped_storeTest.o \
     configTest.o \
     timewatcherTest.o \
     logTest.o \
@@ -61,7 +65,7 @@ CC=g++
 CM_LIB_DIR=../
 INCLUDE = -I. -I$(CM_LIB_DIR) -I/usr/include/libxml2
 LDFLAGS = -m$(WORD_SIZE) -g -lcm_$(WORD_SIZE) -ldl -lcppunit -pthread -lssl -lxml2 -L$(CM_LIB_DIR)
-CCFLAGS = -m$(WORD_SIZE) -g $(INCLUDE) -c -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE$(WORD_SIZE)_SOURCE
+CCFLAGS = -m$(WORD_SIZE) -g $(INCLUDE) -c -std=c++2a -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE$(WORD_SIZE)_SOURCE
 
 POSIXFLAGS = -D_POSIX_PTHREAD_SEMANTICS -D_REENTRANT
 
@@ -44,6 +44,10 @@ OBJS =	utilTest.o \
     networkTest.o \
     queueTest.o \
     storeTest.o \
+    flat_mapTest.o \
+    timer_wheelTest.o \
+    journalTest.o \
+    mapped_storeTest.o \
     configTest.o \
     timewatcherTest.o \
     logTest.o \
@@ -60,7 +64,7 @@ CC=g++
 CM_LIB_DIR=../
 INCLUDE = -I. -I$(CM_LIB_DIR)
 LDFLAGS = -g -lcm_ARM -ldl -lcppunit -pthread -lssl -lcrypto -lxml2 -L$(CM_LIB_DIR)
-CCFLAGS = -g $(INCLUDE) -c -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE64_SOURCE
+CCFLAGS = -g $(INCLUDE) -c -std=c++2a -fPIC -D__LINUX_BOX__ -D_REENTRANT -D_LARGEFILE64_SOURCE
 
 POSIXFLAGS = -D_POSIX_PTHREAD_SEMANTICS -D_REENTRANT
 